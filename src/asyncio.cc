@@ -23,7 +23,8 @@ AsyncIOHandler::AsyncIOHandler(S32 noOfEvents,
                                std::string pollerName) : epollFd_(0),
                                                          maxEvents_(noOfEvents),
                                                          stopPoller_(false),
-                                                         name_(pollerName) {
+                                                         name_(pollerName),
+                                                         readyEvents_(noOfEvents) {
     TRACE();
 
 }
@@ -43,122 +44,119 @@ S32 AsyncIOHandler::createPoller() {
     return 0;
 }
 
-S32 AsyncIOHandler::addFd(S32 fd) {
+S32 AsyncIOHandler::addFd(S32 fd, EventHandler handler, bool edgeTriggered) {
     TRACE();
-    auto inputEvent_ = epollEventPtr(new struct epoll_event);
+    auto watch = WatchPtr(new Watch());
 
     // Zeroize struct epoll_event to suppress valgrind warning
-    memset(inputEvent_.get(), 0, sizeof(struct epoll_event));
+    memset(&watch->event, 0, sizeof(struct epoll_event));
 
-    // Poll for input events on inotify fd
-    inputEvent_->events = EPOLLIN;
-    inputEvent_->data.fd = fd;
-
-    watchedEvents_.push_back(inputEvent_);
+    // Poll for input events on fd
+    watch->fd = fd;
+    watch->event.events = EPOLLIN;
+    if (edgeTriggered) {
+        watch->event.events |= EPOLLET;
+    }
+    watch->event.data.ptr = watch.get();
+    watch->handler = handler;
 
     // Need to pass raw pointer to system calls
-    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, inputEvent_.get()) == -1) {
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &watch->event) == -1) {
         LOG(ERROR, "epoll_ctl() : %s", name_.c_str());
         perror("epoll_ctl() : ");
         return -1;
     }
 
+    watches_[fd] = std::move(watch);
+
     LOG(INFO, "Successfully added fd : %s", name_.c_str());
     return 0;
 }
 
-S32 AsyncIOHandler::modifyFd(S32 fd, S32 op) {
+S32 AsyncIOHandler::modifyFd(S32 fd, U32 events) {
     TRACE();
 
-    // Find event with matching fd
-    auto event = std::find_if(watchedEvents_.begin(),
-                              watchedEvents_.end(),
-                              [&](epollEventPtr(e)) {
-                                  return e->data.fd == fd; });
-
-    if (event != watchedEvents_.end()) {
-        if (epoll_ctl(epollFd_, op, (*event)->data.fd, (*event).get()) == -1) {
-            LOG(ERROR, "epoll_ctl() modify failed : %s", name_.c_str());
-            perror("epoll_ctl() modify : ");
-            return -1;
-        }
-        LOG(INFO, "Successfully modified fd %d : %s", fd, name_.c_str());
-        return 0;
-    } else {
+    auto iter = watches_.find(fd);
+    if (iter == watches_.end()) {
         LOG(ERROR, "Failed to modify fd %d : %s", fd, name_.c_str());
         return 1;
     }
+
+    Watch & watch = *iter->second;
+    watch.event.events = events;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &watch.event) == -1) {
+        LOG(ERROR, "epoll_ctl() modify failed : %s", name_.c_str());
+        perror("epoll_ctl() modify : ");
+        return -1;
+    }
+
+    LOG(INFO, "Successfully modified fd %d : %s", fd, name_.c_str());
+    return 0;
 }
 
 S32 AsyncIOHandler::removeFd(S32 fd) {
     TRACE();
 
-    // std::find_if returns iterator to the element matching
-    // predicate else returns end()
-    auto event = std::find_if(watchedEvents_.begin(),
-                              watchedEvents_.end(),
-                              [&](epollEventPtr(e)) {
-                                  return e->data.fd == fd; });
-
-    if (event != watchedEvents_.end()) {
-        watchedEvents_.erase(event, watchedEvents_.end());
-        LOG(INFO, "Successfully removed fd %d : %s", fd, name_.c_str());
-        return 0;
-    } else {
+    auto iter = watches_.find(fd);
+    if (iter == watches_.end()) {
         LOG(ERROR, "fd not found %d : %s", fd, name_.c_str());
         return -1;
     }
+
+    if (epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr) == -1) {
+        LOG(ERROR, "epoll_ctl() delete failed : %s", name_.c_str());
+        perror("epoll_ctl() delete : ");
+    }
+
+    // Events already returned by epoll_wait() may still refer to
+    // this watch, mute it and free it after dispatch
+    iter->second->handler = nullptr;
+    retired_.push_back(std::move(iter->second));
+    watches_.erase(iter);
+
+    LOG(INFO, "Successfully removed fd %d : %s", fd, name_.c_str());
+    return 0;
 }
 
-S32 AsyncIOHandler::watchFds() {
+S32 AsyncIOHandler::watchFds(S32 timeout) {
     TRACE();
-    const S32 max = maxEvents_;
-    struct epoll_event outputEvents_[max];
-
-    memset(&outputEvents_, 0, maxEvents_ * sizeof(struct epoll_event));
 
     LOG(INFO, "Watching %s", name_.c_str());
 
-    if (!stopPoller_) {
-        // Block here waiting for events
-        S32 nfds = epoll_wait(epollFd_, outputEvents_,
-                              maxEvents_, EPOLL_BLOCK_FD);
+    if (stopPoller_) {
+        LOG(INFO, "Poller %s has been stopped", name_.c_str());
+        return 0;
+    }
+
+    // Block here waiting for events
+    S32 nfds = epoll_wait(epollFd_, readyEvents_.data(), maxEvents_, timeout);
 
-        if (nfds == 0) {
-            LOG(INFO, "Waiting for event : %s", name_.c_str());
+    if (nfds == 0) {
+        LOG(INFO, "Waiting for event : %s", name_.c_str());
+        return 0;
+    } else if (nfds == -1) {
+        if (errno == EINTR) {
             return 0;
-        } else if (nfds == -1) {
-            LOG(ERROR, "epoll_pwait() : %s", name_.c_str());
-            perror("epoll_pwait");
-            return -1;
         }
+        LOG(ERROR, "epoll_pwait() : %s", name_.c_str());
+        perror("epoll_pwait");
+        return -1;
+    }
+
+    LOG(INFO, "nfds %d : %s", nfds, name_.c_str());
 
-        LOG(INFO, "nfds %d : %s", nfds, name_.c_str());
-
-        for (S32 idx = 0; idx < nfds; ++idx) {
-            if ((outputEvents_[idx].events & EPOLLERR) ||
-                (outputEvents_[idx].events & EPOLLHUP) ||
-                (!(outputEvents_[idx].events & EPOLLIN))) {
-
-                LOG(INFO, "epoll error : %s", name_.c_str());
-                close(outputEvents_[idx].data.fd);
-                return -1;
-            }
-
-            for (auto & iter : watchedEvents_) {
-                // Read event on watched fd
-                if (outputEvents_[idx].data.fd == iter->data.fd) {
-                    LOG(INFO, "Event triggered on fd %d : %s", iter->data.fd, name_.c_str());
-                    return iter->data.fd;
-                }
-            }
+    // Dispatch all ready events, handlers see EPOLLERR / EPOLLHUP
+    // along with EPOLLIN and decide how to handle them
+    for (S32 idx = 0; idx < nfds; ++idx) {
+        auto watch = static_cast<Watch *>(readyEvents_[idx].data.ptr);
+        if (watch->handler) {
+            LOG(INFO, "Event triggered on fd %d : %s", watch->fd, name_.c_str());
+            watch->handler(readyEvents_[idx].events);
         }
-    } else {
-        LOG(INFO, "Poller %s has been stopped", name_.c_str());
-        return 0;
     }
 
-    return 0;
+    retired_.clear();
+    return nfds;
 }
 
 void AsyncIOHandler::shutdownHandler() {
@@ -17,13 +17,15 @@
 
 #pragma once
 
+#include <errno.h>
 #include <string.h>  // memset
 #include <unistd.h>  // close
 #include <sys/epoll.h>
 
-#include <memory> // std::shared_ptr
+#include <memory> // std::unique_ptr
 #include <vector>
-#include <algorithm> // std::find_if
+#include <functional>
+#include <unordered_map>
 
 #include "logging.hh"
 
@@ -31,23 +33,41 @@ namespace ASIO {
 
 class AsyncIOHandler {
  public:
-    using epollEventPtr = std::shared_ptr<struct epoll_event>;
+    // Called with epoll events (EPOLLIN, EPOLLERR...) ready on fd
+    using EventHandler = std::function<void(U32 events)>;
+
     AsyncIOHandler(S32 noOfEvents, std::string pollerName);
     S32 createPoller();
-    S32 addFd(S32 fd);
+    // Watch fd for input. Edge triggered fds are reported once per
+    // readiness change, so handler must drain fd till EAGAIN
+    S32 addFd(S32 fd, EventHandler handler, bool edgeTriggered = false);
     S32 removeFd(S32 fd);
-    S32 modifyFd(S32 fd, S32 op);
-    S32 watchFds();
+    S32 modifyFd(S32 fd, U32 events);
+    // Wait for events and dispatch every ready fd to its handler.
+    // Returns no. of events dispatched or -1 on error
+    S32 watchFds(S32 timeout = EPOLL_BLOCK_FD);
     void shutdownHandler();
     ~AsyncIOHandler();
 
-    const S32 EPOLL_BLOCK_FD = -1;
+    static const S32 EPOLL_BLOCK_FD = -1;
  private:
+    struct Watch {
+        S32 fd;
+        struct epoll_event event;
+        EventHandler handler;
+    };
+    using WatchPtr = std::unique_ptr<Watch>;
+
     S32 epollFd_;
     S32 maxEvents_;
     bool stopPoller_;
     std::string name_;
-    std::vector<epollEventPtr> watchedEvents_;
+    // epoll_event.data.ptr points to Watch, so no lookup is needed
+    // on dispatch. Removed watches are kept in retired_ till current
+    // dispatch loop is done since later events may still point to them
+    std::unordered_map<S32, WatchPtr> watches_;
+    std::vector<WatchPtr> retired_;
+    std::vector<struct epoll_event> readyEvents_;
 };
 
 }  // namespace ASIO
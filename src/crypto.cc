@@ -15,17 +15,334 @@
  * with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>  // memcpy
+
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>  // setpriority
+
+#include <openssl/bn.h>
+#include <openssl/dh.h>   // EVP_PKEY_CTX_set_dh_pad
+#include <openssl/err.h>
+#include <openssl/crypto.h>  // OPENSSL_cleanse
+#include <openssl/core_names.h>
+#include <openssl/param_build.h>
+
 #include "crypto.hh"
 
 namespace Crypto {
-Cipher::Cipher() {
+
+const std::size_t CIPHER_TYPES = 5;
+// AES key sizes 128 / 192 / 256 bits
+const std::size_t CIPHER_KEY_SIZES = 3;
+// Salt following key in key material of CTR(RFC 5930) and
+// GCM(RFC 5282)
+const U32 CIPHER_SALT_LEN = 4;
+// IV carried in SK payload of CTR / GCM
+const U32 CIPHER_EXPLICIT_IV_LEN = 8;
+const U32 AES_BLOCK_LEN = 16;
+const U32 DES_BLOCK_LEN = 8;
+const U32 GCM_ICV_LEN = 16;
+const U32 GCM_NONCE_LEN = CIPHER_SALT_LEN + CIPHER_EXPLICIT_IV_LEN;
+
+static void
+logSslError(const char * what) {
+    char buf[256];
+    ERR_error_string_n(ERR_peek_last_error(), buf, sizeof(buf));
+    LOG(ERROR, "%s: %s", what, buf);
+    ERR_clear_error();
+}
+
+static std::size_t
+keySizeIdx(U32 keyLen) {
+    switch (keyLen) {
+        case 16:
+            return 0;
+        case 24:
+            return 1;
+        case 32:
+            return 2;
+    }
+    return CIPHER_KEY_SIZES;
+}
+
+// EVP ciphers are looked up once. OpenSSL 3 would otherwise fetch
+// algorithm(under global lock) on every EVP_CipherInit_ex()
+static const EVP_CIPHER *
+evpCipher(Cipher::CipherType type, U32 keyLen) {
+    static const EVP_CIPHER * ciphers[CIPHER_TYPES][CIPHER_KEY_SIZES];
+    static std::once_flag fetched;
+
+    std::call_once(fetched, []() {
+        const char * names[CIPHER_TYPES][CIPHER_KEY_SIZES] = {
+            {nullptr, nullptr, nullptr},
+            {nullptr, "DES-EDE3-CBC", nullptr},
+            {"AES-128-CBC", "AES-192-CBC", "AES-256-CBC"},
+            {"AES-128-CTR", "AES-192-CTR", "AES-256-CTR"},
+            {"AES-128-GCM", "AES-192-GCM", "AES-256-GCM"},
+        };
+        for (std::size_t type = 0; type < CIPHER_TYPES; type++) {
+            for (std::size_t size = 0; size < CIPHER_KEY_SIZES; size++) {
+                if (names[type][size] == nullptr) {
+                    ciphers[type][size] = nullptr;
+                    continue;
+                }
+                ciphers[type][size] = EVP_CIPHER_fetch(nullptr, names[type][size], nullptr);
+                if (ciphers[type][size] == nullptr) {
+                    logSslError(names[type][size]);
+                }
+            }
+        }
+    });
+
+    // Single DES is legacy, not offered
+    std::size_t size = keySizeIdx(keyLen);
+    if (size == CIPHER_KEY_SIZES) {
+        return nullptr;
+    }
+    return ciphers[static_cast<std::size_t>(type)][size];
+}
+
+// Contexts of calling thread, one per transform and direction. Each
+// remembers key it was last initialized with, so consecutive messages
+// of same SA only reset IV and keep expanded key
+struct ThreadCipherCtx {
+    ThreadCipherCtx() {
+        memset(ctx, 0, sizeof(ctx));
+        memset(keyId, 0, sizeof(keyId));
+    }
+    ~ThreadCipherCtx() {
+        for (auto & row : ctx) {
+            for (auto & iter : row) {
+                EVP_CIPHER_CTX_free(iter);
+            }
+        }
+    }
+
+    EVP_CIPHER_CTX * ctx[CIPHER_TYPES][2];
+    U64 keyId[CIPHER_TYPES][2];
+};
+
+static thread_local ThreadCipherCtx threadCipherCtx;
+
+// 0 means not keyed
+static std::atomic<U64> nextKeyId(1);
+
+// Start of class Cipher
+
+Cipher::Cipher(CipherType type, U32 keyLen) : type_(type), keyLen_(keyLen),
+                                              keyId_(0) {
     TRACE();
 }
 
 Cipher::~Cipher() {
     TRACE();
+    if (!key_.empty()) {
+        OPENSSL_cleanse(key_.data(), key_.size());
+    }
+    if (!salt_.empty()) {
+        OPENSSL_cleanse(salt_.data(), salt_.size());
+    }
+}
+
+U32
+Cipher::keyMaterialLen() const {
+    if (type_ == CipherType::AES_CTR || type_ == CipherType::AES_GCM_16) {
+        return keyLen_ + CIPHER_SALT_LEN;
+    }
+    return keyLen_;
+}
+
+U32
+Cipher::ivLen() const {
+    switch (type_) {
+        case CipherType::DES:
+        case CipherType::DES3:
+            return DES_BLOCK_LEN;
+        case CipherType::AES_CBC:
+            return AES_BLOCK_LEN;
+        case CipherType::AES_CTR:
+        case CipherType::AES_GCM_16:
+            return CIPHER_EXPLICIT_IV_LEN;
+    }
+    return 0;
+}
+
+// Counter modes need no padding
+U32
+Cipher::blockSize() const {
+    switch (type_) {
+        case CipherType::DES:
+        case CipherType::DES3:
+            return DES_BLOCK_LEN;
+        case CipherType::AES_CBC:
+            return AES_BLOCK_LEN;
+        case CipherType::AES_CTR:
+        case CipherType::AES_GCM_16:
+            return 1;
+    }
+    return 1;
+}
+
+U32
+Cipher::icvLen() const {
+    return type_ == CipherType::AES_GCM_16 ? GCM_ICV_LEN : 0;
+}
+
+S32
+Cipher::keyIs(const UCHAR * keyMaterial, U32 len) {
+    TRACE();
+    if (evpCipher(type_, keyLen_) == nullptr) {
+        LOG(ERROR, "Cipher %d with %u byte key is not supported",
+            static_cast<S32>(type_), keyLen_);
+        return -1;
+    }
+
+    if (len != keyMaterialLen()) {
+        LOG(ERROR, "Cipher needs %u bytes of key material, got %u", keyMaterialLen(), len);
+        return -1;
+    }
+
+    key_.assign(keyMaterial, keyMaterial + keyLen_);
+    salt_.assign(keyMaterial + keyLen_, keyMaterial + len);
+    // New id, so no thread uses stale key schedule
+    keyId_ = nextKeyId.fetch_add(1);
+
+    return 0;
+}
+
+S32
+Cipher::encrypt(const UCHAR * iv, UCHAR * data, U32 len,
+                const UCHAR * aad, U32 aadLen, UCHAR * icv) {
+    TRACE();
+    return crypt(true, iv, data, len, aad, aadLen, icv);
+}
+
+S32
+Cipher::decrypt(const UCHAR * iv, UCHAR * data, U32 len,
+                const UCHAR * aad, U32 aadLen, const UCHAR * icv) {
+    TRACE();
+    // EVP takes expected tag through non-const ctrl, it is not written
+    return crypt(false, iv, data, len, aad, aadLen, const_cast<UCHAR *>(icv));
 }
 
+S32
+Cipher::crypt(bool enc, const UCHAR * iv, UCHAR * data, U32 len,
+              const UCHAR * aad, U32 aadLen, UCHAR * icv) {
+    if (keyId_ == 0) {
+        LOG(ERROR, "Cipher is not keyed");
+        return -1;
+    }
+
+    if (len % blockSize() != 0) {
+        LOG(ERROR, "Cipher input of %u bytes is not padded to %u", len, blockSize());
+        return -1;
+    }
+
+    const bool aead = type_ == CipherType::AES_GCM_16;
+    if (aead && icv == nullptr) {
+        LOG(ERROR, "Cipher needs ICV buffer");
+        return -1;
+    }
+
+    // IV handed to EVP. CTR counter block is salt | IV | 1(RFC 5930),
+    // GCM nonce is salt | IV(RFC 5282)
+    UCHAR ivBlock[AES_BLOCK_LEN];
+    const UCHAR * evpIv = iv;
+    if (type_ == CipherType::AES_CTR) {
+        memcpy(ivBlock, salt_.data(), CIPHER_SALT_LEN);
+        memcpy(ivBlock + CIPHER_SALT_LEN, iv, CIPHER_EXPLICIT_IV_LEN);
+        ivBlock[12] = 0;
+        ivBlock[13] = 0;
+        ivBlock[14] = 0;
+        ivBlock[15] = 1;
+        evpIv = ivBlock;
+    } else if (aead) {
+        memcpy(ivBlock, salt_.data(), CIPHER_SALT_LEN);
+        memcpy(ivBlock + CIPHER_SALT_LEN, iv, CIPHER_EXPLICIT_IV_LEN);
+        evpIv = ivBlock;
+    }
+
+    const std::size_t type = static_cast<std::size_t>(type_);
+    EVP_CIPHER_CTX *& ctx = threadCipherCtx.ctx[type][enc];
+    U64 & ctxKeyId = threadCipherCtx.keyId[type][enc];
+    if (ctx == nullptr) {
+        ctx = EVP_CIPHER_CTX_new();
+        if (ctx == nullptr) {
+            logSslError("EVP_CIPHER_CTX_new");
+            return -1;
+        }
+    }
+
+    if (ctxKeyId == keyId_) {
+        // Same key as last message on this thread, only IV changes
+        if (EVP_CipherInit_ex(ctx, nullptr, nullptr, nullptr, evpIv, enc) != 1) {
+            logSslError("EVP_CipherInit_ex");
+            ctxKeyId = 0;
+            return -1;
+        }
+    } else {
+        if (EVP_CipherInit_ex(ctx, evpCipher(type_, keyLen_), nullptr,
+                              key_.data(), evpIv, enc) != 1) {
+            logSslError("EVP_CipherInit_ex");
+            ctxKeyId = 0;
+            return -1;
+        }
+        // IKE padding is added / checked by caller
+        EVP_CIPHER_CTX_set_padding(ctx, 0);
+        ctxKeyId = keyId_;
+    }
+
+    int outLen = 0;
+    int finalLen = 0;
+    if (aead && aadLen > 0 &&
+        EVP_CipherUpdate(ctx, nullptr, &outLen, aad, aadLen) != 1) {
+        logSslError("EVP_CipherUpdate");
+        ctxKeyId = 0;
+        return -1;
+    }
+
+    // In place, EVP allows output to be exactly input
+    if (len > 0 && EVP_CipherUpdate(ctx, data, &outLen, data, len) != 1) {
+        logSslError("EVP_CipherUpdate");
+        ctxKeyId = 0;
+        return -1;
+    }
+
+    if (aead && !enc &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, GCM_ICV_LEN, icv) != 1) {
+        logSslError("EVP_CTRL_GCM_SET_TAG");
+        ctxKeyId = 0;
+        return -1;
+    }
+
+    if (EVP_CipherFinal_ex(ctx, data + outLen, &finalLen) != 1) {
+        // For GCM this is ICV mismatch, which is not library error
+        if (aead && !enc) {
+            LOG(ERROR, "Cipher ICV verification failed");
+            ERR_clear_error();
+        } else {
+            logSslError("EVP_CipherFinal_ex");
+        }
+        return -1;
+    }
+
+    if (aead && enc &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, GCM_ICV_LEN, icv) != 1) {
+        logSslError("EVP_CTRL_GCM_GET_TAG");
+        ctxKeyId = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+// End of class Cipher
+
 Hash::Hash() {
     TRACE();
 }
@@ -42,12 +359,506 @@ Hmac::~Hmac() {
     TRACE();
 }
 
-DH::DH() {
+// Uncompressed point prefix, not carried in ECP KE data
+const UCHAR EC_POINT_UNCOMPRESSED = 0x04;
+// Refill thread yields to packet processing
+const S32 DH_REFILL_NICE = 10;
+// Pause after failed key generation before retrying
+const S32 DH_REFILL_RETRY_MS = 1000;
+
+struct DHGroupInfo {
+    DH::Group group;
+    const char * keyType;
+    // Named domain parameters, nullptr for Curve25519
+    const char * groupName;
+    // KE data length
+    U32 keLen;
+};
+
+static const DHGroupInfo dhGroups[DH_GROUPS] = {
+    {DH::Group::MODP2048, "DH", "modp_2048", 256},
+    {DH::Group::MODP3072, "DH", "modp_3072", 384},
+    {DH::Group::ECP256, "EC", "P-256", 64},
+    {DH::Group::ECP384, "EC", "P-384", 96},
+    {DH::Group::CURVE25519, "X25519", nullptr, 32},
+};
+
+static std::size_t
+dhGroupIdx(DH::Group group) {
+    for (std::size_t idx = 0; idx < DH_GROUPS; idx++) {
+        if (dhGroups[idx].group == group) {
+            return idx;
+        }
+    }
+    return DH_GROUPS;
+}
+
+// Key generation contexts of calling thread, one per group. Context
+// keeps fetched algorithm and group, so generating only draws new key
+struct ThreadKeygenCtx {
+    ThreadKeygenCtx() {
+        ctx.fill(nullptr);
+    }
+    ~ThreadKeygenCtx() {
+        for (auto iter : ctx) {
+            EVP_PKEY_CTX_free(iter);
+        }
+    }
+
+    std::array<EVP_PKEY_CTX *, DH_GROUPS> ctx;
+};
+
+static thread_local ThreadKeygenCtx threadKeygenCtx;
+
+// Start of class DH
+
+DH::DH(Group group) : group_(group), pkey_(nullptr) {
     TRACE();
 }
 
 DH::~DH() {
     TRACE();
+    EVP_PKEY_free(pkey_);
+}
+
+S32
+DH::generateParams() {
+    TRACE();
+    std::size_t idx = dhGroupIdx(group_);
+    if (idx == DH_GROUPS) {
+        LOG(ERROR, "DH group %d is not supported", static_cast<S32>(group_));
+        return -1;
+    }
+
+    EVP_PKEY_CTX *& ctx = threadKeygenCtx.ctx[idx];
+    if (ctx != nullptr) {
+        return 0;
+    }
+
+    ctx = EVP_PKEY_CTX_new_from_name(nullptr, dhGroups[idx].keyType, nullptr);
+    if (ctx == nullptr || EVP_PKEY_keygen_init(ctx) != 1) {
+        logSslError("EVP_PKEY_keygen_init");
+        EVP_PKEY_CTX_free(ctx);
+        ctx = nullptr;
+        return -1;
+    }
+
+    if (dhGroups[idx].groupName != nullptr) {
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME,
+                                             const_cast<char *>(dhGroups[idx].groupName), 0),
+            OSSL_PARAM_construct_end(),
+        };
+        if (EVP_PKEY_CTX_set_params(ctx, params) != 1) {
+            logSslError(dhGroups[idx].groupName);
+            EVP_PKEY_CTX_free(ctx);
+            ctx = nullptr;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+S32
+DH::generateKey() {
+    TRACE();
+    if (generateParams() == -1) {
+        return -1;
+    }
+
+    std::size_t idx = dhGroupIdx(group_);
+    EVP_PKEY * pkey = nullptr;
+    if (EVP_PKEY_generate(threadKeygenCtx.ctx[idx], &pkey) != 1) {
+        logSslError("EVP_PKEY_generate");
+        return -1;
+    }
+
+    std::vector<UCHAR> publicKey(dhGroups[idx].keLen);
+    S32 ret = -1;
+    if (group_ == Group::CURVE25519) {
+        std::size_t len = publicKey.size();
+        if (EVP_PKEY_get_raw_public_key(pkey, publicKey.data(), &len) == 1 &&
+            len == publicKey.size()) {
+            ret = 0;
+        }
+    } else if (group_ == Group::ECP256 || group_ == Group::ECP384) {
+        UCHAR point[1 + 2 * 48];
+        std::size_t len = 0;
+        if (EVP_PKEY_get_octet_string_param(pkey, OSSL_PKEY_PARAM_ENCODED_PUBLIC_KEY,
+                                            point, sizeof(point), &len) == 1 &&
+            len == publicKey.size() + 1 && point[0] == EC_POINT_UNCOMPRESSED) {
+            memcpy(publicKey.data(), point + 1, publicKey.size());
+            ret = 0;
+        }
+    } else {
+        BIGNUM * pub = nullptr;
+        if (EVP_PKEY_get_bn_param(pkey, OSSL_PKEY_PARAM_PUB_KEY, &pub) == 1 &&
+            BN_bn2binpad(pub, publicKey.data(), publicKey.size()) ==
+                static_cast<S32>(publicKey.size())) {
+            ret = 0;
+        }
+        BN_free(pub);
+    }
+
+    if (ret == -1) {
+        logSslError("DH public key");
+        EVP_PKEY_free(pkey);
+        return -1;
+    }
+
+    EVP_PKEY_free(pkey_);
+    pkey_ = pkey;
+    publicKey_.swap(publicKey);
+    return 0;
+}
+
+// Build peer's public key from KE data
+static EVP_PKEY *
+peerKey(const DHGroupInfo & info, const UCHAR * peerKe, U32 len) {
+    if (info.group == DH::Group::CURVE25519) {
+        return EVP_PKEY_new_raw_public_key_ex(nullptr, info.keyType, nullptr, peerKe, len);
+    }
+
+    EVP_PKEY_CTX * ctx = EVP_PKEY_CTX_new_from_name(nullptr, info.keyType, nullptr);
+    OSSL_PARAM_BLD * bld = OSSL_PARAM_BLD_new();
+    OSSL_PARAM * params = nullptr;
+    BIGNUM * pub = nullptr;
+    EVP_PKEY * pkey = nullptr;
+    UCHAR point[1 + 2 * 48];
+
+    bool built = ctx != nullptr && bld != nullptr &&
+                 OSSL_PARAM_BLD_push_utf8_string(bld, OSSL_PKEY_PARAM_GROUP_NAME,
+                                                 info.groupName, 0) == 1;
+    const bool modp = info.group == DH::Group::MODP2048 || info.group == DH::Group::MODP3072;
+    if (built && !modp) {
+        point[0] = EC_POINT_UNCOMPRESSED;
+        memcpy(point + 1, peerKe, len);
+        built = OSSL_PARAM_BLD_push_octet_string(bld, OSSL_PKEY_PARAM_PUB_KEY,
+                                                 point, len + 1) == 1;
+    } else if (built) {
+        pub = BN_bin2bn(peerKe, len, nullptr);
+        built = pub != nullptr &&
+                OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_PUB_KEY, pub) == 1;
+    }
+
+    if (built) {
+        params = OSSL_PARAM_BLD_to_param(bld);
+    }
+    if (params != nullptr && EVP_PKEY_fromdata_init(ctx) == 1) {
+        EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_PUBLIC_KEY, params);
+    }
+
+    OSSL_PARAM_free(params);
+    BN_free(pub);
+    OSSL_PARAM_BLD_free(bld);
+    EVP_PKEY_CTX_free(ctx);
+    return pkey;
+}
+
+S32
+DH::computeKey(const UCHAR * peerKe, U32 len, std::vector<UCHAR> & secret) const {
+    TRACE();
+    secret.clear();
+    std::size_t idx = dhGroupIdx(group_);
+    if (pkey_ == nullptr || idx == DH_GROUPS) {
+        LOG(ERROR, "DH key is not generated");
+        return -1;
+    }
+
+    if (len != dhGroups[idx].keLen) {
+        LOG(ERROR, "DH group %d expects %u bytes of KE data, got %u",
+            static_cast<S32>(group_), dhGroups[idx].keLen, len);
+        return -1;
+    }
+
+    EVP_PKEY * peer = peerKey(dhGroups[idx], peerKe, len);
+    if (peer == nullptr) {
+        logSslError("DH peer key");
+        return -1;
+    }
+
+    const bool modp = group_ == Group::MODP2048 || group_ == Group::MODP3072;
+    S32 ret = -1;
+    std::size_t secretLen = 0;
+    EVP_PKEY_CTX * checkCtx = EVP_PKEY_CTX_new_from_pkey(nullptr, peer, nullptr);
+    EVP_PKEY_CTX * ctx = EVP_PKEY_CTX_new_from_pkey(nullptr, pkey_, nullptr);
+    // Reject peer values out of range / off curve(RFC 7296 5.13.1 /
+    // RFC 5903). Curve25519 accepts any 32 bytes
+    if (group_ != Group::CURVE25519 &&
+        (checkCtx == nullptr || EVP_PKEY_public_check_quick(checkCtx) != 1)) {
+        logSslError("DH peer public check");
+    } else if (ctx != nullptr &&
+               EVP_PKEY_derive_init(ctx) == 1 &&
+               // g^ir is zero padded to prime length(RFC 7296 2.14)
+               (!modp || EVP_PKEY_CTX_set_dh_pad(ctx, 1) == 1) &&
+               // Peer is already validated above, skip the full y^q check
+               EVP_PKEY_derive_set_peer_ex(ctx, peer, 0) == 1 &&
+               EVP_PKEY_derive(ctx, nullptr, &secretLen) == 1) {
+        secret.resize(secretLen);
+        if (EVP_PKEY_derive(ctx, secret.data(), &secretLen) == 1) {
+            secret.resize(secretLen);
+            ret = 0;
+        } else {
+            logSslError("EVP_PKEY_derive");
+        }
+    } else {
+        logSslError("EVP_PKEY_derive_init");
+    }
+
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_CTX_free(checkCtx);
+    EVP_PKEY_free(peer);
+
+    // All zero Curve25519 result means peer sent low order point(RFC 8031)
+    if (ret == 0 && group_ == Group::CURVE25519) {
+        UCHAR acc = 0;
+        for (auto byte : secret) {
+            acc |= byte;
+        }
+        if (acc == 0) {
+            LOG(ERROR, "DH Curve25519 shared secret is all zero");
+            ret = -1;
+        }
+    }
+
+    if (ret == -1 && !secret.empty()) {
+        OPENSSL_cleanse(secret.data(), secret.size());
+        secret.clear();
+    }
+
+    return ret;
+}
+
+// End of class DH
+
+// Start of class DHPool
+
+DHPool::DHPool() : depth_(DH_POOL_DEPTH), reuseMs_(0), reuseCount_(0),
+                   stopThread_(false), hits_(0), misses_(0), reuses_(0) {
+    TRACE();
+}
+
+DHPool &
+DHPool::getDHPool() {
+    TRACE();
+    static DHPool dhPool;
+    return dhPool;
+}
+
+void
+DHPool::configure(U32 depth, U32 reuseMs, U32 reuseCount) {
+    TRACE();
+    std::unique_lock<std::mutex> lock(mutex_);
+    depth_ = depth;
+    reuseMs_ = reuseMs;
+    reuseCount_ = reuseCount;
+
+    // Keys beyond new depth are dropped, so depth 0 really turns pool
+    // off. Same for key being reused once reuse is off
+    for (auto & pool : pools_) {
+        while (pool.keys.size() > depth_) {
+            pool.keys.pop_back();
+        }
+        if (reuseMs_ == 0 || reuseCount_ <= 1) {
+            pool.reused.reset();
+        }
+    }
+    refill_.notify_one();
+}
+
+// Called with mutex_ held
+void
+DHPool::reuseIs(GroupPool & pool, const DH::Ptr & key) {
+    if (reuseMs_ == 0 || reuseCount_ <= 1) {
+        return;
+    }
+    pool.reused = key;
+    pool.reusedSince = std::chrono::steady_clock::now();
+    pool.reuseCount = 1;
+}
+
+DH::Ptr
+DHPool::acquire(DH::Group group) {
+    TRACE();
+    std::size_t idx = dhGroupIdx(group);
+    if (idx == DH_GROUPS) {
+        LOG(ERROR, "DH group %d is not supported", static_cast<S32>(group));
+        return nullptr;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        GroupPool & pool = pools_[idx];
+
+        if (pool.reused && pool.reuseCount < reuseCount_ &&
+            std::chrono::steady_clock::now() - pool.reusedSince <
+                std::chrono::milliseconds(reuseMs_)) {
+            pool.reuseCount++;
+            reuses_++;
+            return pool.reused;
+        }
+        pool.reused.reset();
+
+        if (!pool.keys.empty()) {
+            DH::Ptr key = std::move(pool.keys.front());
+            pool.keys.pop_front();
+            reuseIs(pool, key);
+            refill_.notify_one();
+            hits_++;
+            return key;
+        }
+
+        if (depth_ > 0) {
+            refill_.notify_one();
+        }
+    }
+
+    // Pool ran dry, pay for generation on hot path
+    misses_++;
+    DH::Ptr key = std::make_shared<DH>(group);
+    if (key->generateKey() == -1) {
+        return nullptr;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    reuseIs(pools_[idx], key);
+    return key;
+}
+
+std::size_t
+DHPool::ready(DH::Group group) {
+    TRACE();
+    std::size_t idx = dhGroupIdx(group);
+    if (idx == DH_GROUPS) {
+        return 0;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    return pools_[idx].keys.size();
+}
+
+S32
+DHPool::refillLoop() {
+    TRACE();
+    // Only use cpu packet processing leaves idle
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), DH_REFILL_NICE) == -1) {
+        perror("setpriority");
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopThread_) {
+        // Group with fewest ready keys first, so all fill evenly
+        std::size_t idx = DH_GROUPS;
+        for (std::size_t group = 0; group < DH_GROUPS; group++) {
+            if (pools_[group].keys.size() < depth_ &&
+                (idx == DH_GROUPS || pools_[group].keys.size() < pools_[idx].keys.size())) {
+                idx = group;
+            }
+        }
+
+        if (idx == DH_GROUPS) {
+            refill_.wait(lock);
+            continue;
+        }
+
+        lock.unlock();
+        DH::Ptr key = std::make_shared<DH>(dhGroups[idx].group);
+        S32 ret = key->generateKey();
+        lock.lock();
+
+        if (ret == 0) {
+            // Pool may have been shrunk while key was generated
+            if (pools_[idx].keys.size() < depth_) {
+                pools_[idx].keys.push_back(std::move(key));
+            }
+        } else {
+            LOG(ERROR, "DH pool failed to generate key of group %d",
+                static_cast<S32>(dhGroups[idx].group));
+            refill_.wait_for(lock, std::chrono::milliseconds(DH_REFILL_RETRY_MS));
+        }
+    }
+
+    return 0;
+}
+
+void
+DHPool::shutdownHandler() {
+    TRACE();
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopThread_ = true;
+    refill_.notify_all();
+}
+
+// End of class DHPool
+
+static S32
+runJob(AeadJob & job, bool enc) {
+    if (job.cipher == nullptr) {
+        job.result = -1;
+    } else if (enc) {
+        job.result = job.cipher->encrypt(job.iv, job.data, job.len,
+                                         job.aad, job.aadLen, job.icv);
+    } else {
+        job.result = job.cipher->decrypt(job.iv, job.data, job.len,
+                                         job.aad, job.aadLen, job.icv);
+    }
+    return job.result == 0 ? 0 : 1;
+}
+
+// OpenSSL has no multi-buffer GCM outside TLS stitched ciphers, so
+// batch gains come from ordering: jobs of one key run back to back,
+// keeping key schedule / GHASH table in thread's EVP context, and
+// next job's buffers are prefetched while current one is processed
+static S32
+runBatch(std::vector<AeadJob> & jobs, bool enc) {
+    static thread_local std::vector<U32> order;
+    S32 failed = 0;
+
+    order.resize(jobs.size());
+    for (U32 idx = 0; idx < jobs.size(); idx++) {
+        order[idx] = idx;
+    }
+
+    // Stable, so jobs of same key keep their order(e.g. sequence)
+    std::stable_sort(order.begin(), order.end(), [&jobs](U32 lhs, U32 rhs) {
+        const Cipher * left = jobs[lhs].cipher;
+        const Cipher * right = jobs[rhs].cipher;
+        U64 leftKey = left ? left->keyId() : 0;
+        U64 rightKey = right ? right->keyId() : 0;
+        return leftKey < rightKey;
+    });
+
+    for (U32 idx = 0; idx < order.size(); idx++) {
+        if (idx + 1 < order.size()) {
+            const AeadJob & next = jobs[order[idx + 1]];
+            __builtin_prefetch(next.data, 1);
+            __builtin_prefetch(next.aad, 0);
+        }
+        failed += runJob(jobs[order[idx]], enc);
+    }
+
+    return failed;
+}
+
+S32
+CryptoPluginInterface::encryptBatch(std::vector<AeadJob> & jobs) {
+    TRACE();
+    S32 failed = 0;
+    for (auto & job : jobs) {
+        failed += runJob(job, true);
+    }
+    return failed;
+}
+
+S32
+CryptoPluginInterface::decryptBatch(std::vector<AeadJob> & jobs) {
+    TRACE();
+    S32 failed = 0;
+    for (auto & job : jobs) {
+        failed += runJob(job, false);
+    }
+    return failed;
 }
 
 CryptoPluginInterface::CryptoPluginInterface() {
@@ -76,6 +887,20 @@ CryptoppPlugin::~CryptoppPlugin() {
 
 void OpensslPlugin::init() {
     TRACE();
+    // Look up EVP ciphers before first packet needs them
+    evpCipher(Cipher::CipherType::AES_CBC, AES_BLOCK_LEN);
+}
+
+S32
+OpensslPlugin::encryptBatch(std::vector<AeadJob> & jobs) {
+    TRACE();
+    return runBatch(jobs, true);
+}
+
+S32
+OpensslPlugin::decryptBatch(std::vector<AeadJob> & jobs) {
+    TRACE();
+    return runBatch(jobs, false);
 }
 
 void CryptoppPlugin::init() {
@@ -20,20 +20,63 @@
 #include <openssl/evp.h>
 #include <vector>
 #include <map>
+#include <array>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
 
 #include "logging.hh"
 
 namespace Crypto {
 
+// IKEv2 SK payload transforms(RFC 7296, 5930, 5282). Cipher holds
+// key of one direction of SA, EVP contexts are kept per thread and
+// only re-keyed when thread switches to other Cipher
 class Cipher {
  public:
-    enum class CipherType { DES, DES3, AES };
+    enum class CipherType { DES, DES3, AES_CBC, AES_CTR, AES_GCM_16 };
 
-    Cipher();
+    // keyLen is cipher key size in bytes, e.g. 16 / 24 / 32 for AES
+    explicit Cipher(CipherType type = CipherType::AES_CBC, U32 keyLen = 16);
     ~Cipher();
-    S32 encrypt();
-    S32 decrypt();
+
+    // Key material as derived from SKEYSEED. CTR / GCM take 4 byte
+    // salt after key, so keyMaterialLen() = keyLen + 4 for them
+    S32 keyIs(const UCHAR * keyMaterial, U32 len);
+
+    // Encrypt / decrypt len bytes at data in place. iv points at IV
+    // carried in SK payload(ivLen() bytes). CBC needs len to be
+    // multiple of blockSize(), i.e. caller adds IKE padding. For GCM
+    // aad is IKE header up to IV and icv has icvLen() bytes following
+    // ciphertext. decrypt() returns -1 if ICV does not verify
+    S32 encrypt(const UCHAR * iv, UCHAR * data, U32 len,
+                const UCHAR * aad = nullptr, U32 aadLen = 0,
+                UCHAR * icv = nullptr);
+    S32 decrypt(const UCHAR * iv, UCHAR * data, U32 len,
+                const UCHAR * aad = nullptr, U32 aadLen = 0,
+                const UCHAR * icv = nullptr);
+
+    CipherType type() const { return type_; }
+    // Changes with every keyIs(), 0 while not keyed
+    U64 keyId() const { return keyId_; }
+    U32 keyMaterialLen() const;
+    U32 ivLen() const;
+    U32 blockSize() const;
+    U32 icvLen() const;
  private:
+    S32 crypt(bool enc, const UCHAR * iv, UCHAR * data, U32 len,
+              const UCHAR * aad, U32 aadLen, UCHAR * icv);
+
+    CipherType type_;
+    U32 keyLen_;
+    // Identifies key towards per thread contexts, 0 until keyed
+    U64 keyId_;
+    std::vector<UCHAR> key_;
+    // Salt / nonce of CTR and GCM
+    std::vector<UCHAR> salt_;
 };
 
 class Hash {
@@ -49,14 +92,111 @@ class Hmac {
     ~Hmac();
 };
 
+// Ephemeral key pair of one IKEv2 DH group. KE payload formats are
+// RFC 7296(MODP, zero padded to prime length), RFC 5903(ECP, x | y)
+// and RFC 8031(Curve25519)
 class DH {
  public:
-    enum DHGROUPS { DH_GROUP1, DH_GROUP3, DH_GROUP5 };
-    DH();
+    // IANA transform IDs(transform type 4)
+    enum class Group {
+        MODP2048 = 14,
+        MODP3072 = 15,
+        ECP256 = 19,
+        ECP384 = 20,
+        CURVE25519 = 31,
+    };
+    using Ptr = std::shared_ptr<DH>;
+
+    explicit DH(Group group);
     ~DH();
-    S32 generateKey();
-    S32 computeKey();
+    // Set up key generation with group's named domain parameters,
+    // done once per group on each thread
     S32 generateParams();
+    S32 generateKey();
+    // Secret shared with peer's KE data. Key is not modified, so it
+    // may be used by several threads at once(key reuse)
+    S32 computeKey(const UCHAR * peerKe, U32 len, std::vector<UCHAR> & secret) const;
+
+    Group group() const { return group_; }
+    // KE payload data of this key
+    const std::vector<UCHAR> & publicKey() const { return publicKey_; }
+
+    DH(const DH &)=delete;
+    DH & operator=(const DH &)=delete;
+ private:
+    Group group_;
+    EVP_PKEY * pkey_;
+    std::vector<UCHAR> publicKey_;
+};
+
+const std::size_t DH_GROUPS = 5;
+// Keys kept ready per group by default
+const U32 DH_POOL_DEPTH = 16;
+
+// Pregenerated DH keys per group. Refill loop runs on idle crypto
+// thread and tops pools up, so answering IKE_SA_INIT only pops ready
+// key. Optionally one key serves several exchanges within short
+// window(RFC 7296 section 2.12)
+class DHPool final {
+ public:
+    // Daemon shares getDHPool(), own instance is for tests / benches
+    DHPool();
+    static DHPool & getDHPool();
+
+    // depth keys are kept per group, 0 disables pool. Key is reused for
+    // up to reuseCount exchanges within reuseMs, reuseCount <= 1 or
+    // reuseMs 0 disables reuse
+    void configure(U32 depth, U32 reuseMs, U32 reuseCount);
+    // Ready key of group, generated on calling thread if pool is
+    // empty. nullptr if group is not supported or generation failed
+    DH::Ptr acquire(DH::Group group);
+    // No. of ready keys of group
+    std::size_t ready(DH::Group group);
+    // Keeps pools filled until shutdownHandler() is called
+    S32 refillLoop();
+    void shutdownHandler();
+
+    U64 hits() const { return hits_.load(); }
+    U64 misses() const { return misses_.load(); }
+    U64 reuses() const { return reuses_.load(); }
+
+    DHPool(const DHPool &)=delete;
+    DHPool & operator=(const DHPool &)=delete;
+ private:
+    struct GroupPool {
+        GroupPool() : reuseCount(0) {}
+        std::deque<DH::Ptr> keys;
+        // Key currently handed out again, since when and how often
+        DH::Ptr reused;
+        std::chrono::steady_clock::time_point reusedSince;
+        U32 reuseCount;
+    };
+
+    void reuseIs(GroupPool & pool, const DH::Ptr & key);
+
+    std::mutex mutex_;
+    std::condition_variable refill_;
+    std::array<GroupPool, DH_GROUPS> pools_;
+    U32 depth_;
+    U32 reuseMs_;
+    U32 reuseCount_;
+    bool stopThread_;
+    std::atomic<U64> hits_;
+    std::atomic<U64> misses_;
+    std::atomic<U64> reuses_;
+};
+
+// One SK payload of encrypt / decrypt batch. Buffers are processed in
+// place, result is set to 0 or -1 for each job
+struct AeadJob {
+    Cipher * cipher;
+    const UCHAR * iv;
+    const UCHAR * aad;
+    U32 aadLen;
+    UCHAR * data;
+    U32 len;
+    UCHAR * icv;
+    S32 result;
 };
 
 // This class is abstract base class for cryto library.
@@ -70,6 +210,10 @@ class CryptoPluginInterface {
     std::map<S32, DH> diffieHellmanGrps;
  public:
     virtual void init()=0;
+    // Process jobs(e.g. all SK payloads of one receive batch) in one
+    // call. Returns no. of failed jobs. Default runs them one by one
+    virtual S32 encryptBatch(std::vector<AeadJob> & jobs);
+    virtual S32 decryptBatch(std::vector<AeadJob> & jobs);
     CryptoPluginInterface();
     virtual ~CryptoPluginInterface();
 };
@@ -77,6 +221,10 @@ class CryptoPluginInterface {
 class OpensslPlugin : public CryptoPluginInterface {
  public:
     void init();
+    // Jobs are run grouped by key, so EVP context of each key is set
+    // up once per batch instead of once per job
+    S32 encryptBatch(std::vector<AeadJob> & jobs);
+    S32 decryptBatch(std::vector<AeadJob> & jobs);
     OpensslPlugin();
     ~OpensslPlugin();
 };
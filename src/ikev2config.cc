@@ -70,8 +70,72 @@ Config::confFilePresent() {
     return access(IKEV2_CONF_FILE, F_OK) != -1;
 }
 
+// Parse "key = value" lines from config file. Lines starting
+// with '#' are treated as comments
 S32
-Config::confFileWatcher() {
+Config::loadConfFile() {
+    TRACE();
+
+    std::ifstream confFile(IKEV2_CONF_FILE);
+    if (!confFile.is_open()) {
+        LOG(ERROR, "Failed to open %s", IKEV2_CONF_FILE);
+        return -1;
+    }
+
+    std::string line;
+    while (std::getline(confFile, line)) {
+        boost::trim(line);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        auto pos = line.find('=');
+        if (pos == std::string::npos) {
+            LOG(ERROR, "Ignoring malformed config line : %s", line.c_str());
+            continue;
+        }
+
+        std::string key = boost::trim_copy(line.substr(0, pos));
+        std::string val = boost::trim_copy(line.substr(pos + 1));
+        confValues_[key] = val;
+        LOG(INFO, "Config %s = %s", key.c_str(), val.c_str());
+    }
+
+    return 0;
+}
+
+std::string
+Config::value(const std::string & key,
+              const std::string & defaultValue) const {
+    TRACE();
+    auto iter = confValues_.find(key);
+    if (iter == confValues_.end()) {
+        return defaultValue;
+    }
+    return iter->second;
+}
+
+S32
+Config::intValue(const std::string & key, S32 defaultValue) const {
+    TRACE();
+    auto iter = confValues_.find(key);
+    if (iter == confValues_.end()) {
+        return defaultValue;
+    }
+
+    try {
+        return std::stoi(iter->second);
+    } catch (const std::exception & e) {
+        LOG(ERROR, "Invalid value for %s : %s", key.c_str(),
+            iter->second.c_str());
+        return defaultValue;
+    }
+}
+
+// Read and handle pending inotify events on config file.
+// Returns -1 if daemon has to shutdown
+S32
+Config::handleInotifyEvents() {
     TRACE();
     S32 buffLength;
     char *ptr;
@@ -79,6 +143,48 @@ Config::confFileWatcher() {
     //__attribute__((aligned(__alignof__(EVENT_SIZE))));
     struct inotify_event *event;
 
+    // Read event
+    buffLength = read(inotifyFd_, buffer, INOTIFY_BUFFER_LEN);
+
+    if (buffLength == -1) {
+        LOG(ERROR, "read()");
+        perror("read()");
+        return -1;  // XXX return or continue?
+    }
+
+    LOG(INFO, "Read %d bytes from inotify fd", buffLength);
+
+    for (ptr = buffer ; ptr < buffer + buffLength ;) {
+        event = (struct inotify_event *)ptr;
+        LOG(INFO, "event->mask %x event->len %d",
+                event->mask, event->len);
+
+        // File create event
+        if (event->mask & IN_CREATE) {
+            LOG(INFO, "%s was created", IKEV2_CONF_FILE);
+        // File delete event
+        } else if (event->mask & IN_DELETE_SELF) {
+            LOG(INFO, "%s has been deleted", IKEV2_CONF_FILE);
+            LOGT("%s has been deleted", IKEV2_CONF_FILE);
+            LOGT("IKEv2 will shutdown now");
+
+            return -1;
+        // File modified event
+        } else if (event->mask & IN_MODIFY) {
+            LOG(INFO, "%s was modified", IKEV2_CONF_FILE);
+            // XXX Need to reload daemon
+        }
+        ptr += EVENT_SIZE + event->len;
+    }  // end of for (p = buffer)...
+
+    return 0;
+}
+
+S32
+Config::confFileWatcher() {
+    TRACE();
+    S32 status = 0;
+
     if (!confFilePresent()) {
         LOGT("%s does not exist", IKEV2_CONF_FILE);
         return -1;
@@ -108,7 +214,13 @@ Config::confFileWatcher() {
         return -1;
     }
 
-    if (asioHdl_.addFd(inotifyFd_) == -1) {
+    auto inotifyHandler = [&](U32 events) {
+        if (handleInotifyEvents() == -1) {
+            status = -1;
+        }
+    };
+
+    if (asioHdl_.addFd(inotifyFd_, inotifyHandler) == -1) {
         return -1;
     }
 
@@ -121,56 +233,24 @@ Config::confFileWatcher() {
         return -1;
     }
 
-    if (asioHdl_.addFd(eventFd_) == -1) {
+    auto stopHandler = [&](U32 events) {
+        if (eventNotifier_.readEvent(STOP_CFG_THREAD)) {
+            LOG(INFO, "Cfg thread received stop event");
+            stopThread_ = true;
+        }
+    };
+
+    if (asioHdl_.addFd(eventFd_, stopHandler) == -1) {
         return -1;
     }
 
     // Main thread loop
     while (true) {
-         if (!stopThread_) {
-            // Block here waiting for event
-            S32 polledFd = asioHdl_.watchFds();
-            if (polledFd == inotifyFd_) {
-                // Read event
-                buffLength = read(inotifyFd_, buffer, INOTIFY_BUFFER_LEN);
-
-                if (buffLength == -1) {
-                    LOG(ERROR, "read()");
-                    perror("read()");
-                    return -1;  // XXX return or continue?
-                }
-
-                LOG(INFO, "Read %d bytes from inotify fd", buffLength);
-
-                for (ptr = buffer ; ptr < buffer + buffLength ;) {
-                    event = (struct inotify_event *)ptr;
-                    LOG(INFO, "event->mask %x event->len %d",
-                            event->mask, event->len);
-
-                    // File create event
-                    if (event->mask & IN_CREATE) {
-                        LOG(INFO, "%s was created", IKEV2_CONF_FILE);
-                    // File delete event
-                    } else if (event->mask & IN_DELETE_SELF) {
-                        LOG(INFO, "%s has been deleted", IKEV2_CONF_FILE);
-                        LOGT("%s has been deleted", IKEV2_CONF_FILE);
-                        LOGT("IKEv2 will shutdown now");
-
-                        return -1;
-                    // File modified event
-                    } else if (event->mask & IN_MODIFY) {
-                        LOG(INFO, "%s was modified", IKEV2_CONF_FILE);
-                        // XXX Need to reload daemon
-                    }
-                    ptr += EVENT_SIZE + event->len;
-                }  // end of for (p = buffer)...
-            } else if (polledFd == eventFd_) {
-                if (eventNotifier_.readEvent(STOP_CFG_THREAD)) {
-                    LOG(INFO, "Cfg thread received stop event");
-                    stopThread_ = true;
-                }
-            } else {
-                LOG(ERROR, "Unknown fd polled %d", polledFd);
+        if (!stopThread_) {
+            // Block here waiting for events, all ready fds are
+            // handled before returning
+            if (asioHdl_.watchFds() == -1 || status == -1) {
+                return -1;
             }
         } else {
             LOG(INFO, "Cfg thread stopped" );
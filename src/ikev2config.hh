@@ -22,6 +22,11 @@
 #include <sys/inotify.h>
 #include <sys/stat.h>   // open
 
+#include <map>
+#include <string>
+#include <fstream>
+#include <boost/algorithm/string.hpp>
+
 #include "logging.hh"
 #include "threadpool.hh"
 #include "synchro.hh"
@@ -37,7 +42,13 @@ class Config {
     Config();
     ~Config();
     S32 confFilePresent();
+    S32 loadConfFile();
     S32 confFileWatcher();
+    // Values read from config file, defaultValue is returned
+    // if key is absent or value is malformed
+    std::string value(const std::string & key,
+                      const std::string & defaultValue) const;
+    S32 intValue(const std::string & key, S32 defaultValue) const;
     void shutdown();
     Synchro::Notifier & eventNotifier();
     static const S32 STOP_CFG_THREAD = 1;
@@ -48,12 +59,15 @@ class Config {
     const S32 INOTIFY_BUFFER_LEN = (CFG_MAX_EVENTS + 1)* EVENT_SIZE;
     const S32 INODE_EVENTS = IN_MODIFY | IN_CREATE | IN_DELETE;
  private:
+    S32 handleInotifyEvents();
+
     S32 inotifyFd_;
     S32 inotifyWd_;
     S32 eventFd_;
     bool stopThread_; // Tell ConfFileWatcher thread to stop
     Synchro::Notifier eventNotifier_;
     ASIO::AsyncIOHandler asioHdl_;
+    std::map<std::string, std::string> confValues_;
 };
 
 }  // namespace IKEv2
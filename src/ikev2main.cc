@@ -28,6 +28,7 @@
 #include "network.hh"
 #include "ikev2config.hh"
 #include "threadpool.hh"
+#include "servicethread.hh"
 #include "crypto.hh"
 #include "exception.hh"
 #include "utils.hh"
@@ -56,25 +57,110 @@ IKEv2::Config cfgHandler;
 std::vector<Network::UdpEndpoint4> udpEndpoints4;
 std::vector<Network::UdpEndpoint6> udpEndpoints6;
 
+// Per core shards, used only when sharded mode is enabled
+std::vector<Network::Shard4::Ptr> shards4;
+std::vector<Network::Shard6::Ptr> shards6;
+
+// Every endless loop of daemon runs on its own service thread
+std::vector<IKEv2::ServiceThread::Ptr> services;
+
+// Msec between checks for service threads which died
+const S32 SERVICE_HEALTH_INTERVAL = 10000;
+
+// Start loop on named thread pinned to cpus of role
+static IKEv2::ServiceThread &
+startService(const std::string & name, IKEv2::ThreadRole role, S32 index,
+             IKEv2::ServiceThread::Loop loop,
+             IKEv2::ServiceThread::StopHandler stopHandler = nullptr) {
+    services.push_back(IKEv2::ServiceThread::Ptr(
+                            new IKEv2::ServiceThread(name, role, index, std::move(loop))));
+    services.back()->stopHandlerIs(std::move(stopHandler));
+    services.back()->start();
+    return *services.back();
+}
+
+static void checkServices() {
+    for (auto & iter : services) {
+        if (!iter->healthy()) {
+            LOG(ERROR, "Service %s is %s, exit code %d", iter->name().c_str(),
+                IKEv2::ServiceThread::stateName(iter->state()), iter->exitCode());
+        }
+    }
+}
+
 void cleanup(int status) {
-    // Cleanup config thread
-    cfgHandler.eventNotifier().notify(IKEv2::Config::STOP_CFG_THREAD);
+    // Stop config watcher, timer and network loops. Session handlers
+    // and send loops stop once their queues are shut down below
+    for (auto & iter : services) {
+        iter->stop();
+    }
 
-    asyncTimer.shutdownHandler();
+    for (auto & iter : shards4) {
+        LOG(INFO, "IPv4: Shard %u steering misses %lu", iter->id, iter->steeringMisses);
+        LOG(INFO, "IPv4: Shard %u queue drops overflow %lu evicted %lu new session %lu",
+            iter->id, iter->rcvQ.overflowDrops(), iter->rcvQ.evictions(),
+            iter->rcvQ.newSessionDrops());
+        iter->timer.shutdownHandler();
+        iter->rcvQ.shutdown();
+    }
+
+    for (auto & iter : shards6) {
+        LOG(INFO, "IPv6: Shard %u steering misses %lu", iter->id, iter->steeringMisses);
+        LOG(INFO, "IPv6: Shard %u queue drops overflow %lu evicted %lu new session %lu",
+            iter->id, iter->rcvQ.overflowDrops(), iter->rcvQ.evictions(),
+            iter->rcvQ.newSessionDrops());
+        iter->timer.shutdownHandler();
+        iter->rcvQ.shutdown();
+    }
 
     // Cleanup session managers
     Network::IKEv2SessionManager4::getIKEv2SessionManager4().shutdown();
     Network::IKEv2SessionManager6::getIKEv2SessionManager6().shutdown();
 
-    // Cleanup nw threads
+    // Endpoint stats are only logged, skip them when LOG is compiled out
+#ifdef IKEV2_DBG
     for (auto & iter : udpEndpoints4) {
-        iter.eventNotifier().notify(Network::STOP_NW_THREAD);
+        LOG(INFO, "IPv4: Average receive batch size %.2f", iter.avgRcvBatchSize());
+        LOG(INFO, "IPv4: Datagrams dropped on send %lu", iter.sendDrops());
+        LOG(INFO, "IPv4: Syscalls per datagram %.3f", iter.syscallsPerDatagram());
     }
 
     for (auto & iter : udpEndpoints6) {
-        iter.eventNotifier().notify(Network::STOP_NW_THREAD);
+        LOG(INFO, "IPv6: Average receive batch size %.2f", iter.avgRcvBatchSize());
+        LOG(INFO, "IPv6: Datagrams dropped on send %lu", iter.sendDrops());
+        LOG(INFO, "IPv6: Syscalls per datagram %.3f", iter.syscallsPerDatagram());
+    }
+#endif
+
+    for (auto & iter : services) {
+        iter->join();
+        LOG(INFO, "Service %s %s, exit code %d, up %lu ms", iter->name().c_str(),
+            IKEv2::ServiceThread::stateName(iter->state()), iter->exitCode(),
+            iter->uptimeMs());
     }
 
+    // Time tasks waited in each thread pool lane before running
+#ifdef IKEV2_DBG
+    for (std::size_t idx = 0 ; idx < IKEv2::LANES ; idx++) {
+        auto lane = static_cast<IKEv2::Lane>(idx);
+        auto stats = IKEv2::ThreadPool::getThreadPool().laneStats(lane);
+        LOG(INFO, "Pool lane %s tasks %lu queue wait avg %lu ns max %lu ns",
+            IKEv2::laneName(lane), stats.tasks,
+            stats.tasks ? stats.totalWaitNs / stats.tasks : 0, stats.maxWaitNs);
+    }
+#endif
+
+    // Slab count stays flat once pools are warm
+    LOG(INFO, "IPv4: Packet pool slabs %lu", Network::PeerData4::pool().slabs());
+    LOG(INFO, "IPv6: Packet pool slabs %lu", Network::PeerData6::pool().slabs());
+
+#ifdef IKEV2_DBG
+    // Misses are IKE_SA_INIT requests which generated DH keys inline
+    auto & dhPool = Crypto::DHPool::getDHPool();
+    LOG(INFO, "DH pool hits %lu misses %lu reuses %lu", dhPool.hits(),
+        dhPool.misses(), dhPool.reuses());
+#endif
+
     // Cleanup crypto plugin
     if (cryptoPlugin) {
         LOG(INFO, "Cleaning up cryptoPlugin");
@@ -150,62 +236,215 @@ int main(int argc, char *argv[]) {
     // Set random seed to ensure truely random numbers
     std::srand(std::time(0));
 
-    // Run config task to read and handle config file changes
-    std::vector<std::future<int>> results;
-    results.push_back(ENQUEUE_TASK(&IKEv2::Config::confFileWatcher, &cfgHandler));
+    // Load tunables before any endpoint is created
+    cfgHandler.loadConfFile();
+    cryptoPlugin->init();
+
+    const U32 rcvBatchSize = cfgHandler.intValue("network.rcv_batch_size",
+                                                 Network::NW_RCV_BATCH_SIZE);
+    const U32 sendBatchSize = cfgHandler.intValue("network.send_batch_size",
+                                                  Network::NW_SEND_BATCH_SIZE);
+    // Queue bounds and what to shed once high-water mark is hit
+    const U32 queueCapacity = cfgHandler.intValue("network.queue_capacity",
+                                                  QUEUE_CAPACITY);
+    const U32 queueHighWater = cfgHandler.intValue("network.queue_high_water",
+                                                   QUEUE_HIGH_WATER);
+    const auto queuePolicy = overflowPolicyFromString(
+                                    cfgHandler.value("network.queue_policy", ""),
+                                    OverflowPolicy::PREFER_EXISTING);
+    const auto ioBackend = ASIO::IOBackend::typeFromString(
+                                    cfgHandler.value("network.io_backend", "epoll"));
+    // Let idle timers of sessions coalesce / spread out
+    const S32 timerSlack = cfgHandler.intValue("session.timer_slack",
+                                               Network::SESSION_TIMER_SLACK);
+    const S32 timerSpread = cfgHandler.intValue("session.timer_spread", 0);
+    // Ephemeral DH keys pregenerated per group, optionally reused
+    const U32 dhPoolDepth = cfgHandler.intValue("crypto.dh_pool_depth",
+                                                Crypto::DH_POOL_DEPTH);
+    const U32 dhReuseMs = cfgHandler.intValue("crypto.dh_reuse_ms", 0);
+    const U32 dhReuseCount = cfgHandler.intValue("crypto.dh_reuse_count", 0);
+
+    // In sharded mode each core runs its own socket, queue, session
+    // map and timer. Otherwise endpoints feed global queues which
+    // are served by session manager threads
+    const bool sharded = cfgHandler.intValue("network.sharded", 0) != 0;
+    const U32 shardCount = cfgHandler.intValue("network.shards",
+                                               std::max(1U, std::thread::hardware_concurrency()));
+
+    // Pin each kind of thread to its own cpus, unset roles float
+    auto & threadPool = IKEv2::ThreadPool::getThreadPool();
+    for (std::size_t idx = 0 ; idx < IKEv2::THREAD_ROLES ; idx++) {
+        auto role = static_cast<IKEv2::ThreadRole>(idx);
+        std::string cpuList = cfgHandler.value(std::string("affinity.") +
+                                               IKEv2::threadRoleName(role), "");
+        if (!cpuList.empty()) {
+            threadPool.cpuSetIs(role, cpuList);
+        }
+    }
+    threadPool.placementReport();
+
+    // Run config task to read and handle config file changes. It
+    // is housekeeping, so it shares timer cpus
+    startService("config", IKEv2::ThreadRole::TIMER, -1,
+                 []() { return cfgHandler.confFileWatcher(); },
+                 []() { cfgHandler.eventNotifier().notify(IKEv2::Config::STOP_CFG_THREAD); });
 
     // Start async timer loop
-    results.push_back(ENQUEUE_TASK(&Timer::AsyncTimer::timerLoop, &asyncTimer));
+    startService("timer", IKEv2::ThreadRole::TIMER, -1,
+                 []() { return asyncTimer.timerLoop(); },
+                 []() { asyncTimer.shutdownHandler(); });
+
+    // Refill DH key pools in background on crypto cpus
+    Crypto::DHPool::getDHPool().configure(dhPoolDepth, dhReuseMs, dhReuseCount);
+    if (dhPoolDepth > 0) {
+        startService("dhpool", IKEv2::ThreadRole::CRYPTO, -1,
+                     []() { return Crypto::DHPool::getDHPool().refillLoop(); },
+                     []() { Crypto::DHPool::getDHPool().shutdownHandler(); });
+    }
 
     auto ikev2SessionMgr4 = Network::IKEv2SessionManager4::getIKEv2SessionManager4();
     auto ikev2SessionMgr6 = Network::IKEv2SessionManager6::getIKEv2SessionManager6();
 
-    for (std::size_t _ = 0 ; _ < MAX_IPV4_SESSION_HANDLER_THREADS ; _++) {
-        results.push_back(ENQUEUE_TASK(&Network::IKEv2SessionManager4::handleSession, &ikev2SessionMgr4));
-    }
-
-    for (std::size_t _ = 0 ; _ < MAX_IPV6_SESSION_HANDLER_THREADS ; _++) {
-        results.push_back(ENQUEUE_TASK(&Network::IKEv2SessionManager6::handleSession, &ikev2SessionMgr6));
+    Network::configureQueues(queueCapacity, queueHighWater, queuePolicy);
+    Network::configureSessionTimers(timerSlack, timerSpread);
+
+    if (sharded) {
+        LOGT("Running %u shards", shardCount);
+        for (U32 id = 0 ; id < shardCount ; id++) {
+            // Built on shard's own cpu, so first touch puts queue,
+            // timer wheel and maps on shard's NUMA node
+            threadPool.runPinned(IKEv2::ThreadRole::NETWORK, id, [&]() {
+                shards4.push_back(Network::Shard4::Ptr(new Network::Shard4(id, shardCount)));
+                shards6.push_back(Network::Shard6::Ptr(new Network::Shard6(id, shardCount)));
+                shards4.back()->rcvQ.configure(queueCapacity, queueHighWater, queuePolicy);
+                shards4.back()->rcvQ.classifierIs(Network::isNewSession<Network::PeerData4>);
+                shards6.back()->rcvQ.configure(queueCapacity, queueHighWater, queuePolicy);
+                shards6.back()->rcvQ.classifierIs(Network::isNewSession<Network::PeerData6>);
+            });
+            udpEndpoints4.push_back(Network::UdpEndpoint4(SERVER_ADDR4, IKEV2_UDP_PORT));
+            udpEndpoints6.push_back(Network::UdpEndpoint6(SERVER_ADDR6, IKEV2_UDP_PORT));
+        }
+    } else {
+        for (std::size_t idx = 0 ; idx < MAX_IPV4_SESSION_HANDLER_THREADS ; idx++) {
+            startService("session4-" + std::to_string(idx), IKEv2::ThreadRole::SESSION, -1,
+                         [&]() { return ikev2SessionMgr4.handleSession(); });
+        }
+
+        for (std::size_t idx = 0 ; idx < MAX_IPV6_SESSION_HANDLER_THREADS ; idx++) {
+            startService("session6-" + std::to_string(idx), IKEv2::ThreadRole::SESSION, -1,
+                         [&]() { return ikev2SessionMgr6.handleSession(); });
+        }
+
+        // Create v4 / v6 endpoints to receive / send packets
+        for (std::size_t _ = 0 ; _ < MAX_IPV4_PKTQ_THREADS ; _++) {
+            udpEndpoints4.push_back(Network::UdpEndpoint4(SERVER_ADDR4, IKEV2_UDP_PORT));
+        }
+
+        for (std::size_t _ = 0 ; _ < MAX_IPV6_PKTQ_THREADS ; _++) {
+            udpEndpoints6.push_back(Network::UdpEndpoint6(SERVER_ADDR6, IKEV2_UDP_PORT));
+        }
     }
 
-    // Create v4 / v6 endpoints to receive / send packets
-    for (std::size_t _ = 0 ; _ < MAX_IPV4_PKTQ_THREADS ; _++) {
-        udpEndpoints4.push_back(Network::UdpEndpoint4(SERVER_ADDR4, IKEV2_UDP_PORT));
+    // Create and bind socket to start sending / receiving. Shard
+    // sockets are bound in shard order
+    U32 failedEndpoints = 0;
+    for (std::size_t idx = 0 ; idx < udpEndpoints4.size() ; idx++) {
+        auto & iter = udpEndpoints4[idx];
+        iter.rcvBatchSizeIs(rcvBatchSize);
+        iter.sendBatchSizeIs(sendBatchSize);
+        iter.ioBackendIs(ioBackend);
+        if (sharded) {
+            iter.reusePortIs(true);
+            iter.shardIs(shards4[idx].get());
+        }
+        if (iter.initUdpEndpoint() == -1) {
+            LOG(ERROR, "IPv4: Failed to set up endpoint %zu", idx);
+            failedEndpoints++;
+        }
     }
 
-    for (std::size_t _ = 0 ; _ < MAX_IPV6_PKTQ_THREADS ; _++) {
-        udpEndpoints6.push_back(Network::UdpEndpoint6(SERVER_ADDR6, IKEV2_UDP_PORT));
+    for (std::size_t idx = 0 ; idx < udpEndpoints6.size() ; idx++) {
+        auto & iter = udpEndpoints6[idx];
+        iter.rcvBatchSizeIs(rcvBatchSize);
+        iter.sendBatchSizeIs(sendBatchSize);
+        iter.ioBackendIs(ioBackend);
+        if (sharded) {
+            iter.reusePortIs(true);
+            iter.shardIs(shards6[idx].get());
+        }
+        if (iter.initUdpEndpoint() == -1) {
+            LOG(ERROR, "IPv6: Failed to set up endpoint %zu", idx);
+            failedEndpoints++;
+        }
     }
 
-    // Create and bind socket to start sending / receiving
-    for (auto & iter : udpEndpoints4) {
-       iter.initUdpEndpoint();
+    // Reuseport group index is shard no., so one missing socket would
+    // send every later shard's SAs to its neighbour, and its shard
+    // would run on dead fd
+    if (sharded && failedEndpoints > 0) {
+        LOG(ERROR, "%u shard endpoints failed, not starting", failedEndpoints);
+        cleanup(EXIT_FAILURE);
     }
 
-    for (auto & iter : udpEndpoints6) {
-        iter.initUdpEndpoint();
+    // Program is shared by whole SO_REUSEPORT group so attaching it
+    // to first socket is enough
+    if (sharded && cfgHandler.intValue("network.spi_steering", 1) != 0) {
+        if (!udpEndpoints4.empty()) {
+            udpEndpoints4.front().attachSpiSteering(shardCount);
+        }
+        if (!udpEndpoints6.empty()) {
+            udpEndpoints6.front().attachSpiSteering(shardCount);
+        }
     }
 
-    // Create multiple UdpEndpoint to handle same fd
-    // Unique epoll instance in each thread
-
-    // Now for each udp endpoint created start receive and send thread
-    for (auto & iter : udpEndpoints4) {
-        results.push_back(ENQUEUE_TASK(&Network::UdpEndpoint4::receive, &iter));
-        results.push_back(ENQUEUE_TASK(&Network::UdpEndpoint4::send, &iter));
+    if (sharded) {
+        // Single run-to-completion loop per shard, shard timers
+        // expire in same loop
+        for (std::size_t idx = 0 ; idx < shardCount ; idx++) {
+            auto & endpoint4 = udpEndpoints4[idx];
+            auto & endpoint6 = udpEndpoints6[idx];
+            startService("shard4-" + std::to_string(idx), IKEv2::ThreadRole::NETWORK, idx,
+                         [&endpoint4]() { return endpoint4.runShard(); },
+                         [&endpoint4]() { endpoint4.eventNotifier().notify(Network::STOP_NW_THREAD); });
+            startService("shard6-" + std::to_string(idx), IKEv2::ThreadRole::NETWORK, idx,
+                         [&endpoint6]() { return endpoint6.runShard(); },
+                         [&endpoint6]() { endpoint6.eventNotifier().notify(Network::STOP_NW_THREAD); });
+        }
+    } else {
+        // Create multiple UdpEndpoint to handle same fd
+        // Unique epoll instance in each thread
+
+        // Now for each udp endpoint created start receive and send thread
+        for (std::size_t idx = 0 ; idx < udpEndpoints4.size() ; idx++) {
+            auto & endpoint = udpEndpoints4[idx];
+            startService("recv4-" + std::to_string(idx), IKEv2::ThreadRole::NETWORK, -1,
+                         [&endpoint]() { return endpoint.receive(); },
+                         [&endpoint]() { endpoint.eventNotifier().notify(Network::STOP_NW_THREAD); });
+            startService("send4-" + std::to_string(idx), IKEv2::ThreadRole::NETWORK, -1,
+                         [&endpoint]() { return endpoint.send(); });
+        }
+
+        for (std::size_t idx = 0 ; idx < udpEndpoints6.size() ; idx++) {
+            auto & endpoint = udpEndpoints6[idx];
+            startService("recv6-" + std::to_string(idx), IKEv2::ThreadRole::NETWORK, -1,
+                         [&endpoint]() { return endpoint.receive(); },
+                         [&endpoint]() { endpoint.eventNotifier().notify(Network::STOP_NW_THREAD); });
+            startService("send6-" + std::to_string(idx), IKEv2::ThreadRole::NETWORK, -1,
+                         [&endpoint]() { return endpoint.send(); });
+        }
     }
 
-    for (auto & iter : udpEndpoints6) {
-        results.push_back(ENQUEUE_TASK(&Network::UdpEndpoint6::receive, &iter));
-        results.push_back(ENQUEUE_TASK(&Network::UdpEndpoint6::send, &iter));
-    }
+    // Report service threads which died on their own
+    ENQUEUE_TIMER_TASK(SERVICE_HEALTH_INTERVAL, true, checkServices);
 
     // There will be only one receive thread / main thread for port 500
     // XXX Can multiple threads work for same fd?
 
     // Wait for all threads to complete
-    for (auto & iter : results) {
-        LOG(INFO, "%d", iter.get());
+    for (auto & iter : services) {
+        // Only logged, LOG is compiled out in release
+        [[gnu::unused]] S32 ret = iter->join();
+        LOG(INFO, "Service %s joined with %d", iter->name().c_str(), ret);
     }
 
     cleanup(EXIT_SUCCESS);
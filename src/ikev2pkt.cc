@@ -25,6 +25,35 @@ Packet::~Packet() {
     TRACE();
 }
 
+// Decode fixed IKE header from wire format. Returns false if
+// datagram is too short to carry IKE header
+bool Packet::parseHeader(const SCHAR * buffer, S32 len, ikev2Header & hdr) {
+    TRACE();
+    if (len < IKEV2_HEADER_LEN) {
+        return false;
+    }
+
+    U64 spi;
+    U32 val;
+
+    memcpy(&spi, buffer + IKEV2_INITIATOR_SPI_OFFSET, sizeof(spi));
+    hdr.initiatorSpi = be64toh(spi);
+    memcpy(&spi, buffer + IKEV2_RESPONDER_SPI_OFFSET, sizeof(spi));
+    hdr.responderSpi = be64toh(spi);
+
+    hdr.nextPayload = buffer[16];
+    hdr.version = buffer[17];
+    hdr.xchgType = buffer[18];
+    hdr.flags = buffer[19];
+
+    memcpy(&val, buffer + 20, sizeof(val));
+    hdr.msgId = be32toh(val);
+    memcpy(&val, buffer + 24, sizeof(val));
+    hdr.length = be32toh(val);
+
+    return true;
+}
+
 S32 Packet::create() {
     TRACE();
 
@@ -17,18 +17,28 @@
 
 #pragma once
 
+#include <endian.h>  // be64toh
+#include <string.h>  // memcpy
+
 #include "logging.hh"
 #include "ikev2payload.hh"
 
 namespace IKEv2 {
+
+// Fixed IKE header size and offsets, RFC 7296 section 3.1
+const S32 IKEV2_HEADER_LEN = 28;
+const S32 IKEV2_INITIATOR_SPI_OFFSET = 0;
+const S32 IKEV2_RESPONDER_SPI_OFFSET = 8;
+
 class Packet {
  public:
+    // SPIs, message id and length are in host byte order
     typedef struct ikev2Header_s {
-        U32 initiatorSpi;
-        U32 responderSpi;
+        U64 initiatorSpi;
+        U64 responderSpi;
         U8 nextPayload;
         U8 version;  // Major + Minor version
-        U16 xchgType;
+        U8 xchgType;
         U8 flags;
         U32 msgId;
         U32 length;
@@ -36,6 +46,7 @@ class Packet {
 
     Packet();
     ~Packet();
+    static bool parseHeader(const SCHAR * buffer, S32 len, ikev2Header & hdr);
     S32 create();
     S32 destroy();
     S32 clone();
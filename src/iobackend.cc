@@ -0,0 +1,895 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "iobackend.hh"
+
+namespace ASIO {
+
+S32
+sendAllMsgs(S32 sockfd, struct mmsghdr * msgs, U32 count,
+            const bool & stop, U64 & drops, U64 & syscalls) {
+    TRACE();
+    U32 sent = 0;
+
+    while (sent < count) {
+        if (stop) {
+            return 0;
+        }
+
+        S32 ret = sendmmsg(sockfd, msgs + sent, count - sent, 0);
+        syscalls++;
+        if (ret >= 0) {
+            sent += ret;
+            continue;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            struct pollfd pfd;
+            pfd.fd = sockfd;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            syscalls++;
+            if (poll(&pfd, 1, IO_SEND_POLL_TIMEOUT) == -1 && errno != EINTR) {
+                LOG(ERROR, "poll() failed while waiting to send");
+                perror("poll");
+                return -1;
+            }
+            continue;
+        }
+
+        // Error is reported for first unsent message only,
+        // drop it and carry on with rest of the batch
+        LOG(ERROR, "Error in sendmmsg, dropping datagram");
+        perror("sendmmsg");
+        drops++;
+        sent++;
+    }
+
+    return 0;
+}
+
+SCHAR *
+mapLazy(std::size_t size) {
+    void * mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return nullptr;
+    }
+    return static_cast<SCHAR *>(mem);
+}
+
+// Start of class IOBackend
+
+IOBackend::IOBackend(std::string name) : name_(name),
+                                         stopEvent_(0),
+                                         syscalls_(0),
+                                         datagrams_(0),
+                                         sendDrops_(0) {
+    TRACE();
+}
+
+IOBackend::~IOBackend() {
+    TRACE();
+}
+
+IOBackend::Ptr
+IOBackend::create(Type type, std::string name) {
+    TRACE();
+    if (type == Type::IO_URING) {
+        return Ptr(new UringBackend(name));
+    }
+    return Ptr(new EpollBackend(name));
+}
+
+IOBackend::Type
+IOBackend::typeFromString(const std::string & type) {
+    TRACE();
+    if (type == "io_uring") {
+        return Type::IO_URING;
+    }
+    return Type::EPOLL;
+}
+
+U64
+IOBackend::syscalls() const {
+    return syscalls_;
+}
+
+U64
+IOBackend::datagrams() const {
+    return datagrams_;
+}
+
+U64
+IOBackend::sendDrops() const {
+    return sendDrops_;
+}
+
+const std::string &
+IOBackend::name() const {
+    return name_;
+}
+
+// End of class IOBackend
+
+// Start of class EpollBackend
+
+EpollBackend::EpollBackend(std::string name) : IOBackend(name),
+                                               sockfd_(-1),
+                                               batchSize_(0),
+                                               stopNotifier_(nullptr),
+                                               asioHdl_(3, name),
+                                               sockReady_(false),
+                                               stopPending_(false),
+                                               busyBatches_(0),
+                                               maxDatagram_(0),
+                                               overflowMem_(nullptr),
+                                               overflowSize_(0) {
+    TRACE();
+}
+
+EpollBackend::~EpollBackend() {
+    TRACE();
+    if (overflowMem_ != nullptr) {
+        munmap(overflowMem_, overflowSize_);
+    }
+}
+
+S32
+EpollBackend::init(S32 sockfd, Synchro::Notifier & stopNotifier,
+                   S32 stopEvent, U32 batchSize, U32 maxDatagram) {
+    TRACE();
+    sockfd_ = sockfd;
+    stopNotifier_ = &stopNotifier;
+    stopEvent_ = stopEvent;
+    batchSize_ = batchSize;
+    maxDatagram_ = maxDatagram;
+
+    overflowSize_ = static_cast<std::size_t>(batchSize_) * maxDatagram_;
+    overflowMem_ = mapLazy(overflowSize_);
+    if (overflowMem_ == nullptr) {
+        LOG(ERROR, "Failed to map overflow area : %s", name_.c_str());
+        return -1;
+    }
+
+    // Slot and overflow iovec per message
+    iovecs_.resize(2 * batchSize_);
+    msgs_.resize(batchSize_);
+
+    if (asioHdl_.createPoller() == -1) {
+        return -1;
+    }
+
+    // Errors on socket are reported by recvmmsg()
+    if (asioHdl_.addFd(sockfd_, [this](U32 events) { sockReady_ = true; },
+                       true) == -1) {
+        return -1;
+    }
+
+    if (asioHdl_.addFd(stopNotifier_->eventFd(),
+                       [this](U32 events) { stopPending_ = true; }) == -1) {
+        return -1;
+    }
+
+    LOG(INFO, "Epoll backend ready : %s", name_.c_str());
+    return 0;
+}
+
+S32
+EpollBackend::watchFd(S32 fd, AsyncIOHandler::EventHandler handler) {
+    TRACE();
+    return asioHdl_.addFd(fd, std::move(handler));
+}
+
+S32
+EpollBackend::receive(const SlotProvider & slots,
+                      const RcvHandler & handler) {
+    TRACE();
+
+    // Block on poller only once socket is drained. Under load
+    // poller is checked without blocking so stop event is not starved
+    if (!sockReady_ || ++busyBatches_ >= EPOLL_STOP_CHECK_BATCHES) {
+        busyBatches_ = 0;
+        if (asioHdl_.watchFds(sockReady_ ? 0 : AsyncIOHandler::EPOLL_BLOCK_FD) == -1) {
+            return -1;
+        }
+        syscalls_++;
+    }
+
+    if (stopPending_) {
+        stopPending_ = false;
+        syscalls_++;
+        if (stopNotifier_->readEvent(stopEvent_)) {
+            return IO_STOP;
+        }
+    }
+
+    if (!sockReady_) {
+        return 0;
+    }
+
+    // Datagram size is unknown before reading it. It lands in slot
+    // and whatever does not fit spills into slot's overflow area
+    for (U32 idx = 0; idx < batchSize_; ++idx) {
+        RcvSlot slot = slots(idx, 0);
+        struct iovec * iov = &iovecs_[2 * idx];
+        iov[0].iov_base = slot.buffer;
+        iov[0].iov_len = std::min(slot.len, maxDatagram_);
+        iov[1].iov_base = overflowMem_ + static_cast<std::size_t>(idx) * maxDatagram_;
+        iov[1].iov_len = maxDatagram_ - iov[0].iov_len;
+        memset(&msgs_[idx], 0, sizeof(struct mmsghdr));
+        msgs_[idx].msg_hdr.msg_iov = iov;
+        msgs_[idx].msg_hdr.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
+        msgs_[idx].msg_hdr.msg_name = slot.peer;
+        msgs_[idx].msg_hdr.msg_namelen = slot.peerLen;
+    }
+
+    // Drain up to batchSize_ datagrams with single syscall
+    S32 pkts = recvmmsg(sockfd_, msgs_.data(), batchSize_, MSG_DONTWAIT, nullptr);
+    syscalls_++;
+    if (pkts == -1) {
+        // Another endpoint may have drained the socket
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            sockReady_ = false;
+            return 0;
+        } else if (errno == EINTR) {
+            return 0;
+        }
+        LOG(ERROR, "recvmmsg() failed : %s", name_.c_str());
+        perror("recvmmsg");
+        return -1;
+    }
+
+    // Short read means socket is drained, new datagram will
+    // trigger next edge
+    if (static_cast<U32>(pkts) < batchSize_) {
+        sockReady_ = false;
+    }
+
+    for (S32 idx = 0; idx < pkts; ++idx) {
+        const struct iovec * iov = &iovecs_[2 * idx];
+        const SCHAR * overflow = nullptr;
+        if (msgs_[idx].msg_len > iov[0].iov_len) {
+            overflow = static_cast<const SCHAR *>(iov[1].iov_base);
+        }
+        handler(idx, msgs_[idx].msg_len, overflow,
+                msgs_[idx].msg_hdr.msg_flags & MSG_TRUNC);
+    }
+
+    datagrams_ += pkts;
+    return pkts;
+}
+
+S32
+EpollBackend::send(struct mmsghdr * msgs, U32 count) {
+    TRACE();
+    const bool stop = false;
+    return sendAllMsgs(sockfd_, msgs, count, stop, sendDrops_, syscalls_);
+}
+
+// End of class EpollBackend
+
+// Start of class UringBackend
+
+UringBackend::UringBackend(std::string name) : IOBackend(name),
+                                               ringFd_(-1),
+                                               sockfd_(-1),
+                                               stopNotifier_(nullptr),
+                                               sqRing_(MAP_FAILED),
+                                               cqRing_(MAP_FAILED),
+                                               sqRingSize_(0),
+                                               cqRingSize_(0),
+                                               sqes_(nullptr),
+                                               sqHead_(nullptr),
+                                               sqTail_(nullptr),
+                                               sqMask_(nullptr),
+                                               sqArray_(nullptr),
+                                               cqHead_(nullptr),
+                                               cqTail_(nullptr),
+                                               cqMask_(nullptr),
+                                               cqes_(nullptr),
+                                               toSubmit_(0),
+                                               bufMem_(nullptr),
+                                               bufMemSize_(0),
+                                               bufSize_(0),
+                                               provided_(false),
+                                               recvArmed_(false),
+                                               recvBroken_(false),
+                                               stopped_(false) {
+    TRACE();
+    memset(&params_, 0, sizeof(params_));
+    memset(&rcvHdr_, 0, sizeof(rcvHdr_));
+}
+
+UringBackend::~UringBackend() {
+    TRACE();
+
+    if (bufMem_ != nullptr) {
+        munmap(bufMem_, bufMemSize_);
+    }
+
+    if (sqes_ != nullptr) {
+        munmap(sqes_, params_.sq_entries * sizeof(struct io_uring_sqe));
+    }
+
+    if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_) {
+        munmap(cqRing_, cqRingSize_);
+    }
+
+    if (sqRing_ != MAP_FAILED) {
+        munmap(sqRing_, sqRingSize_);
+    }
+
+    if (ringFd_ >= 0 && close(ringFd_) == -1) {
+        LOG(ERROR, "Error closing io_uring fd : %s", name_.c_str());
+        perror("close");
+    }
+}
+
+S32
+UringBackend::init(S32 sockfd, Synchro::Notifier & stopNotifier,
+                   S32 stopEvent, U32 batchSize, U32 maxDatagram) {
+    TRACE();
+    sockfd_ = sockfd;
+    stopNotifier_ = &stopNotifier;
+    stopEvent_ = stopEvent;
+
+    // Each provided buffer holds recvmsg header, peer address
+    // and payload
+    rcvHdr_.msg_namelen = sizeof(struct sockaddr_storage);
+    rcvHdr_.msg_controllen = 0;
+    bufSize_ = sizeof(struct io_uring_recvmsg_out) + rcvHdr_.msg_namelen +
+               maxDatagram;
+
+    pending_.reserve(batchSize);
+    sendRetries_.reserve(URING_ENTRIES);
+
+    if (setupRing() == -1 || probeOps() == -1 || provideBuffers() == -1) {
+        return -1;
+    }
+
+    armStop();
+    armRecv();
+    if (probeMultishot() == -1) {
+        return -1;
+    }
+
+    LOG(INFO, "io_uring backend ready : %s", name_.c_str());
+    return 0;
+}
+
+S32
+UringBackend::setupRing() {
+    TRACE();
+
+    ringFd_ = syscall(__NR_io_uring_setup, URING_ENTRIES, &params_);
+    if (ringFd_ < 0) {
+        LOG(ERROR, "io_uring_setup() failed : %s", name_.c_str());
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    sqRingSize_ = params_.sq_off.array + params_.sq_entries * sizeof(U32);
+    cqRingSize_ = params_.cq_off.cqes +
+                  params_.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels map both rings with single mmap()
+    if (params_.features & IORING_FEAT_SINGLE_MMAP) {
+        sqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+        cqRingSize_ = sqRingSize_;
+    }
+
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+        LOG(ERROR, "mmap() of submission ring failed : %s", name_.c_str());
+        perror("mmap");
+        return -1;
+    }
+
+    if (params_.features & IORING_FEAT_SINGLE_MMAP) {
+        cqRing_ = sqRing_;
+    } else {
+        cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            LOG(ERROR, "mmap() of completion ring failed : %s", name_.c_str());
+            perror("mmap");
+            return -1;
+        }
+    }
+
+    void * sqes = mmap(nullptr, params_.sq_entries * sizeof(struct io_uring_sqe),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ringFd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        LOG(ERROR, "mmap() of sqes failed : %s", name_.c_str());
+        perror("mmap");
+        return -1;
+    }
+    sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+
+    SCHAR * sq = static_cast<SCHAR *>(sqRing_);
+    sqHead_ = reinterpret_cast<U32 *>(sq + params_.sq_off.head);
+    sqTail_ = reinterpret_cast<U32 *>(sq + params_.sq_off.tail);
+    sqMask_ = reinterpret_cast<U32 *>(sq + params_.sq_off.ring_mask);
+    sqArray_ = reinterpret_cast<U32 *>(sq + params_.sq_off.array);
+
+    SCHAR * cq = static_cast<SCHAR *>(cqRing_);
+    cqHead_ = reinterpret_cast<U32 *>(cq + params_.cq_off.head);
+    cqTail_ = reinterpret_cast<U32 *>(cq + params_.cq_off.tail);
+    cqMask_ = reinterpret_cast<U32 *>(cq + params_.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params_.cq_off.cqes);
+
+    return 0;
+}
+
+S32
+UringBackend::probeOps() {
+    TRACE();
+    std::vector<UCHAR> mem(sizeof(struct io_uring_probe) +
+                           IORING_OP_LAST * sizeof(struct io_uring_probe_op), 0);
+    auto probe = reinterpret_cast<struct io_uring_probe *>(mem.data());
+
+    // Probe itself needs Linux 5.6
+    if (syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_PROBE,
+                probe, IORING_OP_LAST) < 0) {
+        LOG(ERROR, "io_uring opcode probe failed : %s", name_.c_str());
+        perror("io_uring_register");
+        return -1;
+    }
+
+    for (U32 op : {IORING_OP_RECVMSG, IORING_OP_SENDMSG, IORING_OP_POLL_ADD,
+                   IORING_OP_PROVIDE_BUFFERS}) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            LOG(ERROR, "io_uring opcode %u not supported : %s", op, name_.c_str());
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Multishot flag is not covered by opcode probe. Kernel rejects bad
+// request while submitting it, so unsupported multishot recvmsg has
+// completed with error by time io_uring_enter() returns, while
+// supported one stays armed
+S32
+UringBackend::probeMultishot() {
+    TRACE();
+    if (enter(0) == -1) {
+        return -1;
+    }
+
+    bool stopped = false;
+    U32 sendsDone = 0;
+    reapCompletions(stopped, sendsDone);
+    stopped_ = stopped;
+
+    // Datagrams which already arrived are handled by receive()
+    for (auto & cqe : pending_) {
+        if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+            LOG(ERROR, "Multishot recvmsg not supported : %s", name_.c_str());
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Hand whole buffer pool to kernel as buffer group 0. Kernel picks
+// free buffer for every datagram so multishot recvmsg never needs
+// to be rearmed as long as buffers are recycled
+S32
+UringBackend::provideBuffers() {
+    TRACE();
+
+    bufMemSize_ = static_cast<std::size_t>(URING_BUFFERS) * bufSize_;
+    bufMem_ = mapLazy(bufMemSize_);
+    if (bufMem_ == nullptr) {
+        LOG(ERROR, "Failed to map receive buffers : %s", name_.c_str());
+        return -1;
+    }
+
+    struct io_uring_sqe * sqe = getSqe();
+    if (sqe == nullptr) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = URING_BUFFERS;
+    sqe->addr = reinterpret_cast<U64>(bufMem_);
+    sqe->len = bufSize_;
+    sqe->off = 0;
+    sqe->buf_group = 0;
+    sqe->user_data = TAG_PROVIDE;
+
+    if (enter(1) == -1) {
+        return -1;
+    }
+
+    bool stopped = false;
+    U32 sendsDone = 0;
+    reapCompletions(stopped, sendsDone);
+
+    if (!provided_) {
+        LOG(ERROR, "Failed to provide receive buffers : %s", name_.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+// Give buffer back to kernel. Request rides along with next
+// io_uring_enter() so recycling costs no extra syscall
+void
+UringBackend::recycleBuffer(U16 bid) {
+    struct io_uring_sqe * sqe = getSqe();
+    if (sqe == nullptr) {
+        LOG(ERROR, "Leaking receive buffer %u : %s", bid, name_.c_str());
+        return;
+    }
+
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = reinterpret_cast<U64>(bufMem_ + static_cast<std::size_t>(bid) * bufSize_);
+    sqe->len = bufSize_;
+    sqe->off = bid;
+    sqe->buf_group = 0;
+    sqe->user_data = TAG_PROVIDE;
+}
+
+struct io_uring_sqe *
+UringBackend::getSqe() {
+    U32 head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+    U32 tail = *sqTail_;
+
+    // Submission ring is full, let kernel consume it
+    if (tail - head >= params_.sq_entries) {
+        if (enter(0) == -1) {
+            return nullptr;
+        }
+        head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+        if (tail - head >= params_.sq_entries) {
+            return nullptr;
+        }
+    }
+
+    U32 idx = tail & *sqMask_;
+    struct io_uring_sqe * sqe = &sqes_[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray_[idx] = idx;
+
+    // Kernel reads submissions only from io_uring_enter()
+    __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+    toSubmit_++;
+    return sqe;
+}
+
+// Submit queued entries and optionally wait for completions
+S32
+UringBackend::enter(U32 minComplete) {
+    U32 flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    S32 ret = syscall(__NR_io_uring_enter, ringFd_, toSubmit_, minComplete,
+                      flags, nullptr, 0);
+    syscalls_++;
+    if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            return 0;
+        }
+        LOG(ERROR, "io_uring_enter() failed : %s", name_.c_str());
+        perror("io_uring_enter");
+        return -1;
+    }
+
+    toSubmit_ -= std::min(static_cast<U32>(ret), toSubmit_);
+    return ret;
+}
+
+void
+UringBackend::armRecv() {
+    TRACE();
+    struct io_uring_sqe * sqe = getSqe();
+    if (sqe == nullptr) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sockfd_;
+    sqe->addr = reinterpret_cast<U64>(&rcvHdr_);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = TAG_RECV;
+    recvArmed_ = true;
+}
+
+void
+UringBackend::armStop() {
+    TRACE();
+    struct io_uring_sqe * sqe = getSqe();
+    if (sqe == nullptr) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = stopNotifier_->eventFd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = TAG_STOP;
+}
+
+void
+UringBackend::armWatch(U32 idx) {
+    TRACE();
+    struct io_uring_sqe * sqe = getSqe();
+    if (sqe == nullptr) {
+        LOG(ERROR, "Failed to rearm watch on fd %d : %s", watches_[idx].fd, name_.c_str());
+        return;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = watches_[idx].fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = TAG_WATCH + idx;
+}
+
+S32
+UringBackend::watchFd(S32 fd, AsyncIOHandler::EventHandler handler) {
+    TRACE();
+    watches_.push_back({fd, std::move(handler)});
+    armWatch(watches_.size() - 1);
+    return 0;
+}
+
+void
+UringBackend::reapCompletions(bool & stopped, U32 & sendsDone) {
+    U32 head = *cqHead_;
+    U32 tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        struct io_uring_cqe & cqe = cqes_[head & *cqMask_];
+        U64 tag = cqe.user_data & ((1ULL << TAG_BITS) - 1);
+        switch (tag) {
+            case TAG_RECV:
+                pending_.push_back({cqe.res, cqe.flags});
+                break;
+            case TAG_STOP:
+                stopped = true;
+                break;
+            case TAG_PROVIDE:
+                if (cqe.res < 0) {
+                    LOG(ERROR, "Failed to provide buffers %d : %s", -cqe.res, name_.c_str());
+                } else {
+                    provided_ = true;
+                }
+                break;
+            case TAG_SEND:
+                // Socket is non-blocking, so kernel does not wait for
+                // buffer space. Message is sent again once it drains
+                if (cqe.res == -EAGAIN) {
+                    sendRetries_.push_back(cqe.user_data >> TAG_BITS);
+                } else if (cqe.res < 0) {
+                    LOG(ERROR, "sendmsg failed %d : %s", -cqe.res, name_.c_str());
+                    sendDrops_++;
+                }
+                sendsDone++;
+                break;
+            default:
+                if (tag >= TAG_WATCH && tag < TAG_WATCH + watches_.size()) {
+                    readyWatches_.push_back({static_cast<U32>(tag - TAG_WATCH),
+                                             cqe.res});
+                    break;
+                }
+                LOG(ERROR, "Unknown completion : %s", name_.c_str());
+                break;
+        }
+    }
+
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+}
+
+S32
+UringBackend::handleRecv(const Completion & cqe, U32 idx,
+                         const SlotProvider & slots, const RcvHandler & handler) {
+    // Kernel disarms multishot request on error or when
+    // it runs out of provided buffers
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        recvArmed_ = false;
+    }
+
+    if (cqe.res < 0) {
+        // Request itself was rejected, it would fail again if rearmed
+        if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+            recvBroken_ = true;
+        }
+        if (cqe.res != -ENOBUFS) {
+            LOG(ERROR, "recvmsg failed %d : %s", -cqe.res, name_.c_str());
+        }
+        return 0;
+    }
+
+    if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+        return 0;
+    }
+
+    U16 bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    SCHAR * buf = bufMem_ + static_cast<std::size_t>(bid) * bufSize_;
+    auto out = reinterpret_cast<struct io_uring_recvmsg_out *>(buf);
+
+    const SCHAR * name = buf + sizeof(*out);
+    const SCHAR * payload = name + rcvHdr_.msg_namelen + rcvHdr_.msg_controllen;
+    U32 capacity = cqe.res - (payload - buf);
+
+    // Size is known here so slot is picked to fit whole datagram
+    U32 received = std::min(out->payloadlen, capacity);
+    RcvSlot slot = slots(idx, received);
+    U32 len = std::min(received, slot.len);
+    bool truncated = (out->flags & MSG_TRUNC) || out->payloadlen > len;
+
+    // Kernel picked buffer, so datagram is copied once into slot
+    memcpy(slot.buffer, payload, len);
+    memcpy(slot.peer, name, std::min(out->namelen, static_cast<U32>(slot.peerLen)));
+
+    handler(idx, len, nullptr, truncated);
+
+    recycleBuffer(bid);
+    return 1;
+}
+
+S32
+UringBackend::receive(const SlotProvider & slots,
+                      const RcvHandler & handler) {
+    TRACE();
+    bool stopped = stopped_;
+    U32 sendsDone = 0;
+
+    // Rearm after kernel dropped multishot request
+    if (!recvArmed_) {
+        if (recvBroken_) {
+            LOG(ERROR, "Kernel rejects recvmsg, stopping receive : %s", name_.c_str());
+            return -1;
+        }
+        armRecv();
+    }
+
+    // Completions parked by send() are handled without blocking
+    if (pending_.empty() && readyWatches_.empty() && !stopped) {
+        if (enter(1) == -1) {
+            return -1;
+        }
+    }
+
+    reapCompletions(stopped, sendsDone);
+
+    S32 pkts = 0;
+    for (auto & cqe : pending_) {
+        pkts += handleRecv(cqe, pkts, slots, handler);
+    }
+    pending_.clear();
+    datagrams_ += pkts;
+
+    // Handlers may send and so reap more watch completions
+    firedWatches_.swap(readyWatches_);
+    for (auto & event : firedWatches_) {
+        // Poll result is mask of ready events
+        U32 events = event.res < 0 ? static_cast<U32>(EPOLLERR) : static_cast<U32>(event.res);
+        watches_[event.idx].handler(events);
+        armWatch(event.idx);
+    }
+    firedWatches_.clear();
+
+    if (stopped) {
+        stopped_ = true;
+        if (stopNotifier_->readEvent(stopEvent_)) {
+            return IO_STOP;
+        }
+        // Not a stop event, keep watching
+        stopped_ = false;
+        armStop();
+    }
+
+    return pkts;
+}
+
+bool
+UringBackend::queueSend(struct mmsghdr * msgs, U32 idx) {
+    struct io_uring_sqe * sqe = getSqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sockfd_;
+    sqe->addr = reinterpret_cast<U64>(&msgs[idx].msg_hdr);
+    sqe->len = 1;
+    sqe->user_data = TAG_SEND | (static_cast<U64>(idx) << TAG_BITS);
+    return true;
+}
+
+// Queue one sendmsg per message and submit them together
+S32
+UringBackend::send(struct mmsghdr * msgs, U32 count) {
+    TRACE();
+    U32 queued = 0;
+    U32 sendsDone = 0;
+    bool stopped = false;
+
+    for (U32 idx = 0; idx < count; ++idx) {
+        if (!queueSend(msgs, idx)) {
+            sendDrops_ += count - idx;
+            break;
+        }
+        queued++;
+    }
+
+    while (true) {
+        // Messages must stay valid till kernel completes them
+        while (sendsDone < queued) {
+            if (enter(1) == -1) {
+                return -1;
+            }
+            reapCompletions(stopped, sendsDone);
+        }
+
+        if (sendRetries_.empty()) {
+            break;
+        }
+
+        // Socket buffer is full, wait for it to drain as
+        // sendAllMsgs() does and send rest again
+        struct pollfd pfd;
+        pfd.fd = sockfd_;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        syscalls_++;
+        if (poll(&pfd, 1, IO_SEND_POLL_TIMEOUT) == -1 && errno != EINTR) {
+            LOG(ERROR, "poll() failed while waiting to send : %s", name_.c_str());
+            perror("poll");
+            sendDrops_ += sendRetries_.size();
+            sendRetries_.clear();
+            return -1;
+        }
+
+        queued = 0;
+        sendsDone = 0;
+        for (auto idx : sendRetries_) {
+            if (!queueSend(msgs, idx)) {
+                sendDrops_++;
+                continue;
+            }
+            queued++;
+        }
+        sendRetries_.clear();
+    }
+
+    if (stopped) {
+        stopped_ = true;
+    }
+
+    return 0;
+}
+
+// End of class UringBackend
+
+}  // namespace ASIO
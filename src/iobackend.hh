@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// This file implements datagram I/O backends used by network endpoints.
+// Epoll backend waits for readiness and uses recvmmsg() / sendmmsg()
+// straight into endpoint buffers, io_uring backend uses multishot
+// recvmsg with provided buffers so that steady state receive needs
+// no syscall per datagram
+#pragma once
+
+#include <poll.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <algorithm>  // std::min
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <functional>
+
+#include "logging.hh"
+#include "basictypes.hh"
+#include "synchro.hh"
+#include "asyncio.hh"
+
+namespace ASIO {
+
+// Returned by IOBackend::receive() when stop notifier fired
+const S32 IO_STOP = -2;
+
+// Time in msec to wait for socket buffer to drain on EAGAIN
+const S32 IO_SEND_POLL_TIMEOUT = 100;
+
+// Anonymous mapping which only consumes memory for touched pages
+SCHAR * mapLazy(std::size_t size);
+
+// Send all messages with as few sendmmsg() calls as possible,
+// waiting for socket buffer to drain on EAGAIN. Datagram which
+// fails is dropped. Gives up when stop becomes true
+S32 sendAllMsgs(S32 sockfd, struct mmsghdr * msgs, U32 count,
+                const bool & stop, U64 & drops, U64 & syscalls);
+
+class IOBackend {
+ public:
+    enum class Type { EPOLL, IO_URING };
+
+    using Ptr = std::unique_ptr<IOBackend>;
+
+    // Destination of one datagram. Slots are supplied by endpoint so
+    // that datagram lands straight in packet buffer
+    struct RcvSlot {
+        SCHAR * buffer;
+        U32 len;
+        struct sockaddr * peer;
+        socklen_t peerLen;
+    };
+    // Returns slot idx of current batch, big enough for sizeHint bytes
+    // if datagram size is already known(0 otherwise). Same slot is
+    // asked again in next batch if it was not filled
+    using SlotProvider = std::function<RcvSlot(U32 idx, U32 sizeHint)>;
+    // Called when slot idx has been filled with len bytes. Bytes which
+    // did not fit in slot are in overflow(nullptr if none), truncated
+    // is true if datagram exceeded max datagram size
+    using RcvHandler = std::function<void(U32 idx, S32 len,
+                                          const SCHAR * overflow,
+                                          bool truncated)>;
+
+    IOBackend(std::string name);
+    virtual ~IOBackend();
+
+    // Watch socket for datagrams and stop notifier for stopEvent.
+    // Datagrams larger than maxDatagram are reported as truncated
+    virtual S32 init(S32 sockfd, Synchro::Notifier & stopNotifier,
+                     S32 stopEvent, U32 batchSize, U32 maxDatagram) = 0;
+    // Block till datagrams or stop event arrive. Returns no. of
+    // datagrams passed to handler, IO_STOP or -1 on error
+    virtual S32 receive(const SlotProvider & slots,
+                        const RcvHandler & handler) = 0;
+    // Send all messages. Datagrams which fail are dropped and
+    // counted. Returns -1 if backend is unusable
+    virtual S32 send(struct mmsghdr * msgs, U32 count) = 0;
+    // Watch another fd(e.g. timerfd) for input. Handler runs from
+    // receive() on receiving thread
+    virtual S32 watchFd(S32 fd, AsyncIOHandler::EventHandler handler) = 0;
+
+    static Ptr create(Type type, std::string name);
+    static Type typeFromString(const std::string & type);
+
+    // Syscalls issued / datagrams handled, used to compare backends
+    U64 syscalls() const;
+    U64 datagrams() const;
+    U64 sendDrops() const;
+    const std::string & name() const;
+ protected:
+    std::string name_;
+    S32 stopEvent_;
+    U64 syscalls_;
+    U64 datagrams_;
+    U64 sendDrops_;
+};
+
+class EpollBackend : public IOBackend {
+ public:
+    EpollBackend(std::string name);
+    ~EpollBackend();
+
+    S32 init(S32 sockfd, Synchro::Notifier & stopNotifier,
+             S32 stopEvent, U32 batchSize, U32 maxDatagram) override;
+    S32 receive(const SlotProvider & slots,
+                const RcvHandler & handler) override;
+    S32 send(struct mmsghdr * msgs, U32 count) override;
+    S32 watchFd(S32 fd, AsyncIOHandler::EventHandler handler) override;
+
+    // While socket stays readable poller is checked for stop
+    // event only once per these many batches
+    static const U32 EPOLL_STOP_CHECK_BATCHES = 16;
+ private:
+    S32 sockfd_;
+    U32 batchSize_;
+    Synchro::Notifier * stopNotifier_;
+    AsyncIOHandler asioHdl_;
+    // Socket is watched edge triggered, it is read till drained
+    // before waiting on poller again
+    bool sockReady_;
+    bool stopPending_;
+    U32 busyBatches_;
+    // Per slot overflow area for datagrams bigger than slot. Mapped
+    // lazily so only pages touched by big datagrams use memory
+    U32 maxDatagram_;
+    SCHAR * overflowMem_;
+    std::size_t overflowSize_;
+    std::vector<struct iovec> iovecs_;
+    std::vector<struct mmsghdr> msgs_;
+};
+
+class UringBackend : public IOBackend {
+ public:
+    UringBackend(std::string name);
+    ~UringBackend();
+
+    S32 init(S32 sockfd, Synchro::Notifier & stopNotifier,
+             S32 stopEvent, U32 batchSize, U32 maxDatagram) override;
+    S32 receive(const SlotProvider & slots,
+                const RcvHandler & handler) override;
+    S32 send(struct mmsghdr * msgs, U32 count) override;
+    S32 watchFd(S32 fd, AsyncIOHandler::EventHandler handler) override;
+
+    // No. of receive buffers provided to kernel
+    static const U32 URING_BUFFERS = 512;
+    static const U32 URING_ENTRIES = 256;
+ private:
+    // Watched fd idx completes with TAG_WATCH + idx. Tag is in low
+    // 32 bits of user data, sends carry message idx in high 32 bits
+    enum Tag : U64 { TAG_RECV = 1, TAG_STOP, TAG_SEND, TAG_PROVIDE, TAG_WATCH };
+    static const U32 TAG_BITS = 32;
+
+    struct Completion {
+        S32 res;
+        U32 flags;
+    };
+
+    struct Watch {
+        S32 fd;
+        AsyncIOHandler::EventHandler handler;
+    };
+
+    // Poll completion of watch idx
+    struct WatchEvent {
+        U32 idx;
+        S32 res;
+    };
+
+    S32 setupRing();
+    // Check kernel supports every opcode used here, including
+    // multishot recvmsg(Linux 6.0), so that init() fails and endpoint
+    // falls back to epoll instead of failing on every completion
+    S32 probeOps();
+    S32 probeMultishot();
+    S32 provideBuffers();
+    struct io_uring_sqe * getSqe();
+    S32 enter(U32 minComplete);
+    void armRecv();
+    void armStop();
+    void armWatch(U32 idx);
+    void recycleBuffer(U16 bid);
+    // Copy datagram from provided buffer to slot idx
+    S32 handleRecv(const Completion & cqe, U32 idx,
+                   const SlotProvider & slots, const RcvHandler & handler);
+    // Move completions from CQ ring, recv completions are parked
+    // in pending_ till next receive()
+    // Sends which failed with EAGAIN are added to sendRetries_
+    void reapCompletions(bool & stopped, U32 & sendsDone);
+    bool queueSend(struct mmsghdr * msgs, U32 idx);
+
+    S32 ringFd_;
+    S32 sockfd_;
+    Synchro::Notifier * stopNotifier_;
+    struct io_uring_params params_;
+
+    // Submission / completion ring mappings
+    void * sqRing_;
+    void * cqRing_;
+    std::size_t sqRingSize_;
+    std::size_t cqRingSize_;
+    struct io_uring_sqe * sqes_;
+    U32 * sqHead_;
+    U32 * sqTail_;
+    U32 * sqMask_;
+    U32 * sqArray_;
+    U32 * cqHead_;
+    U32 * cqTail_;
+    U32 * cqMask_;
+    struct io_uring_cqe * cqes_;
+    U32 toSubmit_;
+
+    // Buffers provided to kernel for receive, sized for largest
+    // datagram and mapped lazily
+    SCHAR * bufMem_;
+    std::size_t bufMemSize_;
+    U32 bufSize_;
+    bool provided_;
+
+    struct msghdr rcvHdr_;
+    bool recvArmed_;
+    // Kernel rejected recvmsg request itself, rearming would only spin
+    bool recvBroken_;
+    bool stopped_;
+    // Idx of messages to send again once socket buffer drains
+    std::vector<U32> sendRetries_;
+    std::vector<Completion> pending_;
+    // Watched fds are polled one shot and rearmed after handler ran
+    std::vector<Watch> watches_;
+    std::vector<WatchEvent> readyWatches_;
+    std::vector<WatchEvent> firedWatches_;
+};
+
+}  // namespace ASIO
@@ -17,8 +17,22 @@
 
 #pragma once
 
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <shared_mutex>
 #include <unordered_map>
 
+#include "logging.hh"
+#include "basictypes.hh"
+
+// No. of independently locked stripes, power of 2
+const U32 MAP_STRIPE_BITS = 6;
+const std::size_t MAP_STRIPES = 1 << MAP_STRIPE_BITS;
+
+// Concurrent map split in lock striped shards. Lookups take stripe
+// lock shared so they only wait for writer of same stripe, and
+// values being erased are destroyed after lock is dropped
 template<typename k, typename v>
 class Map {
  public:
@@ -29,42 +43,66 @@ class Map {
     // Key will be trivial value which can be
     // passed around, while value is heavy weight object
     using Ptr = std::shared_ptr<v>;
+    using Factory = std::function<Ptr()>;
 
     void add(k, Ptr);
     bool find(k, Ptr &);
+    // Find value or insert one made by factory as single atomic step,
+    // so racing threads never create two values for same key.
+    // Returns true if value was inserted
+    bool findOrInsert(k, const Factory &, Ptr &);
     void erase(k);
-    Map & map();
+    // Erase only if key still maps to given value
+    void erase(k, const v *);
+    std::size_t size();
 
  private:
-    std::unordered_map<k, Ptr> map_;
-    std::mutex mapMutex_;
-    bool stopped_; // XXX required?
+    struct Stripe {
+        std::shared_timed_mutex mutex;
+        std::unordered_map<k, Ptr> map;
+        // Keep stripes on separate cache lines
+        char pad[64];
+    };
+
+    Stripe & stripe(const k & key);
+
+    Stripe stripes_[MAP_STRIPES];
 };
 
 template<typename k, typename v>
 Map<k, v>::Map() {
     TRACE();
-    stopped_ = false;
+}
+
+template<typename k, typename v>
+typename Map<k, v>::Stripe &
+Map<k, v>::stripe(const k & key) {
+    // Buckets inside stripe are picked by low bits of hash, so take
+    // stripe from top bits. Fibonacci multiply first so that weak
+    // hashes(std::hash of integers is identity) still fill top bits
+    U64 h = std::hash<k>()(key);
+    return stripes_[(h * 0x9e3779b97f4a7c15ULL) >> (64 - MAP_STRIPE_BITS)];
 }
 
 template<typename k, typename v>
 void
 Map<k, v>::add(k key, typename Map<k, v>::Ptr value) {
     TRACE();
+    Stripe & s = stripe(key);
 
-    std::unique_lock<std::mutex> lock(mapMutex_);
-    map_.insert({{key, value}});
-
+    std::unique_lock<std::shared_timed_mutex> lock(s.mutex);
+    s.map.insert({{key, value}});
 }
 
 template<typename k, typename v>
 bool
 Map<k, v>::find(k key, typename Map<k, v>::Ptr & value) {
     TRACE();
+    Stripe & s = stripe(key);
 
-    std::unique_lock<std::mutex> lock(mapMutex_);
-    auto iter = map_.find(key);
-    if (iter != map_.end()) {
+    std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+    auto iter = s.map.find(key);
+    if (iter != s.map.end()) {
         value = iter->second;
         return true;
     }
@@ -72,26 +110,89 @@ Map<k, v>::find(k key, typename Map<k, v>::Ptr & value) {
     return false;
 }
 
+template<typename k, typename v>
+bool
+Map<k, v>::findOrInsert(k key, const Factory & factory,
+                        typename Map<k, v>::Ptr & value) {
+    TRACE();
+    Stripe & s = stripe(key);
+
+    // Common case: value already exists
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+        auto iter = s.map.find(key);
+        if (iter != s.map.end()) {
+            value = iter->second;
+            return false;
+        }
+    }
+
+    // Recheck under exclusive lock, another thread may have won
+    std::unique_lock<std::shared_timed_mutex> lock(s.mutex);
+    auto iter = s.map.find(key);
+    if (iter != s.map.end()) {
+        value = iter->second;
+        return false;
+    }
+
+    value = factory();
+    s.map.insert({{key, value}});
+    return true;
+}
+
 template<typename k, typename v>
 void
 Map<k, v>::erase(k key) {
     TRACE();
+    Stripe & s = stripe(key);
+    Ptr victim;
+
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(s.mutex);
+        auto iter = s.map.find(key);
+        if (iter == s.map.end()) {
+            return;
+        }
+        victim = std::move(iter->second);
+        s.map.erase(iter);
+    }
+
+    // victim is released here, outside stripe lock
+}
 
-    std::unique_lock<std::mutex> lock(mapMutex_);
-    map_.erase(key);
+template<typename k, typename v>
+void
+Map<k, v>::erase(k key, const v * value) {
+    TRACE();
+    Stripe & s = stripe(key);
+    Ptr victim;
+
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(s.mutex);
+        auto iter = s.map.find(key);
+        if (iter == s.map.end() || iter->second.get() != value) {
+            return;
+        }
+        victim = std::move(iter->second);
+        s.map.erase(iter);
+    }
 }
 
 template<typename k, typename v>
-Map<k, v> &
-Map<k, v>::map() {
+std::size_t
+Map<k, v>::size() {
     TRACE();
+    std::size_t count = 0;
 
-    return map_;
+    for (auto & s : stripes_) {
+        std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+        count += s.map.size();
+    }
+
+    return count;
 }
 
 template<typename k, typename v>
 Map<k, v>::~Map() {
     TRACE();
-
-    stopped_ = true;
 }
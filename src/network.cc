@@ -17,6 +17,15 @@
 
 #include "network.hh"
 
+std::string
+EndpointKey::toString() const {
+    SCHAR ipAddr[INET6_ADDRSTRLEN];
+    if (inet_ntop(family, addr, ipAddr, sizeof(ipAddr)) == nullptr) {
+        return "invalid";
+    }
+    return std::string(ipAddr) + "-" + std::to_string(ntohs(port));
+}
+
 namespace Network {
 
 // Create different packet queues for sending and receiving packets
@@ -33,6 +42,54 @@ Queue<PeerData6> globalRcvPktQ6;
 Map<HashKey, IKEv2Session4> globalIKEv2Session4Map;
 Map<HashKey, IKEv2Session6> globalIKEv2Session6Map;
 
+SpiTable4 globalIKEv2Spi4Table;
+SpiTable6 globalIKEv2Spi6Table;
+
+// Applied to idle timer of every new session
+S32 sessionTimerSlack = SESSION_TIMER_SLACK;
+S32 sessionTimerSpread = 0;
+
+U32
+spiShard(const SCHAR * buffer, S32 len, U32 shardCount) {
+    IKEv2::Packet::ikev2Header hdr;
+    if (shardCount == 0 ||
+        !IKEv2::Packet::parseHeader(buffer, len, hdr)) {
+        return shardCount;
+    }
+    // Same bits as loaded by steering program(SPI bytes 4..7)
+    return static_cast<U32>(hdr.initiatorSpi) % shardCount;
+}
+
+bool
+startsIkeSa(const SCHAR * buffer, S32 len) {
+    IKEv2::Packet::ikev2Header hdr;
+    if (!IKEv2::Packet::parseHeader(buffer, len, hdr)) {
+        return true;
+    }
+    return hdr.responderSpi == 0;
+}
+
+void
+configureQueues(std::size_t capacity, std::size_t highWater,
+                OverflowPolicy policy) {
+    TRACE();
+    globalRcvPktQ4.configure(capacity, highWater, policy);
+    globalRcvPktQ4.classifierIs(isNewSession<PeerData4>);
+    globalRcvPktQ6.configure(capacity, highWater, policy);
+    globalRcvPktQ6.classifierIs(isNewSession<PeerData6>);
+
+    // Replies belong to existing sessions, drop only when full
+    globalSendPktQ4.configure(capacity, capacity, OverflowPolicy::DROP_NEWEST);
+    globalSendPktQ6.configure(capacity, capacity, OverflowPolicy::DROP_NEWEST);
+}
+
+void
+configureSessionTimers(S32 slack, S32 spread) {
+    TRACE();
+    sessionTimerSlack = slack;
+    sessionTimerSpread = spread;
+}
+
 // Start of class IKEv2SessionManager4
 
 // IKEv2SessionManager must run in 4 threads
@@ -71,30 +128,11 @@ IKEv2SessionManager4::handleSession() {
             continue;
         }
 
-        // Find if hash already exists in connectionMap
-        IKEv2Session4::Ptr conn;
-        bool found = globalIKEv2Session4Map.find(elem->hash, conn);
-
-        // If it exists enqueue packet in private connection Q
-        if (found) {
-            LOGT("Session already exists");
-            globalSendPktQ4.addPkt(elem);
-            ENQUEUE_TIMER_TASK(3000, false, &IKEv2Session4::handleTimeout,
-                               conn, elem->hash);
-            // check session state
-            // call session functions to process packet
-            // get processed packet and add to send Q
-            // session will hold current state of ike session
-            // XXX who will run timer for session?
-
-        // Create new connection and add to connectionMap
-        } else {
-            LOGT("Creating new session");
-            auto conn = IKEv2Session4::Ptr(new IKEv2Session4(elem->hash));
-            globalIKEv2Session4Map.add(elem->hash, conn);
-            globalSendPktQ4.addPkt(elem);
-            ENQUEUE_TIMER_TASK(3000, false, &IKEv2Session4::handleTimeout, 
-                               conn, elem->hash);
+        auto reply = processPkt(elem, globalIKEv2Session4Map,
+                                globalIKEv2Spi4Table,
+                                Timer::AsyncTimer::getAsyncTimer());
+        if (reply) {
+            globalSendPktQ4.addPkt(reply);
         }
 
         // Process packet here and send reply
@@ -106,6 +144,68 @@ IKEv2SessionManager4::handleSession() {
     return 0;
 }
 
+PeerData4::Ptr
+IKEv2SessionManager4::processPkt(const PeerData4::Ptr & elem,
+                                 SessionMap4 & sessions,
+                                 SpiTable4 & spis,
+                                 Timer::AsyncTimer & timer) {
+    TRACE();
+
+    IKEv2Session4::Ptr conn;
+    IKEv2::Packet::ikev2Header hdr;
+    bool ike = IKEv2::Packet::parseHeader(elem->buffer.data(), elem->bufferLen, hdr);
+
+    // Session timing out meanwhile refuses keep alive and is out of
+    // maps by then. Drop entry peer move may have put back and look
+    // session up again
+    while (true) {
+        // Established IKE SA is found by responder SPI we handed out,
+        // so session follows peer across address / port changes
+        if (ike && hdr.responderSpi != 0 && spis.find(hdr.responderSpi, conn)) {
+            HashKey old = conn->key();
+            if (old != elem->hash) {
+                LOGT("Peer %s moved to %s", old.toString().c_str(),
+                     elem->hash.toString().c_str());
+                conn->keyIs(elem->hash);
+                sessions.erase(old, conn.get());
+                IKEv2Session4::Ptr other;
+                sessions.findOrInsert(elem->hash, [&] { return conn; }, other);
+            }
+            LOGT("Session found by SPI");
+
+        // Else find session by peer address or create it, atomically so
+        // that packets of new peer racing on other threads share one session
+        } else {
+            bool created = sessions.findOrInsert(elem->hash, [&] {
+                return IKEv2Session4::create(elem->hash, sessions, spis, timer);
+            }, conn);
+
+            if (!created) {
+                LOGT("Session already exists");
+
+                // check session state
+                // call session functions to process packet
+                // get processed packet and add to send Q
+                // session will hold current state of ike session
+            } else {
+                LOGT("Creating new session");
+                // IKE_SA_INIT request, allocate our SPI for new IKE SA
+                if (ike && hdr.responderSpi == 0) {
+                    conn->responderSpiIs(spis.add(conn));
+                }
+            }
+        }
+
+        if (conn->keepAlive()) {
+            break;
+        }
+        sessions.erase(elem->hash, conn.get());
+    }
+
+    // Packet is echoed back till state machine is in place
+    return elem;
+}
+
 void
 IKEv2SessionManager4::shutdown() {
     TRACE();
@@ -113,6 +213,10 @@ IKEv2SessionManager4::shutdown() {
     globalSendPktQ4.shutdown();
     globalRcvPktQ4.shutdown();
 
+    LOG(INFO, "IPv4: Receive queue drops overflow %lu evicted %lu new session %lu",
+        globalRcvPktQ4.overflowDrops(), globalRcvPktQ4.evictions(),
+        globalRcvPktQ4.newSessionDrops());
+    LOG(INFO, "IPv4: Send queue drops %lu", globalSendPktQ4.drops());
     LOG(INFO, "Stopping session manager 4 thread");
 }
 
@@ -163,22 +267,11 @@ IKEv2SessionManager6::handleSession() {
             continue;
         }
 
-        // Find if hash already exists in connectionMap
-        IKEv2Session6::Ptr conn;
-
-        bool found = globalIKEv2Session6Map.find(elem->hash, conn);
-        // If it exists enqueue packet in private connection Q
-        if (found) {
-            LOGT("Session already exists");
-            globalSendPktQ6.addPkt(elem);
-            ENQUEUE_TIMER_TASK(3000, false, &IKEv2Session6::handleTimeout, conn, elem->hash);
-            // Create new connection and add to connectionMap
-        } else {
-            LOGT("Creating new session");
-            auto c = IKEv2Session6::Ptr(new IKEv2Session6(elem->hash));
-            globalIKEv2Session6Map.add(elem->hash, c);
-            globalSendPktQ6.addPkt(elem);
-            ENQUEUE_TIMER_TASK(3000, false, &IKEv2Session6::handleTimeout, c, elem->hash);
+        auto reply = processPkt(elem, globalIKEv2Session6Map,
+                                globalIKEv2Spi6Table,
+                                Timer::AsyncTimer::getAsyncTimer());
+        if (reply) {
+            globalSendPktQ6.addPkt(reply);
         }
 
         // Process packet here and send reply
@@ -189,6 +282,62 @@ IKEv2SessionManager6::handleSession() {
     return 0;
 }
 
+PeerData6::Ptr
+IKEv2SessionManager6::processPkt(const PeerData6::Ptr & elem,
+                                 SessionMap6 & sessions,
+                                 SpiTable6 & spis,
+                                 Timer::AsyncTimer & timer) {
+    TRACE();
+
+    IKEv2Session6::Ptr conn;
+    IKEv2::Packet::ikev2Header hdr;
+    bool ike = IKEv2::Packet::parseHeader(elem->buffer.data(), elem->bufferLen, hdr);
+
+    // Session timing out meanwhile refuses keep alive and is out of
+    // maps by then. Drop entry peer move may have put back and look
+    // session up again
+    while (true) {
+        // Established IKE SA is found by responder SPI we handed out,
+        // so session follows peer across address / port changes
+        if (ike && hdr.responderSpi != 0 && spis.find(hdr.responderSpi, conn)) {
+            HashKey old = conn->key();
+            if (old != elem->hash) {
+                LOGT("Peer %s moved to %s", old.toString().c_str(),
+                     elem->hash.toString().c_str());
+                conn->keyIs(elem->hash);
+                sessions.erase(old, conn.get());
+                IKEv2Session6::Ptr other;
+                sessions.findOrInsert(elem->hash, [&] { return conn; }, other);
+            }
+            LOGT("Session found by SPI");
+
+        // Else find session by peer address or create it, atomically so
+        // that packets of new peer racing on other threads share one session
+        } else {
+            bool created = sessions.findOrInsert(elem->hash, [&] {
+                return IKEv2Session6::create(elem->hash, sessions, spis, timer);
+            }, conn);
+
+            if (!created) {
+                LOGT("Session already exists");
+
+            } else {
+                LOGT("Creating new session");
+                if (ike && hdr.responderSpi == 0) {
+                    conn->responderSpiIs(spis.add(conn));
+                }
+            }
+        }
+
+        if (conn->keepAlive()) {
+            break;
+        }
+        sessions.erase(elem->hash, conn.get());
+    }
+
+    return elem;
+}
+
 void
 IKEv2SessionManager6::shutdown() {
     TRACE();
@@ -197,6 +346,11 @@ IKEv2SessionManager6::shutdown() {
 
     globalSendPktQ6.shutdown();
     globalRcvPktQ6.shutdown();
+
+    LOG(INFO, "IPv6: Receive queue drops overflow %lu evicted %lu new session %lu",
+        globalRcvPktQ6.overflowDrops(), globalRcvPktQ6.evictions(),
+        globalRcvPktQ6.newSessionDrops());
+    LOG(INFO, "IPv6: Send queue drops %lu", globalSendPktQ6.drops());
 }
 
 // Return global static ikev2 session manager
@@ -219,17 +373,47 @@ IKEv2SessionManager6::~IKEv2SessionManager6() {
 
 
 // Start of class IKEv2Session4
-IKEv2Session4::IKEv2Session4(const HashKey & h) {
+IKEv2Session4::IKEv2Session4(const HashKey & h,
+                             SessionMap4 & sessionMap,
+                             SpiTable4 & spiTable,
+                             Timer::AsyncTimer & timer) : sessionMap_(sessionMap),
+                                                          spiTable_(spiTable),
+                                                          hash_(h),
+                                                          responderSpi_(0),
+                                                          idleTimer_(timer),
+                                                          dead_(false) {
     TRACE();
+}
 
-    hash_ = h;
-
-    std::vector<std::string> s;
-    boost::split(s, hash_, boost::is_any_of("-"));
+IKEv2Session4::Ptr
+IKEv2Session4::create(const HashKey & h, SessionMap4 & sessionMap,
+                      SpiTable4 & spiTable, Timer::AsyncTimer & timer) {
+    TRACE();
+    Ptr session(new IKEv2Session4(h, sessionMap, spiTable, timer));
+
+    // Timer is part of session, its handler must not own session.
+    // Handler runs where timer expires, on shard thread in sharded
+    // mode, so shard maps are never touched from pool workers
+    std::weak_ptr<IKEv2Session4> weak = session;
+    session->idleTimer_.handlerIs([weak] {
+        if (auto self = weak.lock()) {
+            self->handleTimeout();
+        }
+    });
+    session->idleTimer_.slackIs(sessionTimerSlack);
+    session->idleTimer_.spreadIs(sessionTimerSpread, std::hash<HashKey>()(h));
 
-    ipAddr_ = IpAddress4(s[0]);
-    port_ = s[1];
+    return session;
+}
 
+bool
+IKEv2Session4::keepAlive() {
+    std::unique_lock<std::mutex> lock(sessionMutex_);
+    if (dead_) {
+        return false;
+    }
+    idleTimer_.reset(SESSION_TIMEOUT);
+    return true;
 }
 
 S32
@@ -245,11 +429,48 @@ IKEv2Session4::handleSession(std::deque<SCHAR *> & pktList) {
 }
 
 void
-IKEv2Session4::handleTimeout(HashKey hash) {
+IKEv2Session4::handleTimeout() {
     TRACE();
+    // keepAlive() takes same lock, so packet either rearms timer
+    // before check below or finds session dead afterwards
+    std::unique_lock<std::mutex> lock(sessionMutex_);
+    // Packet arrived after timer fired, session is active again
+    if (idleTimer_.armed()) {
+        return;
+    }
+
+    dead_ = true;
+    // Peer may have moved and other session taken old address,
+    // remove only entries still pointing at this session
+    sessionMap_.erase(hash_, this);
+    if (responderSpi_ != 0) {
+        spiTable_.erase(responderSpi_);
+    }
+    LOGT("%s successfully deleted after timeout", hash_.toString().c_str());
+}
+
+HashKey
+IKEv2Session4::key() {
     std::unique_lock<std::mutex> lock(sessionMutex_);
-    globalIKEv2Session4Map.erase(hash);
-    LOGT("%s successfully deleted after timeout", hash.c_str());
+    return hash_;
+}
+
+void
+IKEv2Session4::keyIs(const HashKey & h) {
+    std::unique_lock<std::mutex> lock(sessionMutex_);
+    hash_ = h;
+}
+
+U64
+IKEv2Session4::responderSpi() {
+    std::unique_lock<std::mutex> lock(sessionMutex_);
+    return responderSpi_;
+}
+
+void
+IKEv2Session4::responderSpiIs(U64 spi) {
+    std::unique_lock<std::mutex> lock(sessionMutex_);
+    responderSpi_ = spi;
 }
 
 IKEv2Session4::~IKEv2Session4() {
@@ -259,16 +480,47 @@ IKEv2Session4::~IKEv2Session4() {
 // End of class IKEv2Session4
 
 // Start of class IKEv2Session6
-IKEv2Session6::IKEv2Session6(const HashKey & h) {
+IKEv2Session6::IKEv2Session6(const HashKey & h,
+                             SessionMap6 & sessionMap,
+                             SpiTable6 & spiTable,
+                             Timer::AsyncTimer & timer) : sessionMap_(sessionMap),
+                                                          spiTable_(spiTable),
+                                                          hash_(h),
+                                                          responderSpi_(0),
+                                                          idleTimer_(timer),
+                                                          dead_(false) {
     TRACE();
+}
 
-    hash_ = h;
-    std::vector<std::string> s;
-    boost::split(s, hash_, boost::is_any_of("-"));
+IKEv2Session6::Ptr
+IKEv2Session6::create(const HashKey & h, SessionMap6 & sessionMap,
+                      SpiTable6 & spiTable, Timer::AsyncTimer & timer) {
+    TRACE();
+    Ptr session(new IKEv2Session6(h, sessionMap, spiTable, timer));
+
+    // Timer is part of session, its handler must not own session.
+    // Handler runs where timer expires, on shard thread in sharded
+    // mode, so shard maps are never touched from pool workers
+    std::weak_ptr<IKEv2Session6> weak = session;
+    session->idleTimer_.handlerIs([weak] {
+        if (auto self = weak.lock()) {
+            self->handleTimeout();
+        }
+    });
+    session->idleTimer_.slackIs(sessionTimerSlack);
+    session->idleTimer_.spreadIs(sessionTimerSpread, std::hash<HashKey>()(h));
 
-    ipAddr_ = IpAddress6(s[0]);
-    port_ = s[1];
+    return session;
+}
 
+bool
+IKEv2Session6::keepAlive() {
+    std::unique_lock<std::mutex> lock(sessionMutex_);
+    if (dead_) {
+        return false;
+    }
+    idleTimer_.reset(SESSION_TIMEOUT);
+    return true;
 }
 
 S32
@@ -284,11 +536,48 @@ IKEv2Session6::handleSession(std::deque<SCHAR *> & pktList) {
 }
 
 void
-IKEv2Session6::handleTimeout(HashKey hash) {
+IKEv2Session6::handleTimeout() {
     TRACE();
+    // keepAlive() takes same lock, so packet either rearms timer
+    // before check below or finds session dead afterwards
+    std::unique_lock<std::mutex> lock(sessionMutex_);
+    // Packet arrived after timer fired, session is active again
+    if (idleTimer_.armed()) {
+        return;
+    }
+
+    dead_ = true;
+    // Peer may have moved and other session taken old address,
+    // remove only entries still pointing at this session
+    sessionMap_.erase(hash_, this);
+    if (responderSpi_ != 0) {
+        spiTable_.erase(responderSpi_);
+    }
+    LOGT("%s successfully deleted after timeout", hash_.toString().c_str());
+}
+
+HashKey
+IKEv2Session6::key() {
+    std::unique_lock<std::mutex> lock(sessionMutex_);
+    return hash_;
+}
+
+void
+IKEv2Session6::keyIs(const HashKey & h) {
+    std::unique_lock<std::mutex> lock(sessionMutex_);
+    hash_ = h;
+}
+
+U64
+IKEv2Session6::responderSpi() {
     std::unique_lock<std::mutex> lock(sessionMutex_);
-    globalIKEv2Session6Map.erase(hash);
-    LOGT("%s successfully deleted after timeout", hash.c_str());
+    return responderSpi_;
+}
+
+void
+IKEv2Session6::responderSpiIs(U64 spi) {
+    std::unique_lock<std::mutex> lock(sessionMutex_);
+    responderSpi_ = spi;
 }
 
 IKEv2Session6::~IKEv2Session6() {
@@ -301,7 +590,14 @@ IKEv2Session6::~IKEv2Session6() {
 UdpEndpoint::UdpEndpoint() : stopThread_(false),
                              eventFd_(-1),
                              sockfd_(-1),
-                             eventNotifier_("NetworkNotifier") {
+                             eventNotifier_("NetworkNotifier"),
+                             rcvBatchSize_(NW_RCV_BATCH_SIZE),
+                             rcvBatches_(0),
+                             rcvPkts_(0),
+                             sendBatchSize_(NW_SEND_BATCH_SIZE),
+                             sendDrops_(0),
+                             reusePort_(false),
+                             ioBackendType_(ASIO::IOBackend::Type::EPOLL) {
     TRACE();
 }
 
@@ -336,19 +632,183 @@ UdpEndpoint::eventNotifier() {
     return eventNotifier_;
 }
 
+void
+UdpEndpoint::rcvBatchSizeIs(U32 size) {
+    TRACE();
+    // recvmmsg() needs room for at least one datagram
+    rcvBatchSize_ = size > 0 ? size : 1;
+}
+
+U32
+UdpEndpoint::rcvBatchSize() const {
+    return rcvBatchSize_;
+}
+
+double
+UdpEndpoint::avgRcvBatchSize() const {
+    U64 batches = rcvBatches_.load(std::memory_order_relaxed);
+    if (batches == 0) {
+        return 0;
+    }
+    return static_cast<double>(rcvPkts_.load(std::memory_order_relaxed)) / batches;
+}
+
+void
+UdpEndpoint::rcvBatchDone(U32 pkts) {
+    rcvBatches_.fetch_add(1, std::memory_order_relaxed);
+    rcvPkts_.fetch_add(pkts, std::memory_order_relaxed);
+}
+
+void
+UdpEndpoint::sendBatchSizeIs(U32 size) {
+    TRACE();
+    sendBatchSize_ = size > 0 ? size : 1;
+}
+
+U32
+UdpEndpoint::sendBatchSize() const {
+    return sendBatchSize_;
+}
+
+U64
+UdpEndpoint::sendDrops() const {
+    U64 drops = sendDrops_.load(std::memory_order_relaxed);
+    if (ioBackend_) {
+        drops += ioBackend_->sendDrops();
+    }
+    return drops;
+}
+
+void
+UdpEndpoint::reusePortIs(bool reusePort) {
+    TRACE();
+    reusePort_ = reusePort;
+}
+
+bool
+UdpEndpoint::reusePort() const {
+    return reusePort_;
+}
+
+// Attach classic BPF program to SO_REUSEPORT group which selects
+// socket by initiator SPI instead of 4-tuple hash. Initiator SPI
+// stays same for lifetime of IKE SA, so peer's packets keep landing
+// on owning shard after NAT rebinding or MOBIKE address change.
+// Program sees UDP payload and returns socket index in bind order,
+// index >= no. of sockets makes kernel fall back to hash
+S32
+UdpEndpoint::attachSpiSteering(U32 shardCount) {
+    TRACE();
+
+    if (shardCount == 0) {
+        return -1;
+    }
+
+    struct sock_filter code[] = {
+        // A = datagram length
+        BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+        // Not an IKE message, use hash
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, IKEv2::IKEV2_HEADER_LEN, 0, 3),
+        // A = low 32 bits of initiator SPI
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, IKEv2::IKEV2_INITIATOR_SPI_OFFSET + 4),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, shardCount),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+    };
+
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+
+    if (setsockopt(sockfd_, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   &prog, sizeof(prog)) == -1) {
+        LOG(ERROR, "setsockopt failed to set SO_ATTACH_REUSEPORT_CBPF");
+        perror("setsockopt");
+        return -1;
+    }
+
+    LOG(INFO, "Attached SPI steering program for %u shards", shardCount);
+    return 0;
+}
+
+void
+UdpEndpoint::ioBackendIs(ASIO::IOBackend::Type type) {
+    TRACE();
+    ioBackendType_ = type;
+}
+
+double
+UdpEndpoint::syscallsPerDatagram() const {
+    if (!ioBackend_ || ioBackend_->datagrams() == 0) {
+        return 0;
+    }
+    return static_cast<double>(ioBackend_->syscalls()) / ioBackend_->datagrams();
+}
+
+// Make socket non-blocking and hand it to I/O backend along with
+// stop notifier. io_uring may be unavailable(old kernel, seccomp),
+// in which case endpoint falls back to epoll
+S32
+UdpEndpoint::initBackend(const std::string & name) {
+    TRACE();
+
+    // Make socket non-blocking
+    if (Utils::setFdNonBlocking(sockfd_) == -1) {
+        LOG(ERROR, "Failed to make server socket non-blocking");
+        return -1;
+    }
+
+    // Create notifier event for stopping thread
+    // Main thread will notify if thread has be be
+    // cleaned up in case of success or failure
+    eventFd_ = eventNotifier_.createNotifier(0, EFD_SEMAPHORE);
+    if (eventFd_ == -1) {
+        LOG(ERROR, "Failed to create eventfd");
+        return -1;
+    }
+
+    ioBackend_ = ASIO::IOBackend::create(ioBackendType_, name);
+    if (ioBackend_->init(sockfd_, eventNotifier_, STOP_NW_THREAD,
+                         rcvBatchSize_, NW_MAX_DATAGRAM) == 0) {
+        return 0;
+    }
+
+    if (ioBackendType_ == ASIO::IOBackend::Type::EPOLL) {
+        return -1;
+    }
+
+    LOG(ERROR, "io_uring unavailable, falling back to epoll : %s", name.c_str());
+    ioBackend_ = ASIO::IOBackend::create(ASIO::IOBackend::Type::EPOLL, name);
+    return ioBackend_->init(sockfd_, eventNotifier_, STOP_NW_THREAD,
+                            rcvBatchSize_, NW_MAX_DATAGRAM);
+}
+
+// Flush count messages using as few sendmmsg() calls as possible.
+// Used by send thread which shares socket with receive thread
+S32
+UdpEndpoint::sendBatch(struct mmsghdr * msgs, U32 count) {
+    TRACE();
+    U64 drops = 0;
+    U64 syscalls = 0;
+
+    S32 ret = ASIO::sendAllMsgs(sockfd_, msgs, count, stopThread_, drops, syscalls);
+    sendDrops_.fetch_add(drops, std::memory_order_relaxed);
+    return ret;
+}
+
 // End of class UdpEndpoint
 
 // Start of class UdpEndpoint4
 
 UdpEndpoint4::UdpEndpoint4(const IpAddress4 & srvAddr,
-                           const NetworkPort & srvPort) {
+                           const NetworkPort & srvPort) : shard_(nullptr) {
     TRACE();
     ipVersionIs(IpVersion::IPv4);
     sourceAddress_ = srvAddr;
     sourcePort_ = srvPort;
 }
 
-UdpEndpoint4::UdpEndpoint4(const UdpEndpoint4 & other) {
+UdpEndpoint4::UdpEndpoint4(const UdpEndpoint4 & other) : shard_(nullptr) {
     TRACE();
 }
 
@@ -396,12 +856,25 @@ UdpEndpoint4::initUdpEndpoint() {
                 return -1;
             }
 
+            // Sharded mode binds one socket per shard on same port
+            // and lets kernel distribute datagrams across them
+            if (reusePort_ &&
+                setsockopt(sockfd_, SOL_SOCKET, SO_REUSEPORT,
+                           &reUseAddr, sizeof(reUseAddr)) == -1) {
+                LOG(ERROR, "IPv4: setsockopt failed to set SO_REUSEPORT");
+                perror("setsockopt");
+                return -1;
+            }
+
             struct sockaddr_in *ipv4 = (struct sockaddr_in *)iter->ai_addr;
 
             // If bind fails close socket and try next interface
             if (bind(sockfd_, (struct sockaddr *)ipv4, sizeof(*ipv4)) == -1) {
                 perror("IPv4: bind failed");
                 close(sockfd_);
+                // Descriptor no. may be handed out again, don't
+                // close it twice on teardown
+                sockfd_ = -1;
                 continue;
             }
 
@@ -430,15 +903,15 @@ UdpEndpoint4::initUdpEndpoint() {
 S32
 UdpEndpoint4::send() {
     TRACE();
-    //struct sockaddr_in peer;
-    //struct msghdr msg;
-    //struct iovec iov;
-    //sendmsg
-    PeerData4::Ptr elem;
+    const U32 batchSize = sendBatchSize_;
+    std::vector<PeerData4::Ptr> batch;
+    MsgBatch<struct sockaddr_in> msgBatch(batchSize);
+
+    batch.reserve(batchSize);
 
     LOG(INFO, "IPv4: Send thread created successfully");
 
-    // deque packets and send
+    // deque all pending packets and flush them together
     while (true) {
         if (stopThread_) {
             return 0;
@@ -450,34 +923,24 @@ UdpEndpoint4::send() {
             return 0;
         }
 
-        if (!globalSendPktQ4.getPkt(elem)) {
+        if (!globalSendPktQ4.getPkts(batch, batchSize)) {
             continue;
         }
 
-        // sockfd
-        // buffer
-        // buffer len
-        // flags
-        // struct sockaddr
-        // sockaddr len
-        S32 ret = sendto(sockfd_,
-                         &elem->buffer,
-                         elem->bufferLen,
-                         0,
-                         (struct sockaddr *)&elem->peer,
-                         sizeof(elem->peer));
-        if (ret == -1) {
-            LOG(ERROR, "IPv4: Error in sendto");
-            perror("sendto");
+        for (U32 idx = 0; idx < batch.size(); ++idx) {
+            msgBatch.slotIs(idx, batch[idx]->buffer.data(), batch[idx]->bufferLen,
+                            &batch[idx]->peer);
+        }
+
+        if (sendBatch(msgBatch.msgs(), batch.size()) == -1) {
+            LOG(ERROR, "IPv4: Error in sendmmsg");
             return -1;
         }
 
-        //globalIKEv2Session4Map.erase(elem->hash);
+        LOG(INFO, "IPv4: Sent batch of %zu packets", batch.size());
 
-        LOG(INFO, "IPv4: rcvQ.size() %d", globalRcvPktQ4.queue().size());
-        LOG(INFO, "IPv4: sendQ.size() %d", globalSendPktQ4.queue().size());
-        LOG(INFO, "IPv4: rcvQ.empty() %d", globalRcvPktQ4.queue().empty());
-        LOG(INFO, "IPv4: sendQ.empty() %d", globalSendPktQ4.queue().empty());
+        // Release packets before blocking on queue again
+        batch.clear();
     }  // end of while (true)
     return 0;
 }
@@ -486,95 +949,195 @@ UdpEndpoint4::send() {
 S32
 UdpEndpoint4::receive() {
     TRACE();
-    S32 bytes;
-    S32 peerLen = sizeof(struct sockaddr_in);
-    SCHAR buffer[BUFFLEN];
-    struct sockaddr_in peer;
-    ASIO::AsyncIOHandler asioHdl(NW_MAX_EVENTS, "NetworkPoller4");
+    std::vector<PeerData4::Ptr> batch;
 
-    // Make socket non-blocking
-    if (Utils::setFdNonBlocking(sockfd_) == -1) {
-        LOG(ERROR, "IPv4: Failed to make server socket non-blocking");
-        return -1;
-    }
+    batch.reserve(rcvBatchSize_);
 
-    // Create poller object
-    if (asioHdl.createPoller() == -1) {
+    if (initBackend("NetworkPoller4") == -1) {
+        LOG(ERROR, "IPv4: Failed to initialize I/O backend");
         return -1;
     }
 
-    // Add nw socket to poller object
-    if (asioHdl.addFd(sockfd_) == -1) {
+    // Main thread loop
+    while (true) {
+        if (!stopThread_) {
+            // Block here waiting for datagrams
+            S32 ret = receiveBatch(batch);
+            if (ret == ASIO::IO_STOP) {
+                LOG(INFO, "IPv4: Nw thread received stop event");
+                stopThread_ = true;
+                return 0;
+            } else if (ret == -1) {
+                return -1;
+            }
+
+            // Add whole batch to receive queue and notify handlers
+            globalRcvPktQ4.addPkts(batch);
+        } else {
+            LOG(INFO, "IPv4: Nw thread stopped" );
+            return 0;
+        }
+    }  // end of while (true)
+
+    return 0;
+}
+
+S32
+UdpEndpoint4::runShard() {
+    TRACE();
+    if (shard_ == nullptr) {
+        LOG(ERROR, "IPv4: Endpoint is not bound to any shard");
         return -1;
     }
 
-    // Create notifier event for stopping thread
-    // Main thread will notify if thread has be be
-    // cleaned up in case of success or failure
-    eventFd_ = eventNotifier_.createNotifier(0, EFD_SEMAPHORE);
-    if (eventFd_ == -1) {
-        LOG(ERROR, "IPv4: Failed to create eventfd");
+    std::vector<PeerData4::Ptr> batch;
+    std::vector<PeerData4::Ptr> replies;
+
+    MsgBatch<struct sockaddr_in> sendMsgs(rcvBatchSize_);
+    batch.reserve(rcvBatchSize_);
+    replies.reserve(rcvBatchSize_);
+
+    if (initBackend("ShardPoller4") == -1) {
+        LOG(ERROR, "IPv4: Failed to initialize shard %d I/O backend", shard_->id);
         return -1;
     }
 
-    // Add event fd to poller object
-    if (asioHdl.addFd(eventFd_) == -1) {
+    // Shard timers expire on this thread, woken through timerfd
+    S32 timerFd = shard_->timer.createTimerFd();
+    if (timerFd == -1 ||
+        ioBackend_->watchFd(timerFd, [this](U32 events) { shard_->timer.handleTimerFd(); }) == -1) {
+        LOG(ERROR, "IPv4: Failed to watch shard %d timer", shard_->id);
         return -1;
     }
 
-    // Main thread loop
+    // Send replies collected so far with single sendmmsg()
+    auto flushReplies = [&]() {
+        for (U32 idx = 0; idx < replies.size(); ++idx) {
+            sendMsgs.slotIs(idx, replies[idx]->buffer.data(), replies[idx]->bufferLen,
+                            &replies[idx]->peer);
+        }
+        S32 ret = ioBackend_->send(sendMsgs.msgs(), replies.size());
+        replies.clear();
+        return ret;
+    };
+
     while (true) {
-        if (!stopThread_) {
-            // Block here waiting for event on poller
-            S32 polledFd = asioHdl.watchFds();
-            if (polledFd == sockfd_) {
-                LOG(INFO, "IPv4: UDP socket has become available");
-                bytes = recvfrom(sockfd_, buffer, BUFFLEN, 0,
-                                 (struct sockaddr *)&peer,
-                                 (socklen_t *)&peerLen);
-
-                if (bytes == -1) {
-                    LOG(ERROR, "IPv4: recvfrom() failed in receive()");
-                    perror("recvfrom");
-                    return -1;
-                }
+        if (stopThread_) {
+            LOG(INFO, "IPv4: Shard %d stopped", shard_->id);
+            return 0;
+        }
+
+        S32 ret = receiveBatch(batch);
+        if (ret == ASIO::IO_STOP) {
+            LOG(INFO, "IPv4: Shard %d received stop event", shard_->id);
+            stopThread_ = true;
+            return 0;
+        } else if (ret == -1) {
+            return -1;
+        } else {
 
-                buffer[bytes] = '\0';
+            shard_->rcvQ.addPkts(batch);
+
+            // Run to completion: packets are processed and answered
+            // on this thread, nothing crosses to another core
+            while (shard_->rcvQ.tryGetPkts(batch, rcvBatchSize_)) {
+                for (auto & elem : batch) {
+                    U32 owner = spiShard(elem->buffer.data(), elem->bufferLen, shard_->count);
+                    if (owner < shard_->count && owner != shard_->id) {
+                        shard_->steeringMisses++;
+                    }
+
+                    auto reply = IKEv2SessionManager4::processPkt(elem,
+                                                                 shard_->sessions,
+                                                                 shard_->spis,
+                                                                 shard_->timer);
+                    if (reply) {
+                        replies.push_back(reply);
+                    }
+                    if (replies.size() == sendMsgs.size() && flushReplies() == -1) {
+                        return -1;
+                    }
+                }
+                batch.clear();
+            }
 
-                auto peerData = PeerData4::Ptr(new PeerData4());
+            if (!replies.empty() && flushReplies() == -1) {
+                return -1;
+            }
+        }
+    }
 
-                peerData->peer = peer;
-                peerData->bufferLen = bytes;
-                memcpy(peerData->buffer, buffer, peerData->bufferLen);
+    return 0;
+}
 
-                IpAddress4 ipAddr = sinAddrToStr((void*)&peerData->peer.sin_addr);
-                NetworkPort port = std::to_string(ntohs(peerData->peer.sin_port));
+void
+UdpEndpoint4::shardIs(Shard4 * shard) {
+    TRACE();
+    shard_ = shard;
+}
 
-                peerData->hash = ipAddr.toString() + "-" + port;
+// Wait for datagrams from I/O backend and append them to batch.
+// Returns no. of datagrams read, ASIO::IO_STOP or -1 on error
+S32
+UdpEndpoint4::receiveBatch(std::vector<PeerData4::Ptr> & batch) {
+    TRACE();
 
-                LOG(INFO, "IPv4: Received packet from %s:%s", ipAddr.toRawString(), port.c_str());
-                LOGT("IPv4: Client sent data : %s:%s", ipAddr.toRawString(), port.c_str());
+    // Slot is sized for datagram if backend knows its size, else
+    // datagram lands in NW_LANDING_SIZE buffer
+    auto slots = [&](U32 idx, U32 sizeHint) {
+        if (idx >= rcvSlots_.size()) {
+            rcvSlots_.resize(idx + 1);
+        }
+        auto & peerData = rcvSlots_[idx];
+        if (!peerData) {
+            peerData = PeerData4::create();
+        }
+        peerData->buffer.reserve(sizeHint > 0 ? sizeHint : NW_LANDING_SIZE);
+        return ASIO::IOBackend::RcvSlot{peerData->buffer.data(),
+                                        static_cast<U32>(peerData->buffer.capacity()),
+                                        (struct sockaddr *)&peerData->peer,
+                                        sizeof(peerData->peer)};
+    };
+
+    S32 pkts = ioBackend_->receive(slots, [&](U32 idx, S32 len,
+                                              const SCHAR * overflow,
+                                              bool truncated) {
+        // Slot is reused by next batch
+        if (truncated) {
+            LOG(ERROR, "IPv4: Dropping truncated datagram");
+            return;
+        }
 
-                // Add pkt to receive queue and notify handler
-                globalRcvPktQ4.addPkt(peerData);
+        auto & peerData = rcvSlots_[idx];
 
-            } else if (polledFd == eventFd_) {
-                if (eventNotifier_.readEvent(STOP_NW_THREAD)) {
-                    LOG(INFO, "IPv4: Nw thread received stop event");
-                    stopThread_ = true;
-                    return 0;
-                    // Notify all threads to stop executing
-                }
-            } else {
-                LOG(ERROR, "IPv4: Unknown fd polled %d", polledFd);
+        // Datagram spilled over landing buffer, move it to buffer of
+        // matching size class
+        if (overflow != nullptr) {
+            std::size_t landed = peerData->buffer.capacity();
+            Pool::Buffer buffer;
+            if (!buffer.reserve(len)) {
+                LOG(ERROR, "IPv4: Dropping oversized datagram");
+                return;
             }
-        } else {
-            LOG(INFO, "IPv4: Nw thread stopped" );
-            return 0;
+            memcpy(buffer.data(), peerData->buffer.data(), landed);
+            memcpy(buffer.data() + landed, overflow, len - landed);
+            peerData->buffer = std::move(buffer);
         }
-    }  // end of while (true)
 
-    return 0;
+        peerData->bufferLen = len;
+
+        peerData->hash = HashKey::fromSockAddr(peerData->peer);
+
+        LOG(INFO, "IPv4: Received packet from %s", peerData->hash.toString().c_str());
+
+        batch.push_back(std::move(peerData));
+    });
+
+    if (pkts > 0) {
+        rcvBatchDone(pkts);
+    }
+
+    return pkts;
 }
 
 inline void
@@ -650,7 +1213,7 @@ UdpEndpoint4::~UdpEndpoint4() {
 
 // Start of UdpEndpoint6
 UdpEndpoint6::UdpEndpoint6(const IpAddress6 & srvAddr,
-                           const NetworkPort & srvPort) {
+                           const NetworkPort & srvPort) : shard_(nullptr) {
     TRACE();
     ipVersionIs(IpVersion::IPv6);
     sourceAddress_ = srvAddr;
@@ -658,7 +1221,7 @@ UdpEndpoint6::UdpEndpoint6(const IpAddress6 & srvAddr,
                            }
 
 // XXX Remove this
-UdpEndpoint6::UdpEndpoint6(const UdpEndpoint6 & other) {
+UdpEndpoint6::UdpEndpoint6(const UdpEndpoint6 & other) : shard_(nullptr) {
     TRACE();
 }
 
@@ -706,11 +1269,24 @@ UdpEndpoint6::initUdpEndpoint() {
                 return -1;
             }
 
+            // Sharded mode binds one socket per shard on same port
+            // and lets kernel distribute datagrams across them
+            if (reusePort_ &&
+                setsockopt(sockfd_, SOL_SOCKET, SO_REUSEPORT,
+                           &reUseAddr, sizeof(reUseAddr)) == -1) {
+                LOG(ERROR, "IPv6: setsockopt failed to set SO_REUSEPORT");
+                perror("setsockopt");
+                return -1;
+            }
+
             struct sockaddr_in6 *ipv6 = (struct sockaddr_in6 *)iter->ai_addr;
 
             if (bind(sockfd_, (struct sockaddr *)ipv6, sizeof(*ipv6)) == -1) {
                 perror("IPv6: bind failed");
                 close(sockfd_);
+                // Descriptor no. may be handed out again, don't
+                // close it twice on teardown
+                sockfd_ = -1;
                 continue;
             }
 
@@ -739,15 +1315,15 @@ UdpEndpoint6::initUdpEndpoint() {
 S32
 UdpEndpoint6::send() {
     TRACE();
-    //struct sockaddr_in peer;
-    //struct msghdr msg;
-    //struct iovec iov;
-    //sendmsg
-    PeerData6::Ptr elem;
+    const U32 batchSize = sendBatchSize_;
+    std::vector<PeerData6::Ptr> batch;
+    MsgBatch<struct sockaddr_in6> msgBatch(batchSize);
+
+    batch.reserve(batchSize);
 
     LOG(INFO, "IPv6: Send thread created successfully");
 
-    // deque packets and send
+    // deque all pending packets and flush them together
     while (true) {
         if (stopThread_) {
             return 0;
@@ -759,30 +1335,24 @@ UdpEndpoint6::send() {
             return 0;
         }
 
-        // Returns reference to first pkt in queue
-        if (!globalSendPktQ6.getPkt(elem)) {
+        if (!globalSendPktQ6.getPkts(batch, batchSize)) {
             continue;
         }
 
-        S32 ret = sendto(sockfd_,
-                         &elem->buffer,
-                         elem->bufferLen,
-                         0,
-                         (struct sockaddr *)&elem->peer,
-                         sizeof(elem->peer));
-        if (ret == -1) {
-            LOG(ERROR, "IPv6: Error in sendto");
-            perror("sendto");
-            return -1;
+        for (U32 idx = 0; idx < batch.size(); ++idx) {
+            msgBatch.slotIs(idx, batch[idx]->buffer.data(), batch[idx]->bufferLen,
+                            &batch[idx]->peer);
         }
 
-        //globalIKEv2Session6Map.erase(elem->hash);
+        if (sendBatch(msgBatch.msgs(), batch.size()) == -1) {
+            LOG(ERROR, "IPv6: Error in sendmmsg");
+            return -1;
+        }
 
-        LOG(INFO, "IPv6: rcvQueue_.queue().size() %d", globalRcvPktQ6.queue().size());
-        LOG(INFO, "IPv6: sendQ_.queue().size() %d", globalSendPktQ6.queue().size());
-        LOG(INFO, "IPv6: rcvQueue_.queue().empty() %d", globalRcvPktQ6.queue().empty());
-        LOG(INFO, "IPv6: sendQ_.queue().empty() %d", globalSendPktQ6.queue().empty());
+        LOG(INFO, "IPv6: Sent batch of %zu packets", batch.size());
 
+        // Release packets before blocking on queue again
+        batch.clear();
     }  // end of while (true)
     return 0;
 }
@@ -790,92 +1360,195 @@ UdpEndpoint6::send() {
 S32
 UdpEndpoint6::receive() {
     TRACE();
-    S32 bytes;
-    S32 peerLen = sizeof(struct sockaddr_in6);
-    SCHAR buffer[BUFFLEN];
-    struct sockaddr_in6 peer;
-    ASIO::AsyncIOHandler asioHdl(NW_MAX_EVENTS, "NetworkPoller6");
+    std::vector<PeerData6::Ptr> batch;
 
-    // Make socket non-blocking
-    if (Utils::setFdNonBlocking(sockfd_) == -1) {
-        LOG(ERROR, "IPv6: Failed to make server socket non-blocking");
-    }
+    batch.reserve(rcvBatchSize_);
 
-    // Create poller object
-    if (asioHdl.createPoller() == -1) {
+    if (initBackend("NetworkPoller6") == -1) {
+        LOG(ERROR, "IPv6: Failed to initialize I/O backend");
         return -1;
     }
 
-    // Add nw socket to poller object
-    if (asioHdl.addFd(sockfd_) == -1) {
+    // Main thread loop
+    while (true) {
+        if (!stopThread_) {
+            // Block here waiting for datagrams
+            S32 ret = receiveBatch(batch);
+            if (ret == ASIO::IO_STOP) {
+                LOG(INFO, "IPv6: Nw thread received stop event");
+                stopThread_ = true;
+                return 0;
+            } else if (ret == -1) {
+                return -1;
+            }
+
+            // Add whole batch to receive queue and notify handlers
+            globalRcvPktQ6.addPkts(batch);
+        } else {
+            LOG(INFO, "IPv6: Nw thread stopped" );
+            return 0;
+        }
+    }  // end of while (true)
+
+    return 0;
+}
+
+S32
+UdpEndpoint6::runShard() {
+    TRACE();
+    if (shard_ == nullptr) {
+        LOG(ERROR, "IPv6: Endpoint is not bound to any shard");
         return -1;
     }
 
-    // Create notifier event for stopping thread
-    // Main thread will notify if thread has be be
-    // cleaned up in case of success or failure
-    eventFd_ = eventNotifier_.createNotifier(0, EFD_SEMAPHORE);
-    if (eventFd_ == -1) {
-        LOG(ERROR, "IPv6: Failed to create eventfd");
+    std::vector<PeerData6::Ptr> batch;
+    std::vector<PeerData6::Ptr> replies;
+
+    MsgBatch<struct sockaddr_in6> sendMsgs(rcvBatchSize_);
+    batch.reserve(rcvBatchSize_);
+    replies.reserve(rcvBatchSize_);
+
+    if (initBackend("ShardPoller6") == -1) {
+        LOG(ERROR, "IPv6: Failed to initialize shard %d I/O backend", shard_->id);
         return -1;
     }
 
-    // Add event fd to poller object
-    if (asioHdl.addFd(eventFd_) == -1) {
+    // Shard timers expire on this thread, woken through timerfd
+    S32 timerFd = shard_->timer.createTimerFd();
+    if (timerFd == -1 ||
+        ioBackend_->watchFd(timerFd, [this](U32 events) { shard_->timer.handleTimerFd(); }) == -1) {
+        LOG(ERROR, "IPv6: Failed to watch shard %d timer", shard_->id);
         return -1;
     }
 
-    // Main thread loop
+    // Send replies collected so far with single sendmmsg()
+    auto flushReplies = [&]() {
+        for (U32 idx = 0; idx < replies.size(); ++idx) {
+            sendMsgs.slotIs(idx, replies[idx]->buffer.data(), replies[idx]->bufferLen,
+                            &replies[idx]->peer);
+        }
+        S32 ret = ioBackend_->send(sendMsgs.msgs(), replies.size());
+        replies.clear();
+        return ret;
+    };
+
     while (true) {
-        if (!stopThread_) {
-            // Block here waiting for event on poller
-            S32 polledFd = asioHdl.watchFds();
-            if (polledFd == sockfd_) {
-                LOG(INFO, "IPv6: UDP socket has become available");
-                bytes = recvfrom(sockfd_, buffer, BUFFLEN, 0,
-                                 (struct sockaddr *)&peer,
-                                 (socklen_t *)&peerLen);
-
-                if (bytes == -1) {
-                    LOG(ERROR, "IPv6: recvfrom() failed in receive()");
-                    perror("recvfrom");
-                    return -1;
+        if (stopThread_) {
+            LOG(INFO, "IPv6: Shard %d stopped", shard_->id);
+            return 0;
+        }
+
+        S32 ret = receiveBatch(batch);
+        if (ret == ASIO::IO_STOP) {
+            LOG(INFO, "IPv6: Shard %d received stop event", shard_->id);
+            stopThread_ = true;
+            return 0;
+        } else if (ret == -1) {
+            return -1;
+        } else {
+
+            shard_->rcvQ.addPkts(batch);
+
+            // Run to completion: packets are processed and answered
+            // on this thread, nothing crosses to another core
+            while (shard_->rcvQ.tryGetPkts(batch, rcvBatchSize_)) {
+                for (auto & elem : batch) {
+                    U32 owner = spiShard(elem->buffer.data(), elem->bufferLen, shard_->count);
+                    if (owner < shard_->count && owner != shard_->id) {
+                        shard_->steeringMisses++;
+                    }
+
+                    auto reply = IKEv2SessionManager6::processPkt(elem,
+                                                                 shard_->sessions,
+                                                                 shard_->spis,
+                                                                 shard_->timer);
+                    if (reply) {
+                        replies.push_back(reply);
+                    }
+                    if (replies.size() == sendMsgs.size() && flushReplies() == -1) {
+                        return -1;
+                    }
                 }
+                batch.clear();
+            }
 
-                buffer[bytes] = '\0';
+            if (!replies.empty() && flushReplies() == -1) {
+                return -1;
+            }
+        }
+    }
 
-                auto peerData = PeerData6::Ptr(new PeerData6());
+    return 0;
+}
 
-                peerData->peer = peer;
-                peerData->bufferLen = bytes;
-                memcpy(peerData->buffer, buffer, peerData->bufferLen);
+void
+UdpEndpoint6::shardIs(Shard6 * shard) {
+    TRACE();
+    shard_ = shard;
+}
 
-                IpAddress6 ipAddr = sinAddrToStr((void*)&peerData->peer.sin6_addr);
-                NetworkPort port = std::to_string(ntohs(peerData->peer.sin6_port));
-                peerData->hash = ipAddr.toString() + "-" + port;
+// Wait for datagrams from I/O backend and append them to batch.
+// Returns no. of datagrams read, ASIO::IO_STOP or -1 on error
+S32
+UdpEndpoint6::receiveBatch(std::vector<PeerData6::Ptr> & batch) {
+    TRACE();
 
-                LOG(INFO, "IPv6: Received packet from %s:%s", ipAddr.toRawString(), port.c_str());
+    // Slot is sized for datagram if backend knows its size, else
+    // datagram lands in NW_LANDING_SIZE buffer
+    auto slots = [&](U32 idx, U32 sizeHint) {
+        if (idx >= rcvSlots_.size()) {
+            rcvSlots_.resize(idx + 1);
+        }
+        auto & peerData = rcvSlots_[idx];
+        if (!peerData) {
+            peerData = PeerData6::create();
+        }
+        peerData->buffer.reserve(sizeHint > 0 ? sizeHint : NW_LANDING_SIZE);
+        return ASIO::IOBackend::RcvSlot{peerData->buffer.data(),
+                                        static_cast<U32>(peerData->buffer.capacity()),
+                                        (struct sockaddr *)&peerData->peer,
+                                        sizeof(peerData->peer)};
+    };
+
+    S32 pkts = ioBackend_->receive(slots, [&](U32 idx, S32 len,
+                                              const SCHAR * overflow,
+                                              bool truncated) {
+        // Slot is reused by next batch
+        if (truncated) {
+            LOG(ERROR, "IPv6: Dropping truncated datagram");
+            return;
+        }
 
-                globalRcvPktQ6.addPkt(peerData);
+        auto & peerData = rcvSlots_[idx];
 
-                LOG(INFO, "Data: %s", buffer);
-            } else if (polledFd == eventFd_) {
-                if (eventNotifier_.readEvent(STOP_NW_THREAD)) {
-                    LOG(INFO, "IPv6: Nw thread received stop event");
-                    stopThread_ = true;
-                    return 0;
-                    // Notify all threads to stop executing
-                }
-            } else {
-                LOG(ERROR, "IPv6: Unknown fd polled %d", polledFd);
+        // Datagram spilled over landing buffer, move it to buffer of
+        // matching size class
+        if (overflow != nullptr) {
+            std::size_t landed = peerData->buffer.capacity();
+            Pool::Buffer buffer;
+            if (!buffer.reserve(len)) {
+                LOG(ERROR, "IPv6: Dropping oversized datagram");
+                return;
             }
-        } else {
-            LOG(INFO, "IPv6: Nw thread stopped" );
-            return 0;
+            memcpy(buffer.data(), peerData->buffer.data(), landed);
+            memcpy(buffer.data() + landed, overflow, len - landed);
+            peerData->buffer = std::move(buffer);
         }
-    }  // end of while (true)
 
-    return 0;
+        peerData->bufferLen = len;
+
+        peerData->hash = HashKey::fromSockAddr(peerData->peer);
+
+        LOG(INFO, "IPv6: Received packet from %s", peerData->hash.toString().c_str());
+
+        batch.push_back(std::move(peerData));
+    });
+
+    if (pkts > 0) {
+        rcvBatchDone(pkts);
+    }
+
+    return pkts;
 }
 
 inline void
@@ -17,15 +17,20 @@
 
 #pragma once
 
+#include <poll.h>
 #include <netdb.h>   // getaddrinfo()
 #include <unistd.h>  // close()
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <linux/filter.h>  // struct sock_fprog
 
 #include <mutex>
 #include <memory>
+#include <vector>
+#include <array>
+#include <atomic>
 #include <condition_variable>
 #include <boost/algorithm/string.hpp>
 
@@ -33,14 +38,23 @@
 #include "basictypes.hh"
 #include "synchro.hh"
 #include "asyncio.hh"
+#include "iobackend.hh"
 #include "utils.hh"
 #include "timer.hh"
 #include "queue.hh"
+#include "pool.hh"
 #include "map.hh"
+#include "spitable.hh"
 #include "basictypes.hh"
 #include "ipaddress.hh"
+#include "ikev2pkt.hh"
 
-#define BUFFLEN 1024
+// Largest datagram accepted, IKE messages with certificate chains
+// may need jumbo frames
+#define NW_MAX_DATAGRAM 65535
+// Buffer size datagrams of unknown size land in. Bigger datagrams
+// are moved to buffer of matching size class
+#define NW_LANDING_SIZE 2048
 
 #define SERVER_ADDR4 "127.0.0.1"
 #define SERVER_ADDR6 "::"
@@ -49,7 +63,76 @@
 
 using NetworkPort = std::string;
 using Interface = std::string;
-using HashKey = std::string;
+
+// Peer endpoint identifying session. Built straight from sockaddr
+// and hashed as raw bytes, toString() is meant for logging only
+struct EndpointKey {
+    U16 family;    // AF_INET or AF_INET6
+    U16 port;      // Network byte order
+    U8 addr[16];   // IPv4 address uses first 4 bytes, rest is zero
+
+    static EndpointKey fromSockAddr(const struct sockaddr_in & peer);
+    static EndpointKey fromSockAddr(const struct sockaddr_in6 & peer);
+    bool operator==(const EndpointKey & other) const;
+    bool operator!=(const EndpointKey & other) const;
+    // "address-port" as used to be stored in session hash
+    std::string toString() const;
+};
+
+using HashKey = EndpointKey;
+
+namespace std {
+
+template<>
+struct hash<EndpointKey> {
+    std::size_t operator()(const EndpointKey & key) const {
+        U64 lo, hi;
+        memcpy(&lo, key.addr, sizeof(lo));
+        memcpy(&hi, key.addr + sizeof(lo), sizeof(hi));
+
+        // Mix address halves with port / family(murmur3 finalizer)
+        U64 h = lo ^ (hi * 0x9e3779b97f4a7c15ULL) ^
+                ((static_cast<U64>(key.port) << 16) | key.family);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return static_cast<std::size_t>(h);
+    }
+};
+
+}  // namespace std
+
+inline EndpointKey
+EndpointKey::fromSockAddr(const struct sockaddr_in & peer) {
+    EndpointKey key;
+    memset(&key, 0, sizeof(key));
+    key.family = AF_INET;
+    key.port = peer.sin_port;
+    memcpy(key.addr, &peer.sin_addr, sizeof(peer.sin_addr));
+    return key;
+}
+
+inline EndpointKey
+EndpointKey::fromSockAddr(const struct sockaddr_in6 & peer) {
+    EndpointKey key;
+    key.family = AF_INET6;
+    key.port = peer.sin6_port;
+    memcpy(key.addr, &peer.sin6_addr, sizeof(peer.sin6_addr));
+    return key;
+}
+
+inline bool
+EndpointKey::operator==(const EndpointKey & other) const {
+    return family == other.family && port == other.port &&
+           memcmp(addr, other.addr, sizeof(addr)) == 0;
+}
+
+inline bool
+EndpointKey::operator!=(const EndpointKey & other) const {
+    return !(*this == other);
+}
 
 enum class IpVersion { IPv4, IPv6 };
 
@@ -59,26 +142,117 @@ const S32 STOP_NW_THREAD = 1;
 
 const S32 NW_MAX_EVENTS = 3;
 
+// Default no. of datagrams drained with single recvmmsg() call
+const U32 NW_RCV_BATCH_SIZE = 32;
+
+// Default no. of datagrams flushed with single sendmmsg() call
+const U32 NW_SEND_BATCH_SIZE = 64;
+
+// Time in msec after which idle session is deleted
+const S32 SESSION_TIMEOUT = 3000;
+
+// Default msec session idle timers may fire late, lets timers of
+// sessions active at about same time expire in one batch
+const S32 SESSION_TIMER_SLACK = 100;
+
 // Main thread will read the single socket for data / packet
 // and enqueue packet in packet queue
 // Global packet queue
 
 struct PeerData4 {
+    PeerData4() : bufferLen(0) {}
+
     HashKey hash;
     S32 bufferLen;
-    SCHAR buffer[BUFFLEN];
+    // Size class buffer, contents are left uninitialised
+    Pool::Buffer buffer;
     struct sockaddr_in peer;
     using Ptr = std::shared_ptr<PeerData4>;
+
+    // Packet and its refcount come from single pooled block
+    static Pool::BlockPool & pool() { return Pool::poolFor<PeerData4>("PeerData4"); }
+    static Ptr create() { return Pool::makePooled<PeerData4>(pool()); }
 };
 
 struct PeerData6 {
+    PeerData6() : bufferLen(0) {}
+
     HashKey hash;
     S32 bufferLen;
-    SCHAR buffer[BUFFLEN];
+    // Size class buffer, contents are left uninitialised
+    Pool::Buffer buffer;
     struct sockaddr_in6 peer;
     using Ptr = std::shared_ptr<PeerData6>;
+
+    // Packet and its refcount come from single pooled block
+    static Pool::BlockPool & pool() { return Pool::poolFor<PeerData6>("PeerData6"); }
+    static Ptr create() { return Pool::makePooled<PeerData6>(pool()); }
 };
 
+// Preallocated message headers for recvmmsg() / sendmmsg().
+// Each slot points to caller owned buffer and peer address
+template<typename SockAddr>
+class MsgBatch {
+ public:
+    explicit MsgBatch(U32 size) : iovecs_(size), msgs_(size) {
+        memset(msgs_.data(), 0, msgs_.size() * sizeof(struct mmsghdr));
+    }
+
+    void slotIs(U32 idx, void * buf, std::size_t len, SockAddr * addr) {
+        iovecs_[idx].iov_base = buf;
+        iovecs_[idx].iov_len = len;
+        msgs_[idx].msg_hdr.msg_iov = &iovecs_[idx];
+        msgs_[idx].msg_hdr.msg_iovlen = 1;
+        msgs_[idx].msg_hdr.msg_name = addr;
+        // Kernel overwrites namelen and flags on receive
+        msgs_[idx].msg_hdr.msg_namelen = sizeof(SockAddr);
+        msgs_[idx].msg_hdr.msg_flags = 0;
+        msgs_[idx].msg_len = 0;
+    }
+
+    struct mmsghdr * msgs() { return msgs_.data(); }
+    struct mmsghdr & msg(U32 idx) { return msgs_[idx]; }
+    U32 size() const { return msgs_.size(); }
+ private:
+    std::vector<struct iovec> iovecs_;
+    std::vector<struct mmsghdr> msgs_;
+};
+
+// Shard which owns IKE SA as chosen by reuseport steering program.
+// Returns shardCount if datagram is not IKE and kernel hash is used
+U32 spiShard(const SCHAR * buffer, S32 len, U32 shardCount);
+
+// True if datagram opens new IKE SA(IKE_SA_INIT request carries
+// zero responder SPI) or is not IKE at all. Such packets are shed
+// first when receive queue is overloaded
+bool startsIkeSa(const SCHAR * buffer, S32 len);
+
+template<typename PeerData>
+bool
+isNewSession(const PeerData & pkt) {
+    return startsIkeSa(pkt.buffer.data(), pkt.bufferLen);
+}
+
+// Size global receive / send queues and set overflow policy of
+// receive queues. Must be called before any endpoint is started
+void configureQueues(std::size_t capacity, std::size_t highWater,
+                     OverflowPolicy policy);
+
+// Set slack of session timers and window over which their deadlines
+// are spread(keyed by peer). Must be called before any endpoint is
+// started
+void configureSessionTimers(S32 slack, S32 spread);
+
+class IKEv2Session4;
+class IKEv2Session6;
+
+using SessionMap4 = Map<HashKey, IKEv2Session4>;
+using SessionMap6 = Map<HashKey, IKEv2Session6>;
+
+// Secondary index of IKE SAs by responder SPI
+using SpiTable4 = SpiTable<IKEv2Session4>;
+using SpiTable6 = SpiTable<IKEv2Session6>;
+
 class ProtocolSession {
  public:
      ProtocolSession();
@@ -92,14 +266,31 @@ class ProtocolSession {
 class IKEv2Session4 {
  public:
     using Ptr = std::shared_ptr<IKEv2Session4>;
-    IKEv2Session4(const HashKey & h);
+    IKEv2Session4(const HashKey & h, SessionMap4 & sessionMap,
+                  SpiTable4 & spiTable, Timer::AsyncTimer & timer);
     ~IKEv2Session4();
+    static Ptr create(const HashKey & h, SessionMap4 & sessionMap,
+                      SpiTable4 & spiTable, Timer::AsyncTimer & timer);
     S32 handleSession(std::deque<SCHAR *> & pktList);
-    void handleTimeout(HashKey);
+    // Push idle timeout SESSION_TIMEOUT msec out. Returns false if
+    // session already timed out and left session maps
+    bool keepAlive();
+    void handleTimeout();
+    // Peer address, changes when peer moves
+    HashKey key();
+    void keyIs(const HashKey & h);
+    U64 responderSpi();
+    void responderSpiIs(U64 spi);
  private:
+    // Map which owns this session(global or per shard)
+    SessionMap4 & sessionMap_;
+    SpiTable4 & spiTable_;
     HashKey hash_;
-    IpAddress4 ipAddr_;
-    NetworkPort port_;
+    // Responder SPI of IKE SA, 0 till one is allocated
+    U64 responderSpi_;
+    Timer::TimerHandle idleTimer_;
+    // Set under sessionMutex_ once timeout removed session from maps
+    bool dead_;
     std::mutex sessionMutex_;
     // ike sa
     // ipsec sa
@@ -113,14 +304,30 @@ class IKEv2Session4 {
 class IKEv2Session6 {
  public:
     using Ptr = std::shared_ptr<IKEv2Session6>;
-    IKEv2Session6(const HashKey & h);
+    IKEv2Session6(const HashKey & h, SessionMap6 & sessionMap,
+                  SpiTable6 & spiTable, Timer::AsyncTimer & timer);
     ~IKEv2Session6();
+    static Ptr create(const HashKey & h, SessionMap6 & sessionMap,
+                      SpiTable6 & spiTable, Timer::AsyncTimer & timer);
     S32 handleSession(std::deque<SCHAR *> & pktList);
-    void handleTimeout(HashKey);
+    // Push idle timeout SESSION_TIMEOUT msec out. Returns false if
+    // session already timed out and left session maps
+    bool keepAlive();
+    void handleTimeout();
+    // Peer address, changes when peer moves
+    HashKey key();
+    void keyIs(const HashKey & h);
+    U64 responderSpi();
+    void responderSpiIs(U64 spi);
  private:
+    SessionMap6 & sessionMap_;
+    SpiTable6 & spiTable_;
     HashKey hash_;
-    IpAddress6 ipAddr_;
-    NetworkPort port_;
+    // Responder SPI of IKE SA, 0 till one is allocated
+    U64 responderSpi_;
+    Timer::TimerHandle idleTimer_;
+    // Set under sessionMutex_ once timeout removed session from maps
+    bool dead_;
     std::mutex sessionMutex_;
     // ike sa
     // ipsec sa
@@ -131,6 +338,31 @@ class IKEv2Session6 {
     // etc
 };
 
+// Per core state used in sharded mode. Each shard owns socket
+// bound with SO_REUSEPORT, receive queue, session map and timer
+// so that peer's packets are received, processed and answered
+// by single thread without touching global queues / maps
+template<typename PeerData, typename Session>
+struct Shard {
+    using Ptr = std::unique_ptr<Shard>;
+
+    Shard(U32 shardId, U32 shards) : id(shardId), count(shards),
+                                     steeringMisses(0), spis(shardId) {}
+
+    U32 id;
+    U32 count;
+    // Datagrams which landed here although SPI maps to other shard
+    U64 steeringMisses;
+    Queue<PeerData> rcvQ;
+    // Declared before sessions so it outlives their idle timers
+    Timer::AsyncTimer timer;
+    Map<HashKey, Session> sessions;
+    SpiTable<Session> spis;
+};
+
+using Shard4 = Shard<PeerData4, IKEv2Session4>;
+using Shard6 = Shard<PeerData6, IKEv2Session6>;
+
 // Forward declaration
 class UdpEndpoint4;
 class UdpEndpoint6;
@@ -148,6 +380,12 @@ class IKEv2SessionManager4 final {
     S32 handleSession();
     void shutdown();
     static IKEv2SessionManager4 & getIKEv2SessionManager4();
+    // Find or create session for packet. Returns packet to be
+    // sent back to peer or nullptr
+    static PeerData4::Ptr processPkt(const PeerData4::Ptr & elem,
+                                     SessionMap4 & sessions,
+                                     SpiTable4 & spis,
+                                     Timer::AsyncTimer & timer);
 
     IKEv2SessionManager4(const IKEv2SessionManager4 &);
     IKEv2SessionManager4(IKEv2SessionManager4 &&);
@@ -165,6 +403,10 @@ class IKEv2SessionManager6 final {
     S32 handleSession();
     void shutdown();
     static IKEv2SessionManager6 & getIKEv2SessionManager6();
+    static PeerData6::Ptr processPkt(const PeerData6::Ptr & elem,
+                                     SessionMap6 & sessions,
+                                     SpiTable6 & spis,
+                                     Timer::AsyncTimer & timer);
 
     IKEv2SessionManager6(const IKEv2SessionManager6 &);
     IKEv2SessionManager6(IKEv2SessionManager6 &&);
@@ -185,7 +427,26 @@ class UdpEndpoint {
     IpVersion ipVersion() const;
     void sourceInterfaceIs(const Interface & intf);
     Interface sourceInterface() const;
+    void rcvBatchSizeIs(U32 size);
+    U32 rcvBatchSize() const;
+    // Average no. of datagrams returned per recvmmsg() call
+    double avgRcvBatchSize() const;
+    void sendBatchSizeIs(U32 size);
+    U32 sendBatchSize() const;
+    U64 sendDrops() const;
+    // Bind with SO_REUSEPORT so that each shard gets its own socket
+    void reusePortIs(bool reusePort);
+    bool reusePort() const;
+    // Steer datagrams of SO_REUSEPORT group by IKE initiator SPI
+    S32 attachSpiSteering(U32 shardCount);
+    // Backend used by receive() / runShard(), chosen at startup
+    void ioBackendIs(ASIO::IOBackend::Type type);
+    double syscallsPerDatagram() const;
  protected:
+    S32 initBackend(const std::string & name);
+    void rcvBatchDone(U32 pkts);
+    S32 sendBatch(struct mmsghdr * msgs, U32 count);
+
     bool stopThread_;
     S32 eventFd_;
     S32 sockfd_;
@@ -193,6 +454,14 @@ class UdpEndpoint {
     IpVersion ipVersion_;
     Synchro::Notifier eventNotifier_;
     std::mutex queueMutex_;
+    U32 rcvBatchSize_;
+    std::atomic<U64> rcvBatches_;
+    std::atomic<U64> rcvPkts_;
+    U32 sendBatchSize_;
+    std::atomic<U64> sendDrops_;
+    bool reusePort_;
+    ASIO::IOBackend::Type ioBackendType_;
+    ASIO::IOBackend::Ptr ioBackend_;
 };
 
 class UdpEndpoint4 : public UdpEndpoint {
@@ -209,6 +478,9 @@ class UdpEndpoint4 : public UdpEndpoint {
     S32 initUdpEndpoint();
     S32 send();
     S32 receive();
+    // Receive, process and send on calling thread(sharded mode)
+    S32 runShard();
+    void shardIs(Shard4 * shard);
 
     void sourceAddressIs(const IpAddress4 & addr);
     void peerAddressIs(const IpAddress4 & addr);
@@ -218,6 +490,12 @@ class UdpEndpoint4 : public UdpEndpoint {
     IpAddress4 sourceAddress();
     IpAddress4 sinAddrToStr(void * peer);
  private:
+    S32 receiveBatch(std::vector<PeerData4::Ptr> & batch);
+
+    Shard4 * shard_;
+    // Packets handed to I/O backend as receive slots, unfilled
+    // slots are kept for next batch
+    std::vector<PeerData4::Ptr> rcvSlots_;
     NetworkPort peerPort_;
     NetworkPort sourcePort_;
     IpAddress4 sourceAddress_;
@@ -238,6 +516,9 @@ class UdpEndpoint6 : public UdpEndpoint {
     S32 initUdpEndpoint();
     S32 send();
     S32 receive();
+    // Receive, process and send on calling thread(sharded mode)
+    S32 runShard();
+    void shardIs(Shard6 * shard);
 
     void sourceAddressIs(const IpAddress6 & addr);
     void peerAddressIs(const IpAddress6 & addr);
@@ -247,6 +528,12 @@ class UdpEndpoint6 : public UdpEndpoint {
     IpAddress6 sourceAddress();
     IpAddress6 sinAddrToStr(void * peer);
  private:
+    S32 receiveBatch(std::vector<PeerData6::Ptr> & batch);
+
+    Shard6 * shard_;
+    // Packets handed to I/O backend as receive slots, unfilled
+    // slots are kept for next batch
+    std::vector<PeerData6::Ptr> rcvSlots_;
     NetworkPort peerPort_;
     NetworkPort sourcePort_;
     IpAddress6 peerAddress_;
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>  // std::min, std::max
+
+#include "pool.hh"
+
+namespace Pool {
+
+// Start of class BlockPool
+
+BlockPool::BlockPool(std::string name,
+                     std::size_t blockSize) : name_(name),
+                                              blockSize_(blockSize),
+                                              freeList_(nullptr),
+                                              slabCount_(0) {
+    TRACE();
+    stride_ = HEADER_LEN +
+              ((blockSize_ + alignof(std::max_align_t) - 1) &
+               ~(alignof(std::max_align_t) - 1));
+    slabBlocks_ = std::max<std::size_t>(POOL_MIN_SLAB_BLOCKS,
+                                        POOL_SLAB_BYTES / stride_);
+    cacheBlocks_ = std::min(POOL_CACHE_BLOCKS, slabBlocks_);
+}
+
+BlockPool::~BlockPool() {
+    TRACE();
+    for (auto slab : slabs_) {
+        ::operator delete(slab);
+    }
+}
+
+BlockPool::ThreadCaches::ThreadCaches() {
+    for (auto & cache : caches) {
+        cache.pool = nullptr;
+        cache.head = nullptr;
+        cache.count = 0;
+    }
+}
+
+// Hand cached blocks back when thread exits
+BlockPool::ThreadCaches::~ThreadCaches() {
+    for (auto & cache : caches) {
+        if (cache.pool != nullptr) {
+            cache.pool->flush(cache, 0);
+        }
+    }
+}
+
+// Find or claim this thread's cache for pool. Returns nullptr if
+// thread already caches for POOL_MAX_CACHES pools
+BlockPool::Cache *
+BlockPool::cache() {
+    static thread_local ThreadCaches threadCaches;
+
+    for (auto & cache : threadCaches.caches) {
+        if (cache.pool == this) {
+            return &cache;
+        }
+        if (cache.pool == nullptr) {
+            cache.pool = this;
+            return &cache;
+        }
+    }
+    return nullptr;
+}
+
+// Carve new slab into blocks, called with mutex_ held
+void
+BlockPool::grow() {
+    auto slab = static_cast<SCHAR *>(::operator new(stride_ * slabBlocks_));
+    slabs_.push_back(slab);
+    slabCount_.fetch_add(1, std::memory_order_relaxed);
+
+    for (U32 idx = 0; idx < slabBlocks_; ++idx) {
+        auto block = reinterpret_cast<Block *>(slab + idx * stride_);
+        block->origin = this;
+        block->next = freeList_;
+        freeList_ = block;
+    }
+
+    LOG(INFO, "Pool %s grew to %lu slabs", name_.c_str(), slabs_.size());
+}
+
+// Move half of cache capacity from shared free list
+void
+BlockPool::refill(Cache & cache) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (cache.count < cacheBlocks_ / 2) {
+        if (freeList_ == nullptr) {
+            grow();
+        }
+        Block * block = freeList_;
+        freeList_ = block->next;
+        block->next = cache.head;
+        cache.head = block;
+        cache.count++;
+    }
+}
+
+// Move cached blocks beyond keep to shared free list
+void
+BlockPool::flush(Cache & cache, U32 keep) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (cache.count > keep) {
+        Block * block = cache.head;
+        cache.head = block->next;
+        block->next = freeList_;
+        freeList_ = block;
+        cache.count--;
+    }
+}
+
+void *
+BlockPool::allocate() {
+    Block * block;
+    Cache * local = cache();
+
+    if (local != nullptr) {
+        if (local->head == nullptr) {
+            refill(*local);
+        }
+        block = local->head;
+        local->head = block->next;
+        local->count--;
+    } else {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (freeList_ == nullptr) {
+            grow();
+        }
+        block = freeList_;
+        freeList_ = block->next;
+    }
+
+    return reinterpret_cast<SCHAR *>(block) + HEADER_LEN;
+}
+
+void
+BlockPool::release(void * ptr) {
+    auto block = reinterpret_cast<Block *>(static_cast<SCHAR *>(ptr) - HEADER_LEN);
+    BlockPool * pool = block->origin;
+    Cache * local = pool->cache();
+
+    if (local != nullptr) {
+        block->next = local->head;
+        local->head = block;
+        local->count++;
+        if (local->count > pool->cacheBlocks_) {
+            pool->flush(*local, pool->cacheBlocks_ / 2);
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(pool->mutex_);
+    block->next = pool->freeList_;
+    pool->freeList_ = block;
+}
+
+std::size_t
+BlockPool::blockSize() const {
+    return blockSize_;
+}
+
+const std::string &
+BlockPool::name() const {
+    return name_;
+}
+
+U64
+BlockPool::slabs() const {
+    return slabCount_.load(std::memory_order_relaxed);
+}
+
+// End of class BlockPool
+
+BlockPool &
+bufferPool(U32 sizeClass) {
+    // Never destroyed, see poolFor()
+    static BlockPool * pools[BUFFER_CLASS_COUNT] = {
+        new BlockPool("Buffer512", BUFFER_SIZE_CLASSES[0]),
+        new BlockPool("Buffer2K", BUFFER_SIZE_CLASSES[1]),
+        new BlockPool("Buffer9K", BUFFER_SIZE_CLASSES[2]),
+        new BlockPool("Buffer64K", BUFFER_SIZE_CLASSES[3]),
+    };
+    return *pools[sizeClass];
+}
+
+// Start of class Buffer
+
+Buffer::Buffer() : data_(nullptr), capacity_(0) {
+}
+
+Buffer::~Buffer() {
+    reset();
+}
+
+Buffer::Buffer(Buffer && other) : data_(other.data_), capacity_(other.capacity_) {
+    other.data_ = nullptr;
+    other.capacity_ = 0;
+}
+
+Buffer &
+Buffer::operator=(Buffer && other) {
+    if (this != &other) {
+        reset();
+        data_ = other.data_;
+        capacity_ = other.capacity_;
+        other.data_ = nullptr;
+        other.capacity_ = 0;
+    }
+    return *this;
+}
+
+bool
+Buffer::reserve(std::size_t len) {
+    if (len <= capacity_ && data_ != nullptr) {
+        return true;
+    }
+
+    for (U32 idx = 0; idx < BUFFER_CLASS_COUNT; ++idx) {
+        if (len <= BUFFER_SIZE_CLASSES[idx]) {
+            reset();
+            data_ = static_cast<SCHAR *>(bufferPool(idx).allocate());
+            capacity_ = BUFFER_SIZE_CLASSES[idx];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+Buffer::reset() {
+    if (data_ != nullptr) {
+        BlockPool::release(data_);
+        data_ = nullptr;
+        capacity_ = 0;
+    }
+}
+
+SCHAR *
+Buffer::data() const {
+    return data_;
+}
+
+std::size_t
+Buffer::capacity() const {
+    return capacity_;
+}
+
+// End of class Buffer
+
+}  // namespace Pool
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Fixed size block pool used for per packet allocations. Blocks are
+// carved out of slabs which are never returned to the system, every
+// thread keeps small cache of free blocks per pool so steady state
+// allocation / release takes no lock and no malloc
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <string>
+#include <cstddef>
+
+#include "logging.hh"
+#include "basictypes.hh"
+
+namespace Pool {
+
+// Slab size, no. of blocks per slab is derived from it
+const std::size_t POOL_SLAB_BYTES = 512 * 1024;
+const U32 POOL_MIN_SLAB_BLOCKS = 4;
+// Max free blocks kept in thread cache, half is moved to / from
+// shared free list at once. Pools of big blocks cache less
+const U32 POOL_CACHE_BLOCKS = 64;
+// Max pools for which single thread keeps cache
+const U32 POOL_MAX_CACHES = 8;
+// Room left in block for shared_ptr control block
+const std::size_t POOL_CONTROL_BLOCK_SLACK = 64;
+
+class BlockPool {
+ public:
+    BlockPool(std::string name, std::size_t blockSize);
+    ~BlockPool();
+
+    void * allocate();
+    // Block goes back to pool which allocated it, whichever
+    // thread releases it
+    static void release(void * ptr);
+
+    std::size_t blockSize() const;
+    const std::string & name() const;
+    // Slabs allocated so far, stays constant in steady state
+    U64 slabs() const;
+ private:
+    // Header placed in front of every block
+    struct Block {
+        BlockPool * origin;
+        Block * next;
+    };
+
+    struct Cache {
+        BlockPool * pool;
+        Block * head;
+        U32 count;
+    };
+
+    struct ThreadCaches {
+        Cache caches[POOL_MAX_CACHES];
+        ThreadCaches();
+        ~ThreadCaches();
+    };
+
+    static const std::size_t HEADER_LEN =
+        (sizeof(Block) + alignof(std::max_align_t) - 1) &
+        ~(alignof(std::max_align_t) - 1);
+
+    Cache * cache();
+    void refill(Cache & cache);
+    void flush(Cache & cache, U32 keep);
+    void grow();
+
+    std::string name_;
+    std::size_t blockSize_;
+    std::size_t stride_;
+    U32 slabBlocks_;
+    U32 cacheBlocks_;
+    std::mutex mutex_;
+    Block * freeList_;
+    std::vector<SCHAR *> slabs_;
+    std::atomic<U64> slabCount_;
+};
+
+// Pool serving objects of type T, never destroyed so that blocks
+// released by late threads still have valid origin
+template<typename T>
+BlockPool &
+poolFor(const char * name) {
+    static BlockPool * pool = new BlockPool(name,
+                                            sizeof(T) + POOL_CONTROL_BLOCK_SLACK);
+    return *pool;
+}
+
+// Allocator for std::allocate_shared() so that object and its
+// control block share single pooled block
+template<typename T>
+class PoolAllocator {
+ public:
+    using value_type = T;
+
+    explicit PoolAllocator(BlockPool & pool) : pool_(&pool) {}
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U> & other) : pool_(other.pool()) {}
+
+    T * allocate(std::size_t count) {
+        if (count == 1 && sizeof(T) <= pool_->blockSize()) {
+            return static_cast<T *>(pool_->allocate());
+        }
+        return static_cast<T *>(::operator new(count * sizeof(T)));
+    }
+
+    void deallocate(T * ptr, std::size_t count) {
+        if (count == 1 && sizeof(T) <= pool_->blockSize()) {
+            BlockPool::release(ptr);
+            return;
+        }
+        ::operator delete(ptr);
+    }
+
+    BlockPool * pool() const { return pool_; }
+ private:
+    BlockPool * pool_;
+};
+
+template<typename T, typename U>
+bool operator==(const PoolAllocator<T> & lhs, const PoolAllocator<U> & rhs) {
+    return lhs.pool() == rhs.pool();
+}
+
+template<typename T, typename U>
+bool operator!=(const PoolAllocator<T> & lhs, const PoolAllocator<U> & rhs) {
+    return !(lhs == rhs);
+}
+
+// Create shared object from pool
+template<typename T>
+std::shared_ptr<T>
+makePooled(BlockPool & pool) {
+    return std::allocate_shared<T>(PoolAllocator<T>(pool));
+}
+
+// Packet buffer size classes. Most IKE traffic fits in 2K while
+// IKE_AUTH carrying certificate chains needs bigger classes
+const U32 BUFFER_CLASS_COUNT = 4;
+const std::size_t BUFFER_SIZE_CLASSES[BUFFER_CLASS_COUNT] = {
+    512, 2048, 9216, 65536
+};
+
+// Pool of size class idx
+BlockPool & bufferPool(U32 sizeClass);
+
+// Move-only buffer taken from smallest size class which fits
+class Buffer {
+ public:
+    Buffer();
+    ~Buffer();
+    Buffer(Buffer && other);
+    Buffer & operator=(Buffer && other);
+    Buffer(const Buffer &) = delete;
+    Buffer & operator=(const Buffer &) = delete;
+
+    // Make room for len bytes. Contents are not preserved if buffer
+    // moves to bigger class. Returns false if len exceeds largest class
+    bool reserve(std::size_t len);
+    void reset();
+    SCHAR * data() const;
+    std::size_t capacity() const;
+ private:
+    SCHAR * data_;
+    std::size_t capacity_;
+};
+
+}  // namespace Pool
@@ -17,83 +17,408 @@
 
 #pragma once
 
+#include <atomic>
+#include <algorithm>  // std::min
+#include <memory>
+#include <vector>
+#include <string>
+#include <functional>
+
+#include "logging.hh"
+#include "basictypes.hh"
+#include "synchro.hh"
+
+// Default no. of packets queue can hold, rounded up to power of 2
+const std::size_t QUEUE_CAPACITY = 4096;
+// Default depth above which overflow policy kicks in
+const std::size_t QUEUE_HIGH_WATER = 3072;
+
+// What to do with packet arriving above high-water mark
+enum class OverflowPolicy {
+    DROP_NEWEST,      // Drop arriving packet
+    DROP_OLDEST,      // Evict oldest queued packet to make room
+    PREFER_EXISTING,  // Drop packets starting new session, keep
+                      // queueing existing sessions till ring is full
+};
+
+// Parse "drop_newest", "drop_oldest" or "prefer_existing"
+inline OverflowPolicy
+overflowPolicyFromString(const std::string & policy,
+                         OverflowPolicy defaultPolicy) {
+    if (policy == "drop_newest") {
+        return OverflowPolicy::DROP_NEWEST;
+    } else if (policy == "drop_oldest") {
+        return OverflowPolicy::DROP_OLDEST;
+    } else if (policy == "prefer_existing") {
+        return OverflowPolicy::PREFER_EXISTING;
+    }
+    return defaultPolicy;
+}
+
+// Bounded lock-free multi-producer / multi-consumer ring (Vyukov).
+// Every cell carries sequence number telling whether it is free for
+// producer of that lap or holds packet for consumer of that lap.
+// Producers and consumers only contend on head / tail positions and
+// consumers sleep on futex only when ring is empty
 template<typename T>
 class Queue {
  public:
-    Queue();
+    Queue(std::size_t capacity = QUEUE_CAPACITY);
     ~Queue();
 
     using Ptr = std::shared_ptr<T>;
+    // Returns true if packet starts new session
+    using Classifier = std::function<bool(const T &)>;
+
+    // Must be called before queue is shared with other threads.
+    // Capacity is rounded up to power of 2 and high-water mark is
+    // clamped to it
+    void configure(std::size_t capacity, std::size_t highWater,
+                   OverflowPolicy policy);
+    void classifierIs(Classifier classifier);
 
-    void addPkt(Ptr);
+    // Returns false and drops packet if it is not admitted by
+    // overflow policy or queue is stopped
+    bool addPkt(Ptr);
+    // Returns no. of packets queued, rest are dropped
+    std::size_t addPkts(std::vector<Ptr> &);
     bool getPkt(Ptr &);
+    bool getPkts(std::vector<Ptr> &, std::size_t maxPkts);
+    bool tryGetPkts(std::vector<Ptr> &, std::size_t maxPkts);
     void shutdown();
     bool stopped();
-    std::deque<Ptr> & queue();
+    std::size_t capacity() const;
+    std::size_t highWater() const;
+    // Approximate no. of queued packets
+    std::size_t depth() const;
+    OverflowPolicy policy() const;
+
+    // Drop counters: arriving packets rejected because ring or
+    // high-water mark was hit, oldest packets evicted and new session
+    // packets shed in favour of existing sessions
+    U64 drops() const;
+    U64 overflowDrops() const;
+    U64 evictions() const;
+    U64 newSessionDrops() const;
  private:
-    std::deque<Ptr> opaqueQ_;
-    std::mutex queueMutex_;
-    std::condition_variable queueCond_;
-    bool stopped_;
+    struct Cell {
+        std::atomic<std::size_t> seq;
+        Ptr data;
+    };
+
+    bool admit(Ptr &);
+    bool push(Ptr &);
+    bool pop(Ptr &);
+    void wakeConsumers(std::size_t count);
+
+    // Keep producer and consumer positions on separate cache lines
+    static const std::size_t CACHE_LINE = 64;
+
+    std::size_t mask_;
+    std::size_t highWater_;
+    OverflowPolicy policy_;
+    Classifier classifier_;
+    std::unique_ptr<Cell[]> cells_;
+    char pad0_[CACHE_LINE];
+    std::atomic<std::size_t> tail_;  // Next slot to produce
+    char pad1_[CACHE_LINE];
+    std::atomic<std::size_t> head_;  // Next slot to consume
+    char pad2_[CACHE_LINE];
+    std::atomic<bool> stopped_;
+    std::atomic<U64> overflowDrops_;
+    std::atomic<U64> evictions_;
+    std::atomic<U64> newSessionDrops_;
+    Synchro::WaitWord notEmpty_;
 };
 
 template<typename T>
-Queue<T>::Queue() : stopped_(false) {
+Queue<T>::Queue(std::size_t capacity) : mask_(0),
+                                        tail_(0), head_(0),
+                                        stopped_(false),
+                                        overflowDrops_(0),
+                                        evictions_(0),
+                                        newSessionDrops_(0) {
+    TRACE();
+    configure(capacity, capacity, OverflowPolicy::DROP_NEWEST);
+}
+
+template<typename T>
+void
+Queue<T>::configure(std::size_t capacity, std::size_t highWater,
+                    OverflowPolicy policy) {
     TRACE();
+    std::size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    mask_ = size - 1;
+    highWater_ = std::min(highWater, size);
+    policy_ = policy;
+    cells_.reset(new Cell[size]);
+    for (std::size_t idx = 0; idx < size; ++idx) {
+        cells_[idx].seq.store(idx, std::memory_order_relaxed);
+    }
+    tail_.store(0, std::memory_order_relaxed);
+    head_.store(0, std::memory_order_relaxed);
 }
 
 template<typename T>
 void
+Queue<T>::classifierIs(Classifier classifier) {
+    TRACE();
+    classifier_ = classifier;
+}
+
+// Apply overflow policy and queue packet. Ring being completely
+// full always drops arriving packet
+template<typename T>
+bool
+Queue<T>::admit(Ptr & elem) {
+    if (depth() >= highWater_) {
+        switch (policy_) {
+            case OverflowPolicy::DROP_NEWEST:
+                overflowDrops_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            case OverflowPolicy::DROP_OLDEST: {
+                Ptr oldest;
+                if (pop(oldest)) {
+                    evictions_.fetch_add(1, std::memory_order_relaxed);
+                }
+                break;
+            }
+            case OverflowPolicy::PREFER_EXISTING:
+                // Unclassified packets are treated as new sessions
+                if (!classifier_ || classifier_(*elem)) {
+                    newSessionDrops_.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                break;
+        }
+    }
+
+    if (!push(elem)) {
+        overflowDrops_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+template<typename T>
+bool
+Queue<T>::push(Ptr & elem) {
+    std::size_t pos = tail_.load(std::memory_order_relaxed);
+
+    while (true) {
+        Cell & cell = cells_[pos & mask_];
+        std::size_t seq = cell.seq.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) -
+                              static_cast<std::ptrdiff_t>(pos);
+
+        if (diff == 0) {
+            // Cell is free for this lap, claim it
+            if (tail_.compare_exchange_weak(pos, pos + 1,
+                                            std::memory_order_relaxed)) {
+                cell.data = std::move(elem);
+                cell.seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            // Consumer of previous lap has not freed cell, ring is full
+            return false;
+        } else {
+            pos = tail_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template<typename T>
+bool
+Queue<T>::pop(Ptr & elem) {
+    std::size_t pos = head_.load(std::memory_order_relaxed);
+
+    while (true) {
+        Cell & cell = cells_[pos & mask_];
+        std::size_t seq = cell.seq.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) -
+                              static_cast<std::ptrdiff_t>(pos + 1);
+
+        if (diff == 0) {
+            // Cell holds packet for this lap, claim it
+            if (head_.compare_exchange_weak(pos, pos + 1,
+                                            std::memory_order_relaxed)) {
+                elem = std::move(cell.data);
+                cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            // Ring is empty
+            return false;
+        } else {
+            pos = head_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template<typename T>
+void
+Queue<T>::wakeConsumers(std::size_t count) {
+    if (count > 0 && notEmpty_.hasWaiters()) {
+        notEmpty_.wake(count);
+    }
+}
+
+template<typename T>
+bool
 Queue<T>::addPkt(Ptr elem) {
     TRACE();
-    if (!stopped_) {
-        std::unique_lock<std::mutex> lock(queueMutex_);
-        opaqueQ_.push_back(elem);
+    if (stopped_.load(std::memory_order_relaxed) || !admit(elem)) {
+        return false;
+    }
+
+    wakeConsumers(1);
+    return true;
+}
+
+// Add batch of packets and wake consumers once for whole batch.
+// Batch is cleared so that caller can reuse its storage
+template<typename T>
+std::size_t
+Queue<T>::addPkts(std::vector<Ptr> & elems) {
+    TRACE();
+    std::size_t added = 0;
 
-        // Notify that packet has been added
-        queueCond_.notify_one();
+    if (!stopped_.load(std::memory_order_relaxed)) {
+        for (auto & elem : elems) {
+            if (admit(elem)) {
+                added++;
+            }
+        }
     }
+
+    wakeConsumers(added);
+    elems.clear();
+    return added;
 }
 
 template<typename T>
 bool
 Queue<T>::getPkt(Ptr & elem) {
     TRACE();
-    {
-        std::unique_lock<std::mutex> lock(queueMutex_);
-        queueCond_.wait(lock, [this]{ return this->stopped_ ||
-                                      !this->queue().empty(); });
-
-        if (!opaqueQ_.empty()) {
-            elem = opaqueQ_.back();
-            opaqueQ_.pop_back();
+    while (true) {
+        if (pop(elem)) {
             return true;
-        } else {
+        }
+
+        U32 generation = notEmpty_.prepareWait();
+        if (pop(elem)) {
+            notEmpty_.cancelWait();
+            return true;
+        }
+
+        if (stopped_.load(std::memory_order_acquire)) {
+            notEmpty_.cancelWait();
             return false;
         }
+
+        notEmpty_.wait(generation);
     }
 }
 
+// Block till queue has packets and then drain up to maxPkts
+// packets in arrival order. Returns false if queue was stopped
 template<typename T>
-std::deque<typename Queue<T>::Ptr> &
-Queue<T>::queue() {
+bool
+Queue<T>::getPkts(std::vector<Ptr> & elems, std::size_t maxPkts) {
     TRACE();
-    return opaqueQ_;
+    if (elems.size() >= maxPkts) {
+        return !elems.empty();
+    }
+
+    Ptr elem;
+    if (!getPkt(elem)) {
+        return !elems.empty();
+    }
+    elems.push_back(std::move(elem));
+
+    return tryGetPkts(elems, maxPkts);
+}
+
+// Same as getPkts() but returns immediately if queue is empty
+template<typename T>
+bool
+Queue<T>::tryGetPkts(std::vector<Ptr> & elems, std::size_t maxPkts) {
+    TRACE();
+    Ptr elem;
+    while (elems.size() < maxPkts && pop(elem)) {
+        elems.push_back(std::move(elem));
+    }
+    return !elems.empty();
 }
 
 template<typename T>
 void
 Queue<T>::shutdown() {
     TRACE();
-    stopped_ = true;
-    queueCond_.notify_all();
+    stopped_.store(true, std::memory_order_release);
+    notEmpty_.wakeAll();
 }
 
 template<typename T>
 bool
 Queue<T>::stopped() {
     TRACE();
-    return stopped_;
+    return stopped_.load(std::memory_order_acquire);
+}
+
+template<typename T>
+std::size_t
+Queue<T>::capacity() const {
+    return mask_ + 1;
+}
+
+template<typename T>
+std::size_t
+Queue<T>::highWater() const {
+    return highWater_;
+}
+
+template<typename T>
+std::size_t
+Queue<T>::depth() const {
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+template<typename T>
+OverflowPolicy
+Queue<T>::policy() const {
+    return policy_;
+}
+
+template<typename T>
+U64
+Queue<T>::drops() const {
+    return overflowDrops() + evictions() + newSessionDrops();
+}
+
+template<typename T>
+U64
+Queue<T>::overflowDrops() const {
+    return overflowDrops_.load(std::memory_order_relaxed);
+}
+
+template<typename T>
+U64
+Queue<T>::evictions() const {
+    return evictions_.load(std::memory_order_relaxed);
+}
+
+template<typename T>
+U64
+Queue<T>::newSessionDrops() const {
+    return newSessionDrops_.load(std::memory_order_relaxed);
 }
 
 template<typename T>
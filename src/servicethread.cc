@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>  // strerror
+#include <pthread.h>
+
+#include "servicethread.hh"
+
+namespace IKEv2 {
+
+// Kernel limits thread names to 15 chars
+const std::size_t SERVICE_NAME_LEN = 15;
+
+thread_local ServiceThread * ServiceThread::current_ = nullptr;
+
+// Start of class ServiceThread
+
+ServiceThread::ServiceThread(const std::string & name, ThreadRole role,
+                             S32 index, Loop loop) : name_(name), role_(role),
+                                                     index_(index),
+                                                     loop_(std::move(loop)),
+                                                     state_(State::CREATED),
+                                                     stopRequested_(false),
+                                                     joining_(false),
+                                                     exitCode_(0) {
+    TRACE();
+}
+
+ServiceThread::~ServiceThread() {
+    TRACE();
+    if (thread_.joinable()) {
+        stop();
+        join();
+    }
+    // Still joinable if join() was left to its first caller
+    if (thread_.joinable()) {
+        thread_.detach();
+    }
+}
+
+const char *
+ServiceThread::stateName(State state) {
+    switch (state) {
+        case State::CREATED:
+            return "created";
+        case State::RUNNING:
+            return "running";
+        case State::STOPPED:
+            return "stopped";
+        case State::EXITED:
+            return "exited";
+    }
+    return "unknown";
+}
+
+S32
+ServiceThread::start() {
+    TRACE();
+    if (state_ != State::CREATED) {
+        LOG(ERROR, "Service %s already started", name_.c_str());
+        return -1;
+    }
+
+    started_ = std::chrono::steady_clock::now();
+    state_ = State::RUNNING;
+    try {
+        thread_ = std::thread(&ServiceThread::run, this);
+    }
+    catch(const std::system_error & err) {
+        LOG(ERROR, "Failed to start service %s: %s", name_.c_str(), err.what());
+        state_ = State::EXITED;
+        exitCode_ = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+ServiceThread::run() {
+    TRACE();
+    current_ = this;
+
+    S32 ret = pthread_setname_np(pthread_self(),
+                                 name_.substr(0, SERVICE_NAME_LEN).c_str());
+    if (ret != 0) {
+        LOG(ERROR, "pthread_setname_np: %s", strerror(ret));
+    }
+
+    // Pinned before loop allocates anything, so its memory is local
+    ThreadPool::getThreadPool().threadAffinityIs(role_, index_);
+
+    LOG(INFO, "Service %s started", name_.c_str());
+    ret = loop_();
+    exitCode_ = ret;
+    state_ = stopRequested_ ? State::STOPPED : State::EXITED;
+
+    if (state_ == State::EXITED) {
+        LOG(ERROR, "Service %s exited unexpectedly with %d", name_.c_str(), ret);
+    } else {
+        LOG(INFO, "Service %s stopped with %d", name_.c_str(), ret);
+    }
+}
+
+void
+ServiceThread::stopHandlerIs(StopHandler handler) {
+    TRACE();
+    stopHandler_ = std::move(handler);
+}
+
+void
+ServiceThread::stop() {
+    TRACE();
+    if (stopRequested_.exchange(true)) {
+        return;
+    }
+
+    if (stopHandler_) {
+        stopHandler_();
+    }
+}
+
+S32
+ServiceThread::join() {
+    TRACE();
+    if (thread_.get_id() == std::this_thread::get_id() || joining_.exchange(true)) {
+        return exitCode_;
+    }
+
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    return exitCode_;
+}
+
+bool
+ServiceThread::healthy() const {
+    State state = state_.load();
+    return state == State::RUNNING || state == State::STOPPED;
+}
+
+U64
+ServiceThread::uptimeMs() const {
+    if (state_ == State::CREATED) {
+        return 0;
+    }
+
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - started_).count();
+}
+
+// End of class ServiceThread
+
+}  // namespace IKEv2
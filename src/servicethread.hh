@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <functional>
+
+#include "logging.hh"
+#include "basictypes.hh"
+#include "threadpool.hh"
+
+namespace IKEv2 {
+
+// Named thread running one endless loop(receive, session handler,
+// timer loop...), so such loops never hold thread pool workers.
+// Thread is pinned to cpus of its role before loop starts. Loop is
+// woken for stop by stop handler, e.g. by notifying its event fd
+class ServiceThread final {
+ public:
+    using Ptr = std::unique_ptr<ServiceThread>;
+    using Loop = std::function<S32()>;
+    using StopHandler = std::function<void()>;
+
+    enum class State {
+        CREATED,
+        RUNNING,
+        // Loop returned after stop was requested
+        STOPPED,
+        // Loop returned on its own
+        EXITED,
+    };
+
+    // index >= 0 pins thread to single cpu of role, see
+    // ThreadPool::threadAffinityIs()
+    ServiceThread(const std::string & name, ThreadRole role, S32 index, Loop loop);
+    ~ServiceThread();
+
+    S32 start();
+    void stopHandlerIs(StopHandler handler);
+    // Request stop(stop token) and wake loop through stop handler
+    void stop();
+    // Wait for loop to return, gives loop's return value. Only first
+    // caller waits, so signal handler interrupting join() or running
+    // on service thread itself returns at once
+    S32 join();
+
+    const std::string & name() const { return name_; }
+    State state() const { return state_.load(); }
+    bool stopRequested() const { return stopRequested_.load(); }
+    // Running, or done after being asked to stop
+    bool healthy() const;
+    S32 exitCode() const { return exitCode_.load(); }
+    U64 uptimeMs() const;
+
+    // Service running on calling thread, nullptr if none
+    static ServiceThread * current() { return current_; }
+    static const char * stateName(State state);
+
+    ServiceThread(const ServiceThread &)=delete;
+    ServiceThread & operator=(const ServiceThread &)=delete;
+ private:
+    void run();
+
+    std::string name_;
+    ThreadRole role_;
+    S32 index_;
+    Loop loop_;
+    StopHandler stopHandler_;
+    std::thread thread_;
+    std::atomic<State> state_;
+    std::atomic<bool> stopRequested_;
+    std::atomic<bool> joining_;
+    std::atomic<S32> exitCode_;
+    std::chrono::steady_clock::time_point started_;
+
+    static thread_local ServiceThread * current_;
+};
+
+}  // namespace IKEv2
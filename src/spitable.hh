@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "logging.hh"
+#include "basictypes.hh"
+
+// Responder SPI layout, most to least significant bits:
+//   32 bit random tag | 8 bit shard | 24 bit slot
+// Slot and shard make lookup a direct index, random tag keeps
+// SPIs unpredictable and makes stale SPI of reused slot miss
+const U32 SPI_SLOT_BITS = 24;
+const U32 SPI_SHARD_BITS = 8;
+const U32 SPI_TAG_SHIFT = SPI_SLOT_BITS + SPI_SHARD_BITS;
+const U32 SPI_MAX_SHARDS = 1U << SPI_SHARD_BITS;
+const U32 SPI_MAX_SLOTS = 1U << SPI_SLOT_BITS;
+
+// Slots are allocated in chunks as table grows
+const U32 SPI_CHUNK_BITS = 12;
+const U32 SPI_CHUNK_SLOTS = 1U << SPI_CHUNK_BITS;
+const U32 SPI_MAX_CHUNKS = SPI_MAX_SLOTS >> SPI_CHUNK_BITS;
+
+// Table of IKE SAs indexed by locally allocated responder SPI.
+// SPI is minted by add() and carries slot it lives in, so find()
+// does no hashing or probing, cost is same at any no. of SAs.
+// Chunks never move once published and each slot has its own
+// lock, so find() takes no table wide lock
+template<typename v>
+class SpiTable {
+ public:
+    using Ptr = std::shared_ptr<v>;
+
+    // maxSlots is rounded up to whole chunks
+    explicit SpiTable(U32 shard = 0, U32 maxSlots = SPI_MAX_SLOTS);
+    ~SpiTable();
+
+    // Store value and return its new responder SPI, 0 if table is full
+    U64 add(const Ptr & value);
+    bool find(U64 spi, Ptr & value);
+    void erase(U64 spi);
+    std::size_t size();
+
+    static U32 shardOf(U64 spi);
+
+    SpiTable(const SpiTable &)=delete;
+    SpiTable & operator=(const SpiTable &)=delete;
+ private:
+    struct Slot {
+        Slot() : spi(0), busy(false) {}
+        // 0 while slot is free
+        std::atomic<U64> spi;
+        // Guards value, held only to copy / swap it
+        std::atomic<bool> busy;
+        Ptr value;
+    };
+
+    class SlotLock {
+     public:
+        explicit SlotLock(Slot & s) : s_(s) {
+            while (s_.busy.exchange(true, std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+        }
+        ~SlotLock() { s_.busy.store(false, std::memory_order_release); }
+     private:
+        Slot & s_;
+    };
+
+    Slot * slot(U64 spi);
+
+    U32 shard_;
+    U32 maxChunks_;
+    std::unique_ptr<std::atomic<Slot *>[]> chunks_;
+    // Below guarded by mutex_, only add() and erase() take it
+    std::mutex mutex_;
+    U32 chunkCount_;
+    // Released slots, reused before table grows
+    std::vector<U32> freeSlots_;
+    U32 used_;
+    std::mt19937_64 rng_;
+};
+
+template<typename v>
+SpiTable<v>::SpiTable(U32 shard, U32 maxSlots) : shard_(shard % SPI_MAX_SHARDS),
+                                                 maxChunks_(0),
+                                                 chunks_(new std::atomic<Slot *>[SPI_MAX_CHUNKS]),
+                                                 chunkCount_(0),
+                                                 used_(0),
+                                                 rng_(std::random_device()()) {
+    TRACE();
+    maxSlots = std::min(std::max(maxSlots, 1U), SPI_MAX_SLOTS);
+    maxChunks_ = (maxSlots + SPI_CHUNK_SLOTS - 1) >> SPI_CHUNK_BITS;
+    for (U32 idx = 0; idx < SPI_MAX_CHUNKS; idx++) {
+        chunks_[idx].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+template<typename v>
+U32
+SpiTable<v>::shardOf(U64 spi) {
+    return (spi >> SPI_SLOT_BITS) & (SPI_MAX_SHARDS - 1);
+}
+
+// Slot SPI maps to, nullptr if it can not belong to table. Slot
+// may since have been reused, caller compares its SPI
+template<typename v>
+typename SpiTable<v>::Slot *
+SpiTable<v>::slot(U64 spi) {
+    if (shardOf(spi) != shard_) {
+        return nullptr;
+    }
+
+    U32 idx = spi & (SPI_MAX_SLOTS - 1);
+    Slot * chunk = chunks_[idx >> SPI_CHUNK_BITS].load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+        return nullptr;
+    }
+
+    return &chunk[idx & (SPI_CHUNK_SLOTS - 1)];
+}
+
+template<typename v>
+U64
+SpiTable<v>::add(const Ptr & value) {
+    TRACE();
+    U32 idx;
+    U64 tag;
+
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!freeSlots_.empty()) {
+            idx = freeSlots_.back();
+            freeSlots_.pop_back();
+        } else {
+            if (chunkCount_ >= maxChunks_) {
+                LOG(ERROR, "SPI table of shard %u is full", shard_);
+                return 0;
+            }
+            idx = chunkCount_ * SPI_CHUNK_SLOTS;
+            chunks_[chunkCount_++].store(new Slot[SPI_CHUNK_SLOTS],
+                                         std::memory_order_release);
+            // Hand out rest of new chunk before touching it again
+            for (U32 i = SPI_CHUNK_SLOTS - 1; i > 0; i--) {
+                freeSlots_.push_back(idx + i);
+            }
+        }
+
+        used_++;
+        do {
+            tag = rng_() >> SPI_TAG_SHIFT;
+        } while (tag == 0);
+    }
+
+    U64 spi = (tag << SPI_TAG_SHIFT) |
+              (static_cast<U64>(shard_) << SPI_SLOT_BITS) | idx;
+
+    // Slot is ours alone till SPI is set, finders skip it before that
+    Slot * s = slot(spi);
+    SlotLock lock(*s);
+    s->value = value;
+    s->spi.store(spi, std::memory_order_release);
+
+    return spi;
+}
+
+template<typename v>
+bool
+SpiTable<v>::find(U64 spi, Ptr & value) {
+    TRACE();
+    Slot * s = slot(spi);
+    // Stale or forged SPI is turned away without writing to slot
+    if (s == nullptr || s->spi.load(std::memory_order_acquire) != spi) {
+        return false;
+    }
+
+    SlotLock lock(*s);
+    if (s->spi.load(std::memory_order_relaxed) != spi) {
+        return false;
+    }
+
+    value = s->value;
+    return true;
+}
+
+template<typename v>
+void
+SpiTable<v>::erase(U64 spi) {
+    TRACE();
+    Ptr victim;
+    Slot * s = slot(spi);
+    if (s == nullptr) {
+        return;
+    }
+
+    {
+        SlotLock lock(*s);
+        if (s->spi.load(std::memory_order_relaxed) != spi) {
+            return;
+        }
+        victim = std::move(s->value);
+        s->spi.store(0, std::memory_order_release);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        freeSlots_.push_back(spi & (SPI_MAX_SLOTS - 1));
+        used_--;
+    }
+
+    // victim is released here, outside any lock
+}
+
+template<typename v>
+std::size_t
+SpiTable<v>::size() {
+    TRACE();
+    std::unique_lock<std::mutex> lock(mutex_);
+    return used_;
+}
+
+template<typename v>
+SpiTable<v>::~SpiTable() {
+    TRACE();
+    for (U32 idx = 0; idx < chunkCount_; idx++) {
+        delete [] chunks_[idx].load(std::memory_order_relaxed);
+    }
+}
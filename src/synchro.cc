@@ -15,6 +15,11 @@
  * with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <limits.h>  // INT_MAX
+#include <algorithm>  // std::min
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
 #include "synchro.hh"
 
 namespace Synchro {
@@ -91,4 +96,93 @@ S32 Notifier::readEvent(eventfd_t flag) {
     return 0;
 }
 
+// End of class Notifier
+
+// Start of class WaitWord
+
+namespace {
+
+const U64 WAITER = 1;
+const U64 WOKEN = 1ULL << 32;
+
+U32 waiters(U64 state) { return static_cast<U32>(state); }
+U32 woken(U64 state) { return static_cast<U32>(state >> 32); }
+
+}  // namespace
+
+WaitWord::WaitWord() : word_(0), state_(0) {
+}
+
+U32
+WaitWord::prepareWait() {
+    state_.fetch_add(WAITER, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return word_.load(std::memory_order_seq_cst);
+}
+
+// Waiter leaves after sleeping or backing out. It may not be the
+// one which was woken, but every waiter registered when word_ moved
+// leaves, so woken count never exceeds waiters still to leave
+void
+WaitWord::leave() {
+    U64 state = state_.load(std::memory_order_relaxed);
+    U64 next;
+    do {
+        next = state - WAITER - (woken(state) > 0 ? WOKEN : 0);
+    } while (!state_.compare_exchange_weak(state, next, std::memory_order_seq_cst));
+}
+
+void
+WaitWord::wait(U32 generation) {
+    // Returns immediately if word_ already moved past generation
+    syscall(SYS_futex, reinterpret_cast<U32 *>(&word_), FUTEX_WAIT_PRIVATE,
+            generation, nullptr, nullptr, 0);
+    leave();
+}
+
+void
+WaitWord::cancelWait() {
+    leave();
+}
+
+void
+WaitWord::wake(S32 count) {
+    U64 state = state_.load(std::memory_order_seq_cst);
+    U32 woke;
+    do {
+        U32 sleeping = waiters(state) - std::min(woken(state), waiters(state));
+        if (sleeping == 0) {
+            return;
+        }
+        woke = std::min(static_cast<U32>(count), sleeping);
+    } while (!state_.compare_exchange_weak(state, state + woke * WOKEN,
+                                           std::memory_order_seq_cst));
+
+    word_.fetch_add(1, std::memory_order_seq_cst);
+    syscall(SYS_futex, reinterpret_cast<U32 *>(&word_), FUTEX_WAKE_PRIVATE,
+            woke, nullptr, nullptr, 0);
+}
+
+void
+WaitWord::wakeAll() {
+    // Used on shutdown, wake everybody whether already woken or not
+    U64 state = state_.load(std::memory_order_seq_cst);
+    while (!state_.compare_exchange_weak(state, (static_cast<U64>(waiters(state)) << 32) |
+                                                waiters(state),
+                                         std::memory_order_seq_cst)) {
+    }
+    word_.fetch_add(1, std::memory_order_seq_cst);
+    syscall(SYS_futex, reinterpret_cast<U32 *>(&word_), FUTEX_WAKE_PRIVATE,
+            INT_MAX, nullptr, nullptr, 0);
+}
+
+bool
+WaitWord::hasWaiters() const {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    U64 state = state_.load(std::memory_order_seq_cst);
+    return waiters(state) > woken(state);
+}
+
+// End of class WaitWord
+
 }  // namespace Synchro
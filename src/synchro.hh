@@ -21,6 +21,8 @@
 #include <inttypes.h>
 #include <sys/eventfd.h>
 
+#include <atomic>
+
 #include "basictypes.hh"
 #include "logging.hh"
 
@@ -41,4 +43,30 @@ class Notifier {
 
 };
 
+// Futex backed sleep / wake for lock-free structures. Waiter calls
+// prepareWait(), re-checks its condition and then either sleeps with
+// wait() or backs out with cancelWait(). Wakers publish their change
+// before checking hasWaiters(), so wakeups are never lost
+class WaitWord {
+ public:
+    WaitWord();
+    U32 prepareWait();
+    void wait(U32 generation);
+    void cancelWait();
+    void wake(S32 count);
+    void wakeAll();
+    // True while some waiter has not been woken yet, keeps syscall
+    // off fast path
+    bool hasWaiters() const;
+ private:
+    void leave();
+
+    std::atomic<U32> word_;
+    // Registered waiters in low 32 bits, how many of them were woken
+    // but have not left yet in high 32 bits. Woken waiters are not
+    // woken again, so burst of wakes costs one syscall per sleeper
+    // instead of one per wake
+    std::atomic<U64> state_;
+};
+
 }  // namespace Synchro
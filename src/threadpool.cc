@@ -15,18 +15,569 @@
  * with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/syscall.h>
+
+#include <set>
+
 #include "threadpool.hh"
+#include "utils.hh"
 
 namespace IKEv2 {
 
+// Initial capacity of work deque, grows when full
+const S64 WORK_DEQUE_SIZE = 256;
+
+thread_local ThreadPool::Worker * ThreadPool::localWorker = nullptr;
+thread_local bool ThreadPool::localPinned = false;
+
+const char *
+threadRoleName(ThreadRole role) {
+    switch (role) {
+        case ThreadRole::NETWORK:
+            return "network";
+        case ThreadRole::SESSION:
+            return "session";
+        case ThreadRole::CRYPTO:
+            return "crypto";
+        case ThreadRole::TIMER:
+            return "timer";
+    }
+    return "unknown";
+}
+
+const char *
+laneName(Lane lane) {
+    switch (lane) {
+        case Lane::CONTROL:
+            return "control";
+        case Lane::BULK:
+            return "bulk";
+    }
+    return "unknown";
+}
+
+static U64
+monotonicNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Start of class Task
+
+void *
+Task::operator new(std::size_t size) {
+    return Pool::poolFor<Task>("Task").allocate();
+}
+
+void
+Task::operator delete(void * ptr) {
+    Pool::BlockPool::release(ptr);
+}
+
+// End of class Task
+
+// Start of class WorkDeque
+
+WorkDeque::Array::Array(S64 size) : capacity(size), mask(size - 1),
+                                    slots(new std::atomic<Task *>[size]) {
+}
+
+WorkDeque::WorkDeque() : top_(0), bottom_(0),
+                         array_(new Array(WORK_DEQUE_SIZE)) {
+}
+
+// Copy live range into array twice as big. Old array is kept
+// since thieves may have loaded it already
+WorkDeque::Array *
+WorkDeque::grow(Array * array, S64 bottom, S64 top) {
+    Array * bigger = new Array(array->capacity * 2);
+    for (S64 idx = top; idx < bottom; idx++) {
+        bigger->put(idx, array->get(idx));
+    }
+    retired_.emplace_back(array);
+    array_.store(bigger, std::memory_order_release);
+    return bigger;
+}
+
+void
+WorkDeque::push(Task * task) {
+    S64 bottom = bottom_.load(std::memory_order_relaxed);
+    S64 top = top_.load(std::memory_order_acquire);
+    Array * array = array_.load(std::memory_order_relaxed);
+
+    if (bottom - top > array->capacity - 1) {
+        array = grow(array, bottom, top);
+    }
+
+    // Release store publishes task to thieves loading bottom_
+    array->put(bottom, task);
+    bottom_.store(bottom + 1, std::memory_order_release);
+}
+
+Task *
+WorkDeque::pop() {
+    S64 bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    Array * array = array_.load(std::memory_order_relaxed);
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    S64 top = top_.load(std::memory_order_relaxed);
+
+    if (top > bottom) {
+        // Empty, restore bottom
+        bottom_.store(bottom + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    Task * task = array->get(bottom);
+    if (top == bottom) {
+        // Last task, race thieves for it
+        if (!top_.compare_exchange_strong(top, top + 1,
+                                          std::memory_order_seq_cst,
+                                          std::memory_order_relaxed)) {
+            task = nullptr;
+        }
+        bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    return task;
+}
+
+Task *
+WorkDeque::steal() {
+    S64 top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    S64 bottom = bottom_.load(std::memory_order_acquire);
+
+    if (top >= bottom) {
+        return nullptr;
+    }
+
+    Array * array = array_.load(std::memory_order_acquire);
+    Task * task = array->get(top);
+    if (!top_.compare_exchange_strong(top, top + 1,
+                                      std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+        return nullptr;
+    }
+
+    return task;
+}
+
+bool
+WorkDeque::empty() const {
+    S64 top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return top >= bottom_.load(std::memory_order_acquire);
+}
+
+// Owner is gone, tasks never run are dropped
+WorkDeque::~WorkDeque() {
+    Array * array = array_.load(std::memory_order_relaxed);
+    S64 bottom = bottom_.load(std::memory_order_relaxed);
+    for (S64 idx = top_.load(std::memory_order_relaxed); idx < bottom; idx++) {
+        delete array->get(idx);
+    }
+    delete array;
+}
+
+// End of class WorkDeque
+
+// Start of class ThreadPool
+
+// Constructor just launches some amount of workers
+ThreadPool::ThreadPool(size_t threads) : stop(false), threadCount(0) {
+    TRACE();
+    for (auto & count : injected) {
+        count.store(0);
+    }
+    // Workers inherit this, so it is read before any is started
+    if (sched_getaffinity(0, sizeof(defaultCpus), &defaultCpus) == -1) {
+        perror("sched_getaffinity");
+        CPU_ZERO(&defaultCpus);
+    }
+    for (auto & cpus : roleCpus) {
+        CPU_ZERO(&cpus);
+    }
+
+    for (size_t i = 0 ; i < threads ; ++i) {
+        LOG(INFO, "Creating thread %d", i);
+        addWorker();
+    }
+    LOG(INFO, "All threads started successfully!");
+}
+
+// Worker is fully built before it is published through threadCount,
+// so thieves only ever see complete workers
+S32
+ThreadPool::addWorker() {
+    TRACE();
+    std::unique_lock<std::mutex> lock(workersMutex);
+
+    S32 id = threadCount.load();
+    if (id >= MAX_THREADS || stop) {
+        return -1;
+    }
+
+    workers[id].reset(new Worker(id));
+    threadCount.store(id + 1, std::memory_order_release);
+    workers[id]->thread = std::thread(&ThreadPool::workerFunc, this, workers[id].get());
+
+    return 0;
+}
+
+void
+ThreadPool::LaneCounters::record(U64 waitNs) {
+    tasks.fetch_add(1, std::memory_order_relaxed);
+    totalWaitNs.fetch_add(waitNs, std::memory_order_relaxed);
+    U64 max = maxWaitNs.load(std::memory_order_relaxed);
+    while (waitNs > max &&
+           !maxWaitNs.compare_exchange_weak(max, waitNs, std::memory_order_relaxed)) {
+    }
+}
+
+void
+ThreadPool::submit(Task * task, Lane lane) {
+    task->lane_ = lane;
+    task->queuedNs_ = monotonicNs();
+
+    std::size_t idx = static_cast<std::size_t>(lane);
+    Worker * self = localWorker;
+    if (self != nullptr) {
+        self->deques[idx].push(task);
+    } else {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        TaskList & list = tasks[idx];
+        if (list.tail != nullptr) {
+            list.tail->next_ = task;
+        } else {
+            list.head = task;
+        }
+        list.tail = task;
+        injected[idx].fetch_add(1);
+    }
+
+    // Task is published before waiters are checked, see WaitWord
+    if (idle.hasWaiters()) {
+        idle.wake(1);
+    }
+}
+
+Task *
+ThreadPool::popInjected(std::size_t lane) {
+    if (injected[lane].load() == 0) {
+        return nullptr;
+    }
+
+    std::unique_lock<std::mutex> lock(queueMutex);
+    TaskList & list = tasks[lane];
+    Task * task = list.head;
+    if (task == nullptr) {
+        return nullptr;
+    }
+
+    list.head = task->next_;
+    if (list.head == nullptr) {
+        list.tail = nullptr;
+    }
+    task->next_ = nullptr;
+    injected[lane].fetch_sub(1);
+    return task;
+}
+
+// Lanes strictly by priority, bulk work only runs when no control
+// work is found anywhere
+Task *
+ThreadPool::findTask(Worker * self) {
+    for (std::size_t lane = 0; lane < LANES; lane++) {
+        Task * task = findTask(self, lane);
+        if (task != nullptr) {
+            return task;
+        }
+    }
+
+    return nullptr;
+}
+
+// Own deque first(LIFO keeps caches warm), then shared injector,
+// then steal from other workers starting at random victim
+Task *
+ThreadPool::findTask(Worker * self, std::size_t lane) {
+    Task * task = self->deques[lane].pop();
+    if (task != nullptr) {
+        return task;
+    }
+
+    task = popInjected(lane);
+    if (task != nullptr) {
+        return task;
+    }
+
+    S32 count = threadCount.load(std::memory_order_acquire);
+    self->seed ^= self->seed << 13;
+    self->seed ^= self->seed >> 17;
+    self->seed ^= self->seed << 5;
+    S32 start = self->seed % count;
+
+    for (S32 i = 0; i < count; i++) {
+        Worker * victim = workers[(start + i) % count].get();
+        if (victim == self) {
+            continue;
+        }
+        task = victim->deques[lane].steal();
+        if (task != nullptr) {
+            return task;
+        }
+    }
+
+    return nullptr;
+}
+
+bool
+ThreadPool::hasWork() {
+    for (std::size_t lane = 0; lane < LANES; lane++) {
+        if (injected[lane].load() != 0) {
+            return true;
+        }
+    }
+
+    S32 count = threadCount.load(std::memory_order_acquire);
+    for (S32 i = 0; i < count; i++) {
+        for (auto & deque : workers[i]->deques) {
+            if (!deque.empty()) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void
+ThreadPool::runTask(Worker * self, Task * task) {
+    std::size_t lane = static_cast<std::size_t>(task->lane_);
+    self->counters[lane].record(monotonicNs() - task->queuedNs_);
+
+    // Do your thing
+    (*task)();
+    delete task;
+
+    if (localPinned) {
+        Utils::setThreadAffinity(defaultCpus);
+        localPinned = false;
+    }
+}
+
+void
+ThreadPool::workerFunc(Worker * self) {
+    TRACE();
+    localWorker = self;
+
+    // Indefinite worker loop which finds tasks and
+    // executes them until threadpool is deleted
+    while (!stop) {
+        Task * task = findTask(self);
+        if (task != nullptr) {
+            runTask(self, task);
+            continue;
+        }
+
+        // Nothing found. Announce intent to sleep, look once more
+        // and only then park, so task pushed meanwhile is not missed
+        U32 generation = idle.prepareWait();
+        if (stop || hasWork()) {
+            idle.cancelWait();
+            continue;
+        }
+        idle.wait(generation);
+    }
+}
+
+LaneStats
+ThreadPool::laneStats(Lane lane) const {
+    TRACE();
+    LaneStats stats = {0, 0, 0};
+    auto add = [&stats](const LaneCounters & counters) {
+        stats.tasks += counters.tasks.load(std::memory_order_relaxed);
+        stats.totalWaitNs += counters.totalWaitNs.load(std::memory_order_relaxed);
+        stats.maxWaitNs = std::max(stats.maxWaitNs,
+                                   counters.maxWaitNs.load(std::memory_order_relaxed));
+    };
+
+    S32 count = threadCount.load(std::memory_order_acquire);
+    for (S32 i = 0; i < count; i++) {
+        add(workers[i]->counters[static_cast<std::size_t>(lane)]);
+    }
+
+    return stats;
+}
+
+S32
+ThreadPool::killThread() {
+    TRACE();
+    return 0;
+}
+
+S32
+ThreadPool::cpuSetIs(ThreadRole role, const std::string & cpuList) {
+    TRACE();
+    cpu_set_t cpus;
+
+    if (Utils::parseCpuList(cpuList, cpus) == -1) {
+        LOG(ERROR, "Invalid %s cpu list \"%s\"", threadRoleName(role), cpuList.c_str());
+        return -1;
+    }
+
+    roleCpus[static_cast<std::size_t>(role)] = cpus;
+    return 0;
+}
+
+S32
+ThreadPool::threadAffinityIs(ThreadRole role, S32 index) {
+    TRACE();
+    cpu_set_t cpus = roleCpus[static_cast<std::size_t>(role)];
+
+    if (CPU_COUNT(&cpus) == 0) {
+        // Unpinned role. Single cpu placement is still honoured
+        // over whatever process may run on
+        if (index < 0 || CPU_COUNT(&defaultCpus) == 0) {
+            return 0;
+        }
+        cpus = defaultCpus;
+    }
+
+    if (index >= 0) {
+        S32 nth = index % CPU_COUNT(&cpus);
+        S32 cpu = 0;
+        for (; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &cpus) && nth-- == 0) {
+                break;
+            }
+        }
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+    }
+
+    if (Utils::setThreadAffinity(cpus) == -1) {
+        return -1;
+    }
+    localPinned = true;
+
+    // Report where thread actually ended up
+    LOG(INFO, "Placement: %s thread %ld index %d pinned to cpus %s, on cpu %d node %d",
+        threadRoleName(role), syscall(SYS_gettid), index,
+        Utils::cpuListString(cpus).c_str(), sched_getcpu(),
+        Utils::numaNodeOfCpu(sched_getcpu()));
+
+    return 0;
+}
+
+S32
+ThreadPool::runPinned(ThreadRole role, S32 index, const std::function<void()> & func) {
+    TRACE();
+    S32 ret = 0;
+
+    std::thread thread([&]() {
+        ret = threadAffinityIs(role, index);
+        func();
+    });
+    thread.join();
+
+    return ret;
+}
+
+void
+ThreadPool::placementReport() {
+    TRACE();
+    LOG(INFO, "Placement: process cpus %s", Utils::cpuListString(defaultCpus).c_str());
+
+    for (std::size_t idx = 0; idx < THREAD_ROLES; idx++) {
+        const cpu_set_t & cpus = roleCpus[idx];
+        if (CPU_COUNT(&cpus) == 0) {
+            LOG(INFO, "Placement: %s threads not pinned",
+                threadRoleName(static_cast<ThreadRole>(idx)));
+            continue;
+        }
+
+        // Cpus of two nodes may be numbered alternately
+        std::set<S32> nodeIds;
+        for (S32 cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &cpus)) {
+                continue;
+            }
+            nodeIds.insert(Utils::numaNodeOfCpu(cpu));
+            if (!CPU_ISSET(cpu, &defaultCpus)) {
+                LOG(WARN, "Placement: %s cpu %d is not allowed for process",
+                    threadRoleName(static_cast<ThreadRole>(idx)), cpu);
+            }
+        }
+
+        std::string nodes;
+        for (auto node : nodeIds) {
+            nodes += (nodes.empty() ? "" : ",") + std::to_string(node);
+        }
+
+        LOG(INFO, "Placement: %s threads on cpus %s, NUMA nodes %s",
+            threadRoleName(static_cast<ThreadRole>(idx)),
+            Utils::cpuListString(cpus).c_str(), nodes.c_str());
+    }
+}
+
+// Destructor joins all threads
+ThreadPool::~ThreadPool() {
+    TRACE();
+    if (!stop) {
+        shutdown();
+    }
+
+    // Tasks which never ran
+    for (auto & lane : tasks) {
+        while (lane.head != nullptr) {
+            Task * task = lane.head;
+            lane.head = task->next_;
+            delete task;
+        }
+    }
+}
+
+S32
+ThreadPool::shutdown() {
+    TRACE();
+    if (!stop) {
+        {
+            std::unique_lock<std::mutex> lock(workersMutex);
+            stop = true;
+        }
+
+        // Notify all threads to stop executing
+        idle.wakeAll();
+
+        // Wait for all threads to complete
+        try {
+            S32 count = threadCount.load();
+            for (S32 i = 0; i < count; i++) {
+                LOG(INFO, "Joining thread %x", workers[i]->thread.get_id());
+                workers[i]->thread.join();
+            }
+            LOG(INFO, "Done joining all threads");
+        }
+        catch(const std::system_error & err) {
+            LOGT("Exception while joining threads");
+            LOGT("Eror code %d, meaning %s", err.code().value(), err.what());
+            return -1;
+        }
+    }
+    return 0;
+}
+
 // Return global static thread pool(singleton)
 ThreadPool &
 ThreadPool::getThreadPool() {
     TRACE();
-    static ThreadPool threadPool(MAX_THREADS);
+    static ThreadPool threadPool(std::min<U32>(MAX_THREADS,
+                                               std::max(1U, std::thread::hardware_concurrency())));
     return threadPool;
 }
 
-}  // namespace IKEv2
-
+// End of class ThreadPool
 
+}  // namespace IKEv2
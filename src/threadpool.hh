@@ -20,36 +20,269 @@
 
 #pragma once
 
+#include <array>
+#include <deque>
 #include <vector>
-#include <queue>
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <future>
 #include <functional>
-#include <condition_variable>
+#include <type_traits>
 
 #include <sys/types.h>
 #include <unistd.h>
+#include <sched.h>
 
 #include "logging.hh"
+#include "basictypes.hh"
+#include "synchro.hh"
+#include "pool.hh"
 
-#define MAX_THREADS 50
+// Pool runs one worker per core, but never more than this. Endless
+// loops run on ServiceThread, so workers are never held for long
+#define MAX_THREADS 64
 
 #define ENQUEUE_TASK(...) IKEv2::ThreadPool::getThreadPool().enqueue(__VA_ARGS__)
+// Fire and forget, use when nobody waits for result. Optional
+// second argument picks lane
+#define POST_TASK(...) IKEv2::ThreadPool::getThreadPool().post(__VA_ARGS__)
 
 namespace IKEv2{
 
+// Long running threads by what they do. Each role can be pinned
+// to its own cpus(see affinity.* in ikev2.conf)
+enum class ThreadRole {
+    NETWORK,
+    SESSION,
+    CRYPTO,
+    TIMER,
+};
+
+const std::size_t THREAD_ROLES = 4;
+
+const char * threadRoleName(ThreadRole role);
+
+// Pool workers serve CONTROL lane ahead of BULK, so protocol work
+// (timeouts, replies) is not queued behind crypto / cleanup jobs
+enum class Lane {
+    CONTROL,
+    BULK,
+};
+
+const std::size_t LANES = 2;
+
+const char * laneName(Lane lane);
+
+// Time tasks of lane spent queued before starting to run
+struct LaneStats {
+    U64 tasks;
+    U64 totalWaitNs;
+    U64 maxWaitNs;
+};
+
+// Callables up to this size are stored inside Task itself
+const std::size_t TASK_INLINE_BYTES = 48;
+
+// Move-only type erased void() callable. Small callables are kept
+// inline and task nodes come from block pool, so posting lambda
+// with few captures allocates nothing
+class Task {
+ public:
+    template<typename F, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    explicit Task(F && f);
+    Task(Task && other);
+    ~Task();
+
+    void operator()();
+
+    static void * operator new(std::size_t size);
+    static void operator delete(void * ptr);
+
+    Task(const Task &)=delete;
+    Task & operator=(const Task &)=delete;
+ private:
+    friend class ThreadPool;
+
+    struct Ops {
+        void (*invoke)(void * storage);
+        // Move construct into dst and destroy src
+        void (*move)(void * dst, void * src);
+        void (*destroy)(void * storage);
+    };
+
+    template<typename F>
+    struct InlineOps {
+        static void invoke(void * storage) { (*static_cast<F *>(storage))(); }
+        static void move(void * dst, void * src) {
+            new (dst) F(std::move(*static_cast<F *>(src)));
+            static_cast<F *>(src)->~F();
+        }
+        static void destroy(void * storage) { static_cast<F *>(storage)->~F(); }
+        static const Ops ops;
+    };
+
+    // Inline storage needs callable which fits and whose move
+    // cannot throw, since Task moves it between storages
+    template<typename F>
+    using FitsInline = std::integral_constant<bool,
+        sizeof(F) <= TASK_INLINE_BYTES &&
+        alignof(F) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible<F>::value>;
+
+    // Only matching overload is instantiated, placement new of
+    // big callable into storage would not compile
+    template<typename F>
+    void store(F && f, std::true_type);
+    template<typename F>
+    void store(F && f, std::false_type);
+
+    // Too big for inline storage, storage holds pointer
+    template<typename F>
+    struct HeapOps {
+        static void invoke(void * storage) { (**static_cast<F **>(storage))(); }
+        static void move(void * dst, void * src) {
+            *static_cast<F **>(dst) = *static_cast<F **>(src);
+        }
+        static void destroy(void * storage) { delete *static_cast<F **>(storage); }
+        static const Ops ops;
+    };
+
+    const Ops * ops_;
+    // Set by ThreadPool on submit, for queue wait metrics
+    Lane lane_;
+    U64 queuedNs_;
+    // Link in ThreadPool injector queue
+    Task * next_;
+    alignas(std::max_align_t) UCHAR storage_[TASK_INLINE_BYTES];
+};
+
+template<typename F>
+const Task::Ops Task::InlineOps<F>::ops = {&InlineOps<F>::invoke,
+                                           &InlineOps<F>::move,
+                                           &InlineOps<F>::destroy};
+
+template<typename F>
+const Task::Ops Task::HeapOps<F>::ops = {&HeapOps<F>::invoke,
+                                         &HeapOps<F>::move,
+                                         &HeapOps<F>::destroy};
+
+template<typename F, typename>
+Task::Task(F && f) : lane_(Lane::CONTROL), queuedNs_(0), next_(nullptr) {
+    using Fn = typename std::decay<F>::type;
+    store(std::forward<F>(f), FitsInline<Fn>());
+}
+
+template<typename F>
+void
+Task::store(F && f, std::true_type) {
+    using Fn = typename std::decay<F>::type;
+    new (storage_) Fn(std::forward<F>(f));
+    ops_ = &InlineOps<Fn>::ops;
+}
+
+template<typename F>
+void
+Task::store(F && f, std::false_type) {
+    using Fn = typename std::decay<F>::type;
+    *reinterpret_cast<Fn **>(storage_) = new Fn(std::forward<F>(f));
+    ops_ = &HeapOps<Fn>::ops;
+}
+
+inline
+Task::Task(Task && other) : ops_(other.ops_), lane_(other.lane_),
+                            queuedNs_(other.queuedNs_), next_(nullptr) {
+    ops_->move(storage_, other.storage_);
+    other.ops_ = nullptr;
+}
+
+inline
+Task::~Task() {
+    if (ops_ != nullptr) {
+        ops_->destroy(storage_);
+    }
+}
+
+inline void
+Task::operator()() {
+    ops_->invoke(storage_);
+}
+
+// Chase-Lev work stealing deque(C11 orderings from Le et al., "Correct
+// and Efficient Work-Stealing for Weak Memory Models"). Owner pushes
+// and pops at bottom, other threads steal from top
+class WorkDeque {
+ public:
+    WorkDeque();
+    ~WorkDeque();
+
+    // Owner only
+    void push(Task * task);
+    Task * pop();
+    // Any thread. Returns nullptr if empty or race with other
+    // thief / owner was lost
+    Task * steal();
+    bool empty() const;
+
+    WorkDeque(const WorkDeque &)=delete;
+    WorkDeque & operator=(const WorkDeque &)=delete;
+ private:
+    struct Array {
+        explicit Array(S64 size);
+        Task * get(S64 idx) const {
+            return slots[idx & mask].load(std::memory_order_relaxed);
+        }
+        void put(S64 idx, Task * task) {
+            slots[idx & mask].store(task, std::memory_order_relaxed);
+        }
+
+        S64 capacity;
+        S64 mask;
+        std::unique_ptr<std::atomic<Task *>[]> slots;
+    };
+
+    Array * grow(Array * array, S64 bottom, S64 top);
+
+    static const std::size_t CACHE_LINE = 64;
+
+    // Owner and thieves update different ends, keep them apart
+    char pad0_[CACHE_LINE];
+    std::atomic<S64> top_;
+    char pad1_[CACHE_LINE];
+    std::atomic<S64> bottom_;
+    std::atomic<Array *> array_;
+    char pad2_[CACHE_LINE];
+    // Arrays replaced by grow(), thieves may still be reading them
+    std::vector<std::unique_ptr<Array>> retired_;
+};
+
 class ThreadPool final {
  public:
      ThreadPool(size_t);
      ~ThreadPool();
     static ThreadPool & getThreadPool();
+    // Runs on CONTROL lane
     template<class F, class... Args>
     auto enqueue(F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type>;
+    // Run callable without future or shared state
+    template<class F>
+    void post(F&& f, Lane lane = Lane::CONTROL);
+    LaneStats laneStats(Lane lane) const;
     S32 killThread();
-    S32 threadAffinityIs();
+    // Cpus threads of role run on, in kernel cpu list format
+    S32 cpuSetIs(ThreadRole role, const std::string & cpuList);
+    // Pin calling thread to cpus of role. With index >= 0 thread gets
+    // single cpu, index-th of role's cpus(wrapping), e.g. one per shard.
+    // Pool worker is unpinned again once its task returns
+    S32 threadAffinityIs(ThreadRole role, S32 index = -1);
+    // Run func on thread placed as by threadAffinityIs() and wait for
+    // it. Memory func touches first lands on that cpu's NUMA node
+    S32 runPinned(ThreadRole role, S32 index, const std::function<void()> & func);
+    // Log cpus / NUMA nodes of every role
+    void placementReport();
     S32 shutdown();
 
     // Delete all copy / move constructors
@@ -57,66 +290,84 @@ class ThreadPool final {
     ThreadPool & operator=(const ThreadPool &)=delete;
 
  private:
-    void workerFunc();
-    bool stop;
-    S32 threadCount;
-    std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
+    // Updated by worker owning it, read by laneStats()
+    struct LaneCounters {
+        LaneCounters() : tasks(0), totalWaitNs(0), maxWaitNs(0) {}
+        void record(U64 waitNs);
+        std::atomic<U64> tasks;
+        std::atomic<U64> totalWaitNs;
+        std::atomic<U64> maxWaitNs;
+    };
+
+    struct Worker {
+        explicit Worker(S32 workerId) : id(workerId), seed(workerId + 1) {}
+        S32 id;
+        // Random victim selection(xorshift state)
+        U32 seed;
+        std::array<WorkDeque, LANES> deques;
+        std::array<LaneCounters, LANES> counters;
+        std::thread thread;
+    };
+
+    template<class F, class... Args>
+    auto enqueueOn(Lane lane, F&& f, Args&&... args)
+    -> std::future<typename std::result_of<F(Args...)>::type>;
+    // Tasks submitted from worker go to its own deque, others
+    // go to shared injector queue of lane
+    void submit(Task * task, Lane lane);
+    S32 addWorker();
+    void workerFunc(Worker * self);
+    void runTask(Worker * self, Task * task);
+    Task * findTask(Worker * self);
+    Task * findTask(Worker * self, std::size_t lane);
+    Task * popInjected(std::size_t lane);
+    bool hasWork();
+
+    std::atomic<bool> stop;
+    // No. of started workers
+    std::atomic<S32> threadCount;
+    std::mutex workersMutex;
+    std::array<std::unique_ptr<Worker>, MAX_THREADS> workers;
+
+    // Injector queue of lane, FIFO linked through Task::next_ so
+    // that submitting from non-pool thread allocates nothing
+    struct TaskList {
+        TaskList() : head(nullptr), tail(nullptr) {}
+        Task * head;
+        Task * tail;
+    };
 
     std::mutex queueMutex;
-    std::condition_variable condition;
-};
+    std::array<TaskList, LANES> tasks;
+    std::array<std::atomic<std::size_t>, LANES> injected;
 
-inline void
-ThreadPool::workerFunc() {
-    TRACE();
-    // Indefinite worker loop which pops tasks from queue and
-    // executes them until threadpool is deleted
-    while (true) {
-        std::function<void()> task;
-        // Scoped lock, same lock is used to protect both tasks & stop
-        {
-            // Worker thread will block till new work in enqueued
-            std::unique_lock<std::mutex> lock(queueMutex);
-            condition.wait(lock, [this]{ return this->stop ||
-                                         !this->tasks.empty(); });
-            // If thread pool is deleted or tasks is empty
-            if (stop || tasks.empty()) {
-                return;
-            }
-            // Move temp task object and then pop
-            task = tasks.front();
-            tasks.pop();
-        }
-        // Do your thing
-        task();
-        threadCount--;
-    }
-}
+    // Idle workers sleep here
+    Synchro::WaitWord idle;
 
-// Constructor just launches some amount of workers
-inline
-ThreadPool::ThreadPool(size_t threads) : stop(false), threadCount(0) {
-    TRACE();
-    for(size_t i = 0 ; i < threads ; ++i) {
-        LOG(INFO, "Creating thread %d", i);
-        workers.emplace_back(&ThreadPool::workerFunc, this);
-    }
-    LOG(INFO, "All threads started successfully!");
-}
+    // Affinity of process at startup, workers go back to it after
+    // task pinned them. Empty role set means role is not pinned
+    cpu_set_t defaultCpus;
+    std::array<cpu_set_t, THREAD_ROLES> roleCpus;
+
+    // Worker run by current thread, nullptr for non-pool threads
+    static thread_local Worker * localWorker;
+    // Task on current thread changed its affinity
+    static thread_local bool localPinned;
+};
 
 // Add new work item to the pool
 template <class F, class... Args>
 auto
 ThreadPool::enqueue(F&& f, Args&&... args) ->
     std::future<typename std::result_of<F(Args...)>::type> {
-    TRACE();
+    return enqueueOn(Lane::CONTROL, std::forward<F>(f), std::forward<Args>(args)...);
+}
 
-    if (threadCount > MAX_THREADS) {
-        LOGT("Max threads in thread pool exceeded");
-        LOGT("Creating more threads on-demand");
-        workers.emplace_back(&ThreadPool::workerFunc, this);
-    }
+template <class F, class... Args>
+auto
+ThreadPool::enqueueOn(Lane lane, F&& f, Args&&... args) ->
+    std::future<typename std::result_of<F(Args...)>::type> {
+    TRACE();
 
     // Define return type
     using returnType = typename std::result_of<F(Args...)>::type;
@@ -130,76 +381,28 @@ ThreadPool::enqueue(F&& f, Args&&... args) ->
     // Get future object for obtaining return value of task
     auto res = task->get_future();
 
-    //Scoped lock for queue
-    {
-        std::unique_lock<std::mutex> lock(queueMutex);
-
-        // Don't allow enqueueing after stopping the pool
-        if (stop) {
-            throw std::runtime_error("enqueue on stopped ThreadPool");
-        }
-
-        // Add task to queue
-        tasks.emplace([task](){ (*task)(); });
-        threadCount++;
-        LOG(INFO, "Successfully added task");
+    // Don't allow enqueueing after stopping the pool
+    if (stop) {
+        throw std::runtime_error("enqueue on stopped ThreadPool");
     }
 
-    // Notify worker thread
-    condition.notify_one();
+    submit(new Task([task](){ (*task)(); }), lane);
 
     return res;
 }
 
-inline S32
-ThreadPool::killThread() {
+template <class F>
+void
+ThreadPool::post(F&& f, Lane lane) {
     TRACE();
-    return 0;
-}
-
-inline S32
-ThreadPool::threadAffinityIs() {
-    TRACE();
-    return 0;
-}
 
-// Destructor joins all threads
-inline
-ThreadPool::~ThreadPool() {
-    TRACE();
-    if (!stop) {
-        shutdown();
+    // Nobody waits on posted task, so drop instead of throwing
+    if (stop) {
+        LOGT("post on stopped ThreadPool");
+        return;
     }
-}
-
-inline S32
-ThreadPool::shutdown() {
-    TRACE();
-    if (!stop) {
-        // Scoped lock for stop variable
-        {
-            std::unique_lock<std::mutex> lock(queueMutex);
-            stop = true;
-        }
-
-        // Notify all threads to stop executing
-        condition.notify_all();
 
-        // Wait for all threads to complete
-        try {
-            for (auto & worker: workers) {
-                LOG(INFO, "Joining thread %x", worker.get_id());
-                worker.join();
-            }
-            LOG(INFO, "Done joining all threads");
-        }
-        catch(const std::system_error & err) {
-            LOGT("Exception while joining threads");
-            LOGT("Eror code %d, meaning %s", err.code().value(), err.what());
-            return -1;
-        }
-    }
-    return 0;
+    submit(new Task(std::forward<F>(f)), lane);
 }
 
 }  // namespace IKEv2
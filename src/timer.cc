@@ -19,122 +19,523 @@
 
 namespace Timer {
 
+void
+TimerNode::unlink() {
+    prev_->next_ = next_;
+    next_->prev_ = prev_;
+    prev_ = next_ = this;
+}
+
+void
+TimerNode::linkBefore(TimerNode * node) {
+    prev_ = node->prev_;
+    next_ = node;
+    node->prev_->next_ = this;
+    node->prev_ = this;
+}
 
-Event::Event(S32 id, S32 timeLeft,
-             S32 timeout, bool repeat,
-             S32 repeatCount,
-             std::chrono::time_point<std::chrono::system_clock> startTime,
+Event::Event(S32 id, S32 timeout, bool repeat,
+             S32 repeatCount, U64 expiry,
              std::function<void()> eventHandler) :
-                id_(id), timeLeft_(timeLeft),
-                timeout_(timeout), repeat_(repeat),
+                id_(id), timeout_(timeout),
+                repeat_(repeat),
                 repeatCount_(repeatCount),
-                startTime_(startTime),
-                eventHandler_(eventHandler) {
+                eventHandler_(std::move(eventHandler)) {
     TRACE();
+    expiry_ = expiry;
 }
 
-AsyncTimer::AsyncTimer() : stopThread_(false), fallThrough_(false) {
+TimerHandle::TimerHandle(AsyncTimer & timer) : timer_(timer), slackMask_(0),
+                                               spread_(0), deadline_(0) {
     TRACE();
+    handle_ = true;
 }
 
-S32
-AsyncTimer::timerLoop() {
+void
+TimerHandle::handlerIs(std::function<void()> handler) {
+    TRACE();
+    handler_ = std::move(handler);
+}
+
+void
+TimerHandle::slackIs(S32 slack) {
+    TRACE();
+    // Window is largest power of 2 within slack so that rounding
+    // up is a mask and handles with same slack share boundaries
+    slackMask_ = 0;
+    while (slack > 1 && (slackMask_ + 1) * 2 <= static_cast<U64>(slack)) {
+        slackMask_ = slackMask_ * 2 + 1;
+    }
+}
+
+void
+TimerHandle::spreadIs(S32 window, U64 seed) {
+    TRACE();
+    if (window <= 0) {
+        spread_ = 0;
+        return;
+    }
+
+    // Mix seed so nearby seeds(e.g. sequential SPIs) scatter
+    seed ^= seed >> 33;
+    seed *= 0xff51afd7ed558ccdULL;
+    seed ^= seed >> 33;
+    spread_ = seed % static_cast<U64>(window);
+}
+
+void
+TimerHandle::reset(S32 timeout) {
+    U64 deadline = timer_.nowTick() + std::max(timeout, 0) + 1 + spread_;
+    deadline = (deadline + slackMask_) & ~slackMask_;
+
+    // Armed and moving out: node is already linked no later than
+    // new deadline, publishing deadline is enough
+    U64 current = deadline_.load();
+    while (current != 0 && deadline >= current) {
+        if (deadline_.compare_exchange_weak(current, deadline)) {
+            return;
+        }
+    }
+
+    // Disarmed(or fired meanwhile) or moving in, relink under lock
+    timer_.arm(this, deadline);
+}
+
+void
+TimerHandle::cancel() {
+    TRACE();
+    timer_.disarm(this);
+}
+
+bool
+TimerHandle::armed() const {
+    return deadline_.load() != 0;
+}
+
+TimerHandle::~TimerHandle() {
     TRACE();
+    // Always go through lock, timer loop may be reading handler
+    cancel();
+}
+
+AsyncTimer::AsyncTimer() : epoch_(std::chrono::steady_clock::now()),
+                           armed_(0), currentTick_(0), wakeTick_(UINT64_MAX),
+                           nextId_(0), timerFd_(-1), stopThread_(false),
+                           fallThrough_(false) {
+    TRACE();
+    memset(levelCount_, 0, sizeof(levelCount_));
+}
+
+U64
+AsyncTimer::nowTick() const {
+    if (clock_) {
+        return clock_();
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - epoch_).count();
+}
+
+// Link node in slot of lowest level whose span covers time left.
+// Caller must hold eventQMutex_
+void
+AsyncTimer::place(TimerNode * node) {
+    U64 expiry = node->expiry_;
+    if (expiry < currentTick_) {
+        expiry = currentTick_;
+    }
+
+    // Beyond wheel range, park in last level. Node keeps real
+    // expiry and is placed again when slot cascades
+    U64 delta = expiry - currentTick_;
+    const U64 range = 1ULL << (WHEEL_BITS * WHEEL_LEVELS);
+    if (delta >= range) {
+        delta = range - 1;
+        expiry = currentTick_ + delta;
+    }
+
+    U32 level = 0;
+    while (delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    U32 slot = (expiry >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    node->linkBefore(&wheel_[level][slot]);
+    node->level_ = level;
+    levelCount_[level]++;
+}
+
+// Caller must hold eventQMutex_
+void
+AsyncTimer::unlink(TimerNode * node) {
+    levelCount_[node->level_]--;
+    node->unlink();
+}
+
+// Move events of current slot in given level to lower levels
+void
+AsyncTimer::cascade(U32 level) {
+    U32 slot = (currentTick_ >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    TimerNode & head = wheel_[level][slot];
+    if (head.empty()) {
+        return;
+    }
+
+    // Detach whole slot first, place() may link into it again
+    TimerNode list;
+    list.next_ = head.next_;
+    list.prev_ = head.prev_;
+    list.next_->prev_ = &list;
+    list.prev_->next_ = &list;
+    head.next_ = head.prev_ = &head;
+
+    while (!list.empty()) {
+        TimerNode * node = list.next_;
+        unlink(node);
+        place(node);
+    }
+}
+
+// Process every tick up to and including now. Handlers of expired
+// events are collected in fired so they run without lock held
+void
+AsyncTimer::expire(U64 now, std::vector<std::function<void()>> & fired) {
+    // Nothing armed, no slot to visit on the way
+    if (armed_ == 0) {
+        currentTick_ = std::max(currentTick_, now + 1);
+        return;
+    }
+
+    while (currentTick_ <= now) {
+        U32 idx = currentTick_ & WHEEL_MASK;
+
+        // Level 0 wrapped, pull next slot of upper levels down
+        if (idx == 0) {
+            for (U32 level = 1; level < WHEEL_LEVELS; level++) {
+                cascade(level);
+                if (((currentTick_ >> (WHEEL_BITS * level)) & WHEEL_MASK) != 0) {
+                    break;
+                }
+            }
+        }
+
+        TimerNode & head = wheel_[0][idx];
+        while (!head.empty()) {
+            TimerNode * node = head.next_;
+            unlink(node);
+
+            if (node->handle_) {
+                expireHandle(static_cast<TimerHandle *>(node), fired);
+                continue;
+            }
+
+            Event * event = static_cast<Event *>(node);
+
+            // If timer has to be repeated arm it again
+            // one period after tick it was due
+            if (event->repeat_) {
+                fired.push_back(event->eventHandler_);
+                event->repeatCount_++;
+                event->expiry_ = currentTick_ + std::max(event->timeout_, 1);
+                place(event);
+            } else {
+                fired.push_back(std::move(event->eventHandler_));
+                events_.erase(event->id_);
+                armed_--;
+            }
+        }
+
+        currentTick_++;
+
+        // Level 0 is drained, jump straight to next tick where lowest
+        // busy level cascades instead of visiting each empty slot
+        if (levelCount_[0] == 0) {
+            U32 level = 1;
+            while (level < WHEEL_LEVELS && levelCount_[level] == 0) {
+                level++;
+            }
+            U64 next = now + 1;
+            if (level < WHEEL_LEVELS) {
+                U64 span = 1ULL << (WHEEL_BITS * level);
+                next = std::min(next, (currentTick_ + span - 1) & ~(span - 1));
+            }
+            currentTick_ = next;
+        }
+    }
+}
+
+// Handle's slot came due. Fire it unless deadline was pushed out
+// meanwhile, then only move node to slot of new deadline
+void
+AsyncTimer::expireHandle(TimerHandle * handle,
+                         std::vector<std::function<void()>> & fired) {
+    U64 deadline = handle->deadline_.load();
     while (true) {
-        // Block till queue is empty
-        {
-            std::unique_lock<std::mutex> lock(emptyQMutex_);
-            emptyQCond_.wait(lock, [this]{ return this->stopThread_ ||
-                                           !this->eventQ_.empty(); });
+        if (deadline > currentTick_) {
+            handle->expiry_ = deadline;
+            place(handle);
+            return;
+        }
+        // Lost race with reset() moving deadline, try again
+        if (handle->deadline_.compare_exchange_weak(deadline, 0)) {
+            fired.push_back(handle->handler_);
+            armed_--;
+            return;
         }
+    }
+}
 
-        if (stopThread_) {
-            LOG(INFO, "Timer loop has been stopped");
-            return 0;
+// Earliest tick with work: first busy level 0 slot before level 0
+// wraps, else the wrap itself where upper levels cascade
+U64
+AsyncTimer::nextWakeTick() const {
+    U64 tick = currentTick_;
+    do {
+        if (!wheel_[0][tick & WHEEL_MASK].empty()) {
+            return tick;
         }
+        tick++;
+    } while (tick & WHEEL_MASK);
 
-        if (!eventQ_.empty()) {
-            // Block till least timeout value in eventQ_ is expired or
-            // new event gets added to eventQ_ with lesser value
-            std::unique_lock<std::mutex> lock(eventQMutex_);
-            eventQCond_.wait_until(lock,
-                                   std::chrono::system_clock::now() + std::chrono::milliseconds(eventQ_.back()->timeLeft_),
-                                   [this] { return this->stopThread_ ||
-                                            this->fallThrough_; });
-
-            auto currTime = std::chrono::system_clock::now();
-
-            for (auto iter = eventQ_.begin() ; iter != eventQ_.end();) {
-                auto elapsedTime = \
-                    std::chrono::duration_cast<std::chrono::milliseconds>(
-                    currTime - (*iter)->startTime_).count();
-
-                (*iter)->timeLeft_ -= elapsedTime;
-
-                // If there's no time left then fire event handler
-                if ((*iter)->timeLeft_ <= 0) {
-                    ENQUEUE_TASK((*iter)->eventHandler_);
-                    // If timer has to be repeated reset
-                    // startTime_ and timeLeft_
-                    if ((*iter)->repeat_) {
-                        (*iter)->startTime_ = currTime;
-                        (*iter)->timeLeft_ = (*iter)->timeout_;
-                        (*iter)->repeatCount_++;
-                        ++iter;
-                        continue;
-                    } else {
-                        // Erase requires iterator to the element which
-                        // has to be deleted. To get iterator(if not available)
-                        // use std::find, std::find_if or use
-                        // std::remove(remove/erase) idiom.
-                        iter = eventQ_.erase(iter);
+    return tick;
+}
+
+S32
+AsyncTimer::timerLoop() {
+    TRACE();
+    std::vector<std::function<void()>> fired;
+
+    std::unique_lock<std::mutex> lock(eventQMutex_);
+    while (!stopThread_) {
+        expire(nowTick(), fired);
+
+        if (!fired.empty()) {
+            lock.unlock();
+            // Handlers expired together go to pool in batches
+            // instead of one task each
+            for (std::size_t idx = 0; idx < fired.size(); idx += TIMER_BATCH_SIZE) {
+                auto first = fired.begin() + idx;
+                auto last = fired.begin() + std::min(fired.size(), idx + TIMER_BATCH_SIZE);
+                std::vector<std::function<void()>> batch(std::make_move_iterator(first),
+                                                         std::make_move_iterator(last));
+                POST_TASK([batch = std::move(batch)]() mutable {
+                    for (auto & handler : batch) {
+                        handler();
                     }
-                } else {
-                    (*iter)->startTime_ = currTime;
-                    ++iter;
-                }
+                });
             }
+            // Bound args(sessions etc) are released outside lock
+            fired.clear();
+            lock.lock();
+            continue;
+        }
 
-            // Sort once again to ensure event with shortest
-            // timeLeft_ is always at back of the queue
-            std::sort(eventQ_.begin(),
-                      eventQ_.end(),
-                      [](EventPtr(e1), EventPtr(e2)) {
-                         return e1->timeLeft_ > e2->timeLeft_; });
+        // Block till next busy tick, or new event gets added
+        // which expires earlier than that
+        fallThrough_ = false;
+        auto wakeUp = [this] { return this->stopThread_ || this->fallThrough_; };
+        if (armed_ == 0) {
+            wakeTick_ = UINT64_MAX;
+            eventQCond_.wait(lock, wakeUp);
+        } else {
+            wakeTick_ = nextWakeTick();
+            eventQCond_.wait_until(lock, epoch_ + std::chrono::milliseconds(wakeTick_),
+                                   wakeUp);
         }
     }
+
+    LOG(INFO, "Timer loop has been stopped");
+    return 0;
+}
+
+// Sleeper is either timerLoop() waiting on condition variable
+// or poller waiting on timerfd
+void
+AsyncTimer::wakeBy(U64 tick) {
+    if (tick >= wakeTick_) {
+        return;
+    }
+
+    if (timerFd_ != -1) {
+        wakeTick_ = tick;
+        armTimerFd(tick);
+        return;
+    }
+
+    // The timer loop may already be waiting for later tick.
+    // It's necessary to notify the conditional variable and
+    // fall through
+    fallThrough_ = true;
+    eventQCond_.notify_one();
+}
+
+// Set timerfd to expire at tick, disarm it for UINT64_MAX.
+// steady_clock is CLOCK_MONOTONIC so epoch_ converts directly
+void
+AsyncTimer::armTimerFd(U64 tick) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+
+    if (tick != UINT64_MAX) {
+        auto at = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            epoch_.time_since_epoch() + std::chrono::milliseconds(tick)).count();
+        spec.it_value.tv_sec = at / 1000000000;
+        spec.it_value.tv_nsec = at % 1000000000;
+    }
+
+    if (timerfd_settime(timerFd_, TFD_TIMER_ABSTIME, &spec, nullptr) == -1) {
+        LOG(ERROR, "Failed to arm timerfd");
+        perror("timerfd_settime");
+    }
+}
+
+S32
+AsyncTimer::createTimerFd() {
+    TRACE();
+    std::unique_lock<std::mutex> lock(eventQMutex_);
+
+    timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd_ == -1) {
+        LOG(ERROR, "Failed to create timerfd");
+        perror("timerfd_create");
+        return -1;
+    }
+
+    // Pick up events armed before timerfd existed
+    wakeTick_ = armed_ == 0 ? UINT64_MAX : nextWakeTick();
+    armTimerFd(wakeTick_);
+
+    return timerFd_;
+}
+
+void
+AsyncTimer::handleTimerFd() {
+    TRACE();
+    std::vector<std::function<void()>> fired;
+
+    {
+        U64 expirations;
+        if (read(timerFd_, &expirations, sizeof(expirations)) == -1 &&
+            errno != EAGAIN) {
+            perror("read timerfd");
+        }
+
+        std::unique_lock<std::mutex> lock(eventQMutex_);
+        expire(nowTick(), fired);
+        wakeTick_ = armed_ == 0 ? UINT64_MAX : nextWakeTick();
+        armTimerFd(wakeTick_);
+    }
+
+    // Run on poller thread, handlers may arm timers again
+    for (auto & handler : fired) {
+        handler();
+    }
+}
+
+void
+AsyncTimer::clockIs(std::function<U64()> clock) {
+    TRACE();
+    std::unique_lock<std::mutex> lock(eventQMutex_);
+    clock_ = std::move(clock);
+}
+
+S32
+AsyncTimer::addEvent(S32 timeout, bool repeat, std::function<void()> task) {
+    TRACE();
+
+    std::unique_lock<std::mutex> lock(eventQMutex_);
+
+    // Wheel is empty, nothing to catch up with
+    U64 now = nowTick();
+    if (armed_ == 0) {
+        currentTick_ = std::max(currentTick_, now);
+    }
+
+    // Ids stay positive, -1 is returned on failure
+    S32 id;
+    do {
+        id = nextId_;
+        nextId_ = (nextId_ + 1) & 0x7fffffff;
+    } while (events_.count(id) != 0);
+
+    // Current tick is partly over, round up so event never fires early
+    Event * event = new Event(id, timeout, repeat, 0,
+                              now + std::max(timeout, 0) + 1, std::move(task));
+    events_.emplace(id, EventPtr(event));
+    place(event);
+    armed_++;
+    wakeBy(event->expiry_);
+
+    return id;
 }
 
 S32
 AsyncTimer::cancelTimerEvent(S32 id) {
     TRACE();
+    std::function<void()> handler;
 
+    {
+        std::unique_lock<std::mutex> lock(eventQMutex_);
+        auto event = events_.find(id);
+        if (event == events_.end()) {
+            return -1;
+        }
+
+        unlink(event->second.get());
+        handler = std::move(event->second->eventHandler_);
+        events_.erase(event);
+        armed_--;
+    }
+
+    return 0;
+}
+
+void
+AsyncTimer::arm(TimerHandle * handle, U64 deadline) {
+    TRACE();
     std::unique_lock<std::mutex> lock(eventQMutex_);
-    auto event = std::find_if(eventQ_.begin(),
-                              eventQ_.end(),
-                              [&](EventPtr(e1)) { return e1->id_ == id; });
 
-    if (event != eventQ_.end()) {
-        eventQ_.erase(event);
-        return 0;
+    if (armed_ == 0) {
+        currentTick_ = std::max(currentTick_, nowTick());
+    }
+
+    if (handle->linked()) {
+        unlink(handle);
+    } else {
+        armed_++;
     }
 
-    return -1;
+    handle->deadline_.store(deadline);
+    handle->expiry_ = deadline;
+    place(handle);
+    wakeBy(deadline);
+}
+
+void
+AsyncTimer::disarm(TimerHandle * handle) {
+    TRACE();
+    std::unique_lock<std::mutex> lock(eventQMutex_);
+
+    handle->deadline_.store(0);
+    if (handle->linked()) {
+        unlink(handle);
+        armed_--;
+    }
 }
 
+// Never destroyed: sessions in global maps own handles on it
+// and may be torn down later during static destruction
 AsyncTimer &
 AsyncTimer::getAsyncTimer() {
     TRACE();
-    static AsyncTimer asyncTimer;
-    return asyncTimer;
+    static AsyncTimer * asyncTimer = new AsyncTimer;
+    return *asyncTimer;
 }
 
 void AsyncTimer::shutdownHandler() {
     TRACE();
+    std::unique_lock<std::mutex> lock(eventQMutex_);
     stopThread_ = true;
     eventQCond_.notify_all();
-    emptyQCond_.notify_all();
-
 }
 
 AsyncTimer::~AsyncTimer() {
@@ -143,6 +544,10 @@ AsyncTimer::~AsyncTimer() {
         shutdownHandler();
 
     }
+
+    if (timerFd_ != -1) {
+        close(timerFd_);
+    }
 }
 
 }
@@ -17,19 +17,25 @@
 
 #pragma once
 
+#include <string.h>  // memset
+#include <unistd.h>  // close()
+#include <sys/timerfd.h>
+
 #include <iostream>
 #include <ctime>
 #include <cstdlib>
-#include <algorithm>  // std::sort
+#include <cstdint>  // UINT64_MAX
+#include <algorithm>  // std::max
 #include <thread>
 #include <mutex>
 #include <chrono>
 #include <future>
-#include <deque>
 #include <vector>
 #include <functional>
 #include <condition_variable>
+#include <unordered_map>
 #include <memory>
+#include <atomic>
 
 #include "logging.hh"
 #include "threadpool.hh"
@@ -40,29 +46,84 @@
 
 namespace Timer {
 
-class Event {
+// Timing wheel geometry. Level n has WHEEL_SLOTS slots each spanning
+// WHEEL_SLOTS^n ticks of 1 msec, 4 levels cover ~49 days. Timers
+// further out are parked in last level and cascade down again
+const U32 WHEEL_BITS = 8;
+const U32 WHEEL_SLOTS = 1U << WHEEL_BITS;
+const U32 WHEEL_MASK = WHEEL_SLOTS - 1;
+const U32 WHEEL_LEVELS = 4;
+
+// Max no. of expired handlers timerLoop() runs in one thread pool task
+const U32 TIMER_BATCH_SIZE = 256;
+
+// Link of intrusive circular list, wheel slots are sentinels
+struct TimerNode {
+    TimerNode() : prev_(this), next_(this), expiry_(0), level_(0), handle_(false) {}
+    void unlink();
+    void linkBefore(TimerNode * node);
+    bool empty() const { return next_ == this; }
+    bool linked() const { return next_ != this; }
+
+    TimerNode * prev_;
+    TimerNode * next_;
+    U64 expiry_;   // wheel tick of slot node is linked in
+    U32 level_;    // wheel level node is linked in
+    bool handle_;  // node is TimerHandle, else Event
+};
+
+class Event : public TimerNode {
  public:
-    Event(S32 id, S32 timeLeft,
-          S32 timeout, bool repeat,
-          S32 repeatCount,
-          std::chrono::time_point<std::chrono::system_clock> startTime,
+    Event(S32 id, S32 timeout, bool repeat,
+          S32 repeatCount, U64 expiry,
           std::function<void()> eventHandler);
     S32 id_;       // unique id for each event object
-    S32 timeLeft_;
     S32 timeout_;  // in millisec
     bool repeat_;  // repeat event indefinitely
     S32 repeatCount_;
-    // timestamp of event creation
-    std::chrono::time_point<std::chrono::system_clock> startTime_;
     std::function<void()> eventHandler_;
 };
 
-// Make shared pointer for container objects
-// When container is deleted all references
-// to shared objects will be deleted and hence
-// objects in container will also be deleted
-using EventPtr = std::shared_ptr<Event>;
+// Events are owned by id index, wheel slots only link them
+using EventPtr = std::unique_ptr<Event>;
 
+class AsyncTimer;
+
+// Timer embedded in its owner, e.g. session idle timer. Nothing is
+// allocated to arm it, and pushing armed deadline further out is
+// single CAS: node stays in its slot and is moved when slot comes
+// due. Timer must outlive handle
+class TimerHandle : public TimerNode {
+ public:
+    explicit TimerHandle(AsyncTimer & timer);
+    ~TimerHandle();
+
+    // Set before handle is armed first time
+    void handlerIs(std::function<void()> handler);
+    // Arm handle to fire timeout msec from now or move armed deadline
+    void reset(S32 timeout);
+    void cancel();
+    bool armed() const;
+    // Let handle fire up to slack msec late. Deadlines are rounded up
+    // to slack window so timers due close together expire in one tick
+    void slackIs(S32 slack);
+    // Delay every deadline by fixed offset in [0, window) derived from
+    // seed, so that timers armed at once spread over window
+    void spreadIs(S32 window, U64 seed);
+ private:
+    friend class AsyncTimer;
+
+    AsyncTimer & timer_;
+    std::function<void()> handler_;
+    U64 slackMask_;
+    U64 spread_;
+    // Tick handler is due, 0 while disarmed. Never before expiry_
+    std::atomic<U64> deadline_;
+};
+
+// Hierarchical timing wheel with msec resolution. Insert and
+// cancel are O(1), expiry is amortised O(1) per event: each event
+// cascades at most once per level on its way to level 0
 class AsyncTimer {
  public:
     AsyncTimer();
@@ -76,18 +137,55 @@ class AsyncTimer {
     S32 timerLoop();
     void shutdownHandler();
 
+    // Drive timer from caller's poller instead of timerLoop() thread.
+    // Returns CLOCK_MONOTONIC timerfd to watch for input, poller
+    // thread then calls handleTimerFd() which runs expired
+    // handlers inline
+    S32 createTimerFd();
+    void handleTimerFd();
+
+    // Replace msec clock, e.g. tests stepping time by hand. Must be
+    // set before anything is armed
+    void clockIs(std::function<U64()> clock);
+
     AsyncTimer(const AsyncTimer &);
     AsyncTimer(AsyncTimer &&);
     AsyncTimer & operator=(const AsyncTimer &);
     AsyncTimer & operator=(AsyncTimer &&);
  private:
-    std::deque<EventPtr> eventQ_;
+    friend class TimerHandle;
+
+    S32 addEvent(S32 timeout, bool repeat, std::function<void()> task);
+    void arm(TimerHandle * handle, U64 deadline);
+    void disarm(TimerHandle * handle);
+    U64 nowTick() const;
+    void place(TimerNode * node);
+    void unlink(TimerNode * node);
+    void cascade(U32 level);
+    void expire(U64 tick, std::vector<std::function<void()>> & fired);
+    void expireHandle(TimerHandle * handle, std::vector<std::function<void()>> & fired);
+    U64 nextWakeTick() const;
+    // Make sure sleeper wakes up by tick
+    void wakeBy(U64 tick);
+    void armTimerFd(U64 tick);
+
+    const std::chrono::steady_clock::time_point epoch_;
+    std::function<U64()> clock_;
+    TimerNode wheel_[WHEEL_LEVELS][WHEEL_SLOTS];
+    std::unordered_map<S32, EventPtr> events_;
+    // No. of events and handles linked in wheel, in total and
+    // per level
+    U64 armed_;
+    U64 levelCount_[WHEEL_LEVELS];
+    // Next tick to be processed, all earlier slots are empty
+    U64 currentTick_;
+    // Tick timer loop(or timerfd) sleeps till
+    U64 wakeTick_;
+    S32 nextId_;
+    S32 timerFd_;
 
     std::mutex eventQMutex_;
     std::condition_variable eventQCond_;
-
-    std::mutex emptyQMutex_;
-    std::condition_variable emptyQCond_;
     bool stopThread_;
     bool fallThrough_;
 };
@@ -100,28 +198,7 @@ S32 AsyncTimer::createTimerEvent(S32 timeout, bool repeat, F&& f, Args&&... args
     // and return type, make it callable without args(func())
     // using std::bind
     auto func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-    std::function<void()> task = func;
-
-    // Create new event object
-    S32 id = std::rand();
-    {
-        std::unique_lock<std::mutex> lock(eventQMutex_);
-        eventQ_.push_back(EventPtr(new Event(id, timeout, timeout, repeat, 0,
-                                             std::chrono::system_clock::now(),
-                                             task)));
-
-        // The timer loop may already be waiting for longer
-        // timeout value. If new event with lesser timeout
-        // gets added to eventQ_ its necessary to notify
-        // the conditional variable and fall through
-        if (timeout < eventQ_.back()->timeLeft_) {
-            fallThrough_ = true;
-        }
-
-        emptyQCond_.notify_one();
-
-        return id;
-    }
+    return addEvent(timeout, repeat, std::function<void()>(func));
 }
 
 }
@@ -15,6 +15,9 @@
  * with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <dirent.h>   // opendir
+#include <stdlib.h>   // strtol
+
 #include "utils.hh"
 
 namespace Utils {
@@ -58,4 +61,132 @@ setFdNonBlocking(S32 fd) {
     return 0;
 }
 
+// Bind calling thread to single cpu
+S32
+pinThreadToCpu(S32 cpu) {
+    TRACE();
+    cpu_set_t cpuSet;
+
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+
+    if (setThreadAffinity(cpuSet) == -1) {
+        return -1;
+    }
+
+    LOG(INFO, "Thread pinned to cpu %d", cpu);
+    return 0;
+}
+
+// Bind calling thread to set of cpus
+S32
+setThreadAffinity(const cpu_set_t & cpuSet) {
+    TRACE();
+    S32 ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+    if (ret != 0) {
+        LOG(ERROR, "pthread_setaffinity_np: %s", strerror(ret));
+        return -1;
+    }
+
+    return 0;
+}
+
+S32
+parseCpuList(const std::string & cpuList, cpu_set_t & cpuSet) {
+    TRACE();
+    const char * pos = cpuList.c_str();
+
+    CPU_ZERO(&cpuSet);
+    while (*pos != '\0') {
+        char * end;
+        S32 first = strtol(pos, &end, 10);
+        if (end == pos || first < 0) {
+            return -1;
+        }
+
+        S32 last = first;
+        pos = end;
+        if (*pos == '-') {
+            pos++;
+            last = strtol(pos, &end, 10);
+            if (end == pos || last < first) {
+                return -1;
+            }
+            pos = end;
+        }
+
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+
+        for (S32 cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, &cpuSet);
+        }
+
+        if (*pos == ',') {
+            pos++;
+        } else if (*pos != '\0') {
+            return -1;
+        }
+    }
+
+    return CPU_COUNT(&cpuSet) == 0 ? -1 : 0;
+}
+
+std::string
+cpuListString(const cpu_set_t & cpuSet) {
+    std::string cpuList;
+    S32 cpu = 0;
+
+    while (cpu < CPU_SETSIZE) {
+        if (!CPU_ISSET(cpu, &cpuSet)) {
+            cpu++;
+            continue;
+        }
+
+        S32 last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &cpuSet)) {
+            last++;
+        }
+
+        if (!cpuList.empty()) {
+            cpuList += ",";
+        }
+        cpuList += std::to_string(cpu);
+        if (last != cpu) {
+            cpuList += "-" + std::to_string(last);
+        }
+        cpu = last + 1;
+    }
+
+    return cpuList;
+}
+
+// sysfs lists node the cpu belongs to as nodeN entry
+S32
+numaNodeOfCpu(S32 cpu) {
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR * dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        return -1;
+    }
+
+    S32 node = -1;
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        char * end;
+        if (strncmp(entry->d_name, "node", 4) != 0) {
+            continue;
+        }
+        S32 id = strtol(entry->d_name + 4, &end, 10);
+        if (end != entry->d_name + 4 && *end == '\0') {
+            node = id;
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+
 }
@@ -19,6 +19,11 @@
 
 #include <sys/resource.h>  // strlimit
 #include <string.h>  // strerror
+#include <fcntl.h>   // fcntl
+#include <sched.h>   // cpu_set_t
+#include <pthread.h> // pthread_setaffinity_np
+
+#include <string>
 
 #include "basictypes.hh"
 #include "logging.hh"
@@ -31,5 +36,12 @@ extern "C" void __gcov_flush();
 
 S32 setResourceLimit();
 S32 setFdNonBlocking(S32);
+S32 pinThreadToCpu(S32 cpu);
+S32 setThreadAffinity(const cpu_set_t & cpuSet);
+// Parse cpu list in kernel format, e.g. "0-3,8,10-11"
+S32 parseCpuList(const std::string & cpuList, cpu_set_t & cpuSet);
+std::string cpuListString(const cpu_set_t & cpuSet);
+// NUMA node owning cpu, -1 if kernel does not tell
+S32 numaNodeOfCpu(S32 cpu);
 
 }
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <new>
+#include <atomic>
+#include <cstdlib>
+
+#include "alloccount.hh"
+
+namespace {
+
+std::atomic<U64> allocCount(0);
+
+}  // namespace
+
+namespace AllocCount {
+
+U64
+allocations() {
+    return allocCount.load(std::memory_order_relaxed);
+}
+
+}  // namespace AllocCount
+
+// Replaces global operator new for whole test binary. Array and
+// nothrow forms of libstdc++ end up here as well
+void *
+operator new(std::size_t size) {
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    void * ptr = malloc(size ? size : 1);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void
+operator delete(void * ptr) noexcept {
+    free(ptr);
+}
+
+void
+operator delete(void * ptr, std::size_t) noexcept {
+    free(ptr);
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// SK payload cipher throughput per transform and packet size, and
+// cost of switching keys: jobs of several SAs interleaved one by one
+// against same jobs through OpensslPlugin::encryptBatch()
+#include <chrono>
+#include <vector>
+#include <cstdio>
+
+#include "crypto.hh"
+
+using Crypto::Cipher;
+
+namespace {
+
+const U64 BYTES_PER_RUN = 16 << 20;
+const U32 SA_COUNT = 8;
+const U32 BATCH_SIZE = 32;
+const U32 AAD_LEN = 28;
+
+struct Transform {
+    const char * name;
+    Cipher::CipherType type;
+    U32 keyLen;
+};
+
+const Transform transforms[] = {
+    {"3DES-CBC", Cipher::CipherType::DES3, 24},
+    {"AES-128-CBC", Cipher::CipherType::AES_CBC, 16},
+    {"AES-256-CBC", Cipher::CipherType::AES_CBC, 32},
+    {"AES-128-CTR", Cipher::CipherType::AES_CTR, 16},
+    {"AES-128-GCM", Cipher::CipherType::AES_GCM_16, 16},
+    {"AES-256-GCM", Cipher::CipherType::AES_GCM_16, 32},
+};
+
+const U32 sizes[] = {64, 512, 1408};
+
+double
+mbPerSec(std::chrono::steady_clock::time_point start, U64 bytes) {
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return bytes / secs / (1 << 20);
+}
+
+// Single SA, every message hits thread's cached key schedule
+double
+runSingle(const Transform & transform, U32 size) {
+    Cipher cipher(transform.type, transform.keyLen);
+    std::vector<UCHAR> key(cipher.keyMaterialLen(), 0x11);
+    cipher.keyIs(key.data(), key.size());
+
+    std::vector<UCHAR> iv(cipher.ivLen(), 0x22);
+    std::vector<UCHAR> aad(AAD_LEN, 0x33);
+    std::vector<UCHAR> icv(16);
+    std::vector<UCHAR> data(size, 0x44);
+
+    U64 count = BYTES_PER_RUN / size;
+    auto start = std::chrono::steady_clock::now();
+    for (U64 idx = 0; idx < count; ++idx) {
+        cipher.encrypt(iv.data(), data.data(), size, aad.data(), aad.size(), icv.data());
+    }
+    return mbPerSec(start, count * size);
+}
+
+// SA_COUNT SAs, batch holds their messages round robin
+void
+runInterleaved(const Transform & transform, U32 size, double & oneByOne, double & batched) {
+    std::vector<Cipher> ciphers;
+    for (U32 sa = 0; sa < SA_COUNT; ++sa) {
+        ciphers.emplace_back(transform.type, transform.keyLen);
+        std::vector<UCHAR> key(ciphers.back().keyMaterialLen(), 0x11 + sa);
+        ciphers.back().keyIs(key.data(), key.size());
+    }
+
+    std::vector<UCHAR> iv(ciphers[0].ivLen(), 0x22);
+    std::vector<UCHAR> aad(AAD_LEN, 0x33);
+    std::vector<std::vector<UCHAR>> buffers(BATCH_SIZE, std::vector<UCHAR>(size, 0x44));
+    std::vector<std::vector<UCHAR>> icvs(BATCH_SIZE, std::vector<UCHAR>(16));
+
+    std::vector<Crypto::AeadJob> jobs(BATCH_SIZE);
+    for (U32 idx = 0; idx < BATCH_SIZE; ++idx) {
+        jobs[idx] = {&ciphers[idx % SA_COUNT], iv.data(), aad.data(), AAD_LEN,
+                     buffers[idx].data(), size, icvs[idx].data(), 0};
+    }
+
+    U64 batches = BYTES_PER_RUN / (static_cast<U64>(size) * BATCH_SIZE);
+    auto start = std::chrono::steady_clock::now();
+    for (U64 round = 0; round < batches; ++round) {
+        for (auto & job : jobs) {
+            job.cipher->encrypt(job.iv, job.data, job.len, job.aad, job.aadLen, job.icv);
+        }
+    }
+    oneByOne = mbPerSec(start, batches * size * BATCH_SIZE);
+
+    Crypto::OpensslPlugin plugin;
+    start = std::chrono::steady_clock::now();
+    for (U64 round = 0; round < batches; ++round) {
+        plugin.encryptBatch(jobs);
+    }
+    batched = mbPerSec(start, batches * size * BATCH_SIZE);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    printf("%-12s %5s %12s %16s %16s\n", "transform", "bytes", "single SA",
+           "8 SAs one by one", "8 SAs batched");
+    for (auto & transform : transforms) {
+        for (auto size : sizes) {
+            double single = runSingle(transform, size);
+            double oneByOne = 0;
+            double batched = 0;
+            runInterleaved(transform, size, oneByOne, batched);
+            printf("%-12s %5u %7.0f MB/s %11.0f MB/s %11.0f MB/s\n",
+                   transform.name, size, single, oneByOne, batched);
+        }
+    }
+    return 0;
+}
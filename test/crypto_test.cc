@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "catch.hpp"
+#include "crypto.hh"
+
+using Crypto::Cipher;
+
+namespace {
+
+std::vector<UCHAR>
+hex(const std::string & str) {
+    std::vector<UCHAR> bytes;
+    for (std::size_t idx = 0; idx + 1 < str.size(); idx += 2) {
+        bytes.push_back(std::stoul(str.substr(idx, 2), nullptr, 16));
+    }
+    return bytes;
+}
+
+std::vector<UCHAR>
+concat(std::vector<UCHAR> first, const std::vector<UCHAR> & second) {
+    first.insert(first.end(), second.begin(), second.end());
+    return first;
+}
+
+struct KnownAnswer {
+    Cipher::CipherType type;
+    U32 keyLen;
+    // Key followed by salt for CTR / GCM
+    std::vector<UCHAR> keyMaterial;
+    std::vector<UCHAR> iv;
+    std::vector<UCHAR> plain;
+    std::vector<UCHAR> cipher;
+};
+
+// Encrypt and decrypt in place and compare with known answer
+void
+check(Cipher & cipher, const KnownAnswer & kat) {
+    std::vector<UCHAR> data = kat.plain;
+    REQUIRE( cipher.encrypt(kat.iv.data(), data.data(), data.size()) == 0 );
+    REQUIRE( data == kat.cipher );
+    REQUIRE( cipher.decrypt(kat.iv.data(), data.data(), data.size()) == 0 );
+    REQUIRE( data == kat.plain );
+}
+
+// RFC 3602 section 4, cases 1 and 2
+const KnownAnswer cbc1 = {
+    Cipher::CipherType::AES_CBC, 16,
+    hex("06a9214036b8a15b512e03d534120006"),
+    hex("3dafba429d9eb430b422da802c9fac41"),
+    std::vector<UCHAR>({'S', 'i', 'n', 'g', 'l', 'e', ' ', 'b',
+                        'l', 'o', 'c', 'k', ' ', 'm', 's', 'g'}),
+    hex("e353779c1079aeb82708942dbe77181a"),
+};
+
+const KnownAnswer cbc2 = {
+    Cipher::CipherType::AES_CBC, 16,
+    hex("c286696d887c9aa0611bbb3e2025a45a"),
+    hex("562e17996d093d28ddb3ba695a2e6f58"),
+    hex("000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"),
+    hex("d296cd94c2cccf8a3a863028b5e1dc0a7586602d253cfff91b8266bea6d61ab1"),
+};
+
+// RFC 3686 section 6, test vectors 1 and 2. Nonce is salt
+const KnownAnswer ctr1 = {
+    Cipher::CipherType::AES_CTR, 16,
+    hex("ae6852f8121067cc4bf7a5765577f39e" "00000030"),
+    hex("0000000000000000"),
+    std::vector<UCHAR>({'S', 'i', 'n', 'g', 'l', 'e', ' ', 'b',
+                        'l', 'o', 'c', 'k', ' ', 'm', 's', 'g'}),
+    hex("e4095d4fb7a7b3792d6175a3261311b8"),
+};
+
+const KnownAnswer ctr2 = {
+    Cipher::CipherType::AES_CTR, 16,
+    hex("7e24067817fae0d743d6ce1f32539163" "006cb6db"),
+    hex("c0543b59da48d90b"),
+    hex("000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"),
+    hex("5104a106168a72d9790d41ee8edad388eb2e1efc46da57c8fce630df9141be28"),
+};
+
+// GCM spec(McGrew / Viega) test case 4. 12 byte IV splits in
+// RFC 5282 salt | explicit IV
+const std::vector<UCHAR> gcmKey = hex("feffe9928665731c6d6a8f9467308308");
+const std::vector<UCHAR> gcmSalt = hex("cafebabe");
+const std::vector<UCHAR> gcmIv = hex("facedbaddecaf888");
+const std::vector<UCHAR> gcmAad = hex("feedfacedeadbeeffeedfacedeadbeefabaddad2");
+const std::vector<UCHAR> gcmPlain = hex(
+    "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+    "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39");
+const std::vector<UCHAR> gcmCipher = hex(
+    "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+    "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091");
+const std::vector<UCHAR> gcmTag = hex("5bc94fbc3221a5db94fae95ae7121a47");
+
+Cipher
+keyed(const KnownAnswer & kat) {
+    Cipher cipher(kat.type, kat.keyLen);
+    REQUIRE( cipher.keyIs(kat.keyMaterial.data(), kat.keyMaterial.size()) == 0 );
+    return cipher;
+}
+
+}  // namespace
+
+TEST_CASE( "AES-CBC matches RFC 3602", "[crypto]" ) {
+    Cipher first = keyed(cbc1);
+    check(first, cbc1);
+    Cipher second = keyed(cbc2);
+    check(second, cbc2);
+
+    // Unpadded input is refused
+    std::vector<UCHAR> data(15);
+    REQUIRE( first.encrypt(cbc1.iv.data(), data.data(), data.size()) == -1 );
+}
+
+TEST_CASE( "AES-CTR matches RFC 3686", "[crypto]" ) {
+    Cipher first = keyed(ctr1);
+    REQUIRE( first.keyMaterialLen() == 20 );
+    check(first, ctr1);
+    Cipher second = keyed(ctr2);
+    check(second, ctr2);
+}
+
+TEST_CASE( "AES-GCM matches test case 4 and rejects tampering", "[crypto]" ) {
+    Cipher cipher(Cipher::CipherType::AES_GCM_16, 16);
+    auto keyMaterial = concat(gcmKey, gcmSalt);
+    REQUIRE( cipher.keyIs(keyMaterial.data(), keyMaterial.size()) == 0 );
+    REQUIRE( cipher.icvLen() == gcmTag.size() );
+
+    std::vector<UCHAR> data = gcmPlain;
+    std::vector<UCHAR> icv(cipher.icvLen());
+    REQUIRE( cipher.encrypt(gcmIv.data(), data.data(), data.size(),
+                            gcmAad.data(), gcmAad.size(), icv.data()) == 0 );
+    REQUIRE( data == gcmCipher );
+    REQUIRE( icv == gcmTag );
+
+    data = gcmCipher;
+    REQUIRE( cipher.decrypt(gcmIv.data(), data.data(), data.size(),
+                            gcmAad.data(), gcmAad.size(), gcmTag.data()) == 0 );
+    REQUIRE( data == gcmPlain );
+
+    SECTION( "flipped ciphertext bit" ) {
+        data = gcmCipher;
+        data[10] ^= 0x01;
+        REQUIRE( cipher.decrypt(gcmIv.data(), data.data(), data.size(),
+                                gcmAad.data(), gcmAad.size(), gcmTag.data()) == -1 );
+    }
+
+    SECTION( "flipped ICV bit" ) {
+        auto tag = gcmTag;
+        tag[0] ^= 0x80;
+        data = gcmCipher;
+        REQUIRE( cipher.decrypt(gcmIv.data(), data.data(), data.size(),
+                                gcmAad.data(), gcmAad.size(), tag.data()) == -1 );
+    }
+
+    SECTION( "modified AAD" ) {
+        auto aad = gcmAad;
+        aad.back() ^= 0x01;
+        data = gcmCipher;
+        REQUIRE( cipher.decrypt(gcmIv.data(), data.data(), data.size(),
+                                aad.data(), aad.size(), gcmTag.data()) == -1 );
+    }
+
+    // Failed decrypt leaves context usable for next message
+    data = gcmCipher;
+    REQUIRE( cipher.decrypt(gcmIv.data(), data.data(), data.size(),
+                            gcmAad.data(), gcmAad.size(), gcmTag.data()) == 0 );
+    REQUIRE( data == gcmPlain );
+}
+
+TEST_CASE( "Interleaved keys share per thread context", "[crypto]" ) {
+    // Same transform, so both ciphers use one context per thread and
+    // every switch has to re-key it
+    Cipher first = keyed(cbc1);
+    Cipher second = keyed(cbc2);
+    REQUIRE( first.keyId() != second.keyId() );
+
+    for (U32 round = 0; round < 8; ++round) {
+        check(first, cbc1);
+        check(second, cbc2);
+        check(second, cbc2);
+    }
+
+    // Re-keyed cipher gets new id, context keyed with old key must
+    // not be reused
+    U64 oldId = first.keyId();
+    REQUIRE( first.keyIs(cbc2.keyMaterial.data(), cbc2.keyMaterial.size()) == 0 );
+    REQUIRE( first.keyId() != oldId );
+    check(first, cbc2);
+    REQUIRE( first.keyIs(cbc1.keyMaterial.data(), cbc1.keyMaterial.size()) == 0 );
+    check(first, cbc1);
+
+    // Other threads have contexts of their own
+    bool ok[2] = {true, true};
+    std::thread other([&]() {
+        for (U32 round = 0; round < 1000; ++round) {
+            std::vector<UCHAR> data = cbc2.plain;
+            second.encrypt(cbc2.iv.data(), data.data(), data.size());
+            ok[1] = ok[1] && data == cbc2.cipher;
+        }
+    });
+    for (U32 round = 0; round < 1000; ++round) {
+        std::vector<UCHAR> data = cbc1.plain;
+        first.encrypt(cbc1.iv.data(), data.data(), data.size());
+        ok[0] = ok[0] && data == cbc1.cipher;
+    }
+    other.join();
+    REQUIRE( ok[0] );
+    REQUIRE( ok[1] );
+}
+
+namespace {
+
+// One SK payload with buffers for batch and single call runs
+struct Message {
+    Cipher * cipher;
+    std::vector<UCHAR> iv;
+    std::vector<UCHAR> aad;
+    std::vector<UCHAR> data;
+    std::vector<UCHAR> icv;
+};
+
+Crypto::AeadJob
+jobOf(Message & msg) {
+    bool aead = msg.cipher && msg.cipher->type() == Cipher::CipherType::AES_GCM_16;
+    return Crypto::AeadJob{msg.cipher, msg.iv.data(),
+                           aead ? msg.aad.data() : nullptr,
+                           aead ? static_cast<U32>(msg.aad.size()) : 0U,
+                           msg.data.data(), static_cast<U32>(msg.data.size()),
+                           aead ? msg.icv.data() : nullptr, 1};
+}
+
+// Same message run through single call encrypt / decrypt
+Message
+single(Message msg, bool enc) {
+    Crypto::AeadJob job = jobOf(msg);
+    if (enc) {
+        job.result = msg.cipher->encrypt(job.iv, job.data, job.len,
+                                         job.aad, job.aadLen, job.icv);
+    } else {
+        job.result = msg.cipher->decrypt(job.iv, job.data, job.len,
+                                         job.aad, job.aadLen, job.icv);
+    }
+    REQUIRE( job.result == 0 );
+    return msg;
+}
+
+}  // namespace
+
+TEST_CASE( "Batched jobs match single calls whatever their order", "[crypto]" ) {
+    Cipher gcm128(Cipher::CipherType::AES_GCM_16, 16);
+    auto keyMaterial = concat(gcmKey, gcmSalt);
+    REQUIRE( gcm128.keyIs(keyMaterial.data(), keyMaterial.size()) == 0 );
+    Cipher gcm256(Cipher::CipherType::AES_GCM_16, 32);
+    keyMaterial = concat(concat(gcmKey, gcmKey), gcmSalt);
+    REQUIRE( gcm256.keyIs(keyMaterial.data(), keyMaterial.size()) == 0 );
+    Cipher cbc = keyed(cbc2);
+    Cipher ctr = keyed(ctr2);
+    Cipher * ciphers[] = {&gcm128, &cbc, &gcm256, &ctr};
+
+    // Ciphers interleaved job by job, so batch has to regroup them.
+    // Every job gets own IV and length
+    std::vector<Message> plain;
+    for (U32 idx = 0; idx < 24; ++idx) {
+        Message msg;
+        msg.cipher = ciphers[idx % 4];
+        msg.iv.assign(msg.cipher->ivLen(), static_cast<UCHAR>(idx));
+        msg.aad.assign(28, static_cast<UCHAR>(0xa0 + idx));
+        msg.data.resize(16 * (1 + idx % 5));
+        for (U32 pos = 0; pos < msg.data.size(); ++pos) {
+            msg.data[pos] = static_cast<UCHAR>(idx * 7 + pos);
+        }
+        msg.icv.assign(16, 0);
+        plain.push_back(msg);
+    }
+    // Job without cipher(SA gone) fails alone
+    Message orphan = plain[5];
+    orphan.cipher = nullptr;
+    plain.insert(plain.begin() + 7, orphan);
+
+    Crypto::OpensslPlugin plugin;
+
+    std::vector<Message> sealed = plain;
+    std::vector<Crypto::AeadJob> jobs;
+    for (auto & msg : sealed) {
+        jobs.push_back(jobOf(msg));
+    }
+    REQUIRE( plugin.encryptBatch(jobs) == 1 );
+    for (U32 idx = 0; idx < sealed.size(); ++idx) {
+        if (sealed[idx].cipher == nullptr) {
+            REQUIRE( jobs[idx].result == -1 );
+            continue;
+        }
+        REQUIRE( jobs[idx].result == 0 );
+        Message expected = single(plain[idx], true);
+        REQUIRE( sealed[idx].data == expected.data );
+        REQUIRE( sealed[idx].icv == expected.icv );
+    }
+
+    // Decrypt batch, with ICV of one GCM job tampered
+    const U32 tampered = 2;
+    REQUIRE( sealed[tampered].cipher == &gcm256 );
+    sealed[tampered].icv[3] ^= 0x10;
+    std::vector<Message> opened = sealed;
+    jobs.clear();
+    for (auto & msg : opened) {
+        jobs.push_back(jobOf(msg));
+    }
+    REQUIRE( plugin.decryptBatch(jobs) == 2 );
+    for (U32 idx = 0; idx < opened.size(); ++idx) {
+        if (opened[idx].cipher == nullptr || idx == tampered) {
+            REQUIRE( jobs[idx].result == -1 );
+            continue;
+        }
+        REQUIRE( jobs[idx].result == 0 );
+        REQUIRE( opened[idx].data == single(sealed[idx], false).data );
+        REQUIRE( opened[idx].data == plain[idx].data );
+    }
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Responder side DH cost of IKE_SA_INIT: acquire() our key plus
+// computeKey() with initiator's KE data, per group, with pool kept
+// filled against pool turned off(key generated inline)
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+#include <cstdio>
+
+#include "crypto.hh"
+
+using Group = Crypto::DH::Group;
+
+namespace {
+
+const U32 EXCHANGES = 200;
+const U32 POOL_DEPTH = 4;
+
+struct GroupName {
+    Group group;
+    const char * name;
+};
+
+const GroupName groups[] = {
+    {Group::MODP2048, "MODP-2048"},
+    {Group::MODP3072, "MODP-3072"},
+    {Group::ECP256, "ECP-256"},
+    {Group::ECP384, "ECP-384"},
+    {Group::CURVE25519, "Curve25519"},
+};
+
+// Mean usec per exchange. With pool, refill is given time to top
+// pool up between exchanges and is not counted, as on responder
+// whose crypto cpus are idle between requests
+double
+run(Crypto::DHPool & pool, Group group, const Crypto::DH & peer, bool pooled) {
+    std::vector<UCHAR> secret;
+    double totalUs = 0;
+
+    for (U32 idx = 0; idx < EXCHANGES; ++idx) {
+        while (pooled && pool.ready(group) < POOL_DEPTH) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        auto key = pool.acquire(group);
+        if (key == nullptr ||
+            key->computeKey(peer.publicKey().data(), peer.publicKey().size(), secret) == -1) {
+            printf("exchange failed\n");
+            return 0;
+        }
+        totalUs += std::chrono::duration<double, std::micro>(
+                       std::chrono::steady_clock::now() - start).count();
+    }
+
+    return totalUs / EXCHANGES;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Crypto::DHPool pool;
+    auto refill = std::async(std::launch::async, [&pool]() { return pool.refillLoop(); });
+
+    printf("group          no pool      pool filled\n");
+    for (auto & iter : groups) {
+        Crypto::DH peer(iter.group);
+        if (peer.generateKey() == -1) {
+            printf("%-12s key generation failed\n", iter.name);
+            continue;
+        }
+
+        pool.configure(0, 0, 0);
+        double inlineUs = run(pool, iter.group, peer, false);
+        pool.configure(POOL_DEPTH, 0, 0);
+        double pooledUs = run(pool, iter.group, peer, true);
+        printf("%-12s %8.1f us   %8.1f us\n", iter.name, inlineUs, pooledUs);
+    }
+
+    pool.shutdownHandler();
+    refill.wait();
+    return 0;
+}
@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <openssl/bn.h>
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "catch.hpp"
+#include "crypto.hh"
+
+// OpenSSL declares global DH type, so always qualify ours
+using Group = Crypto::DH::Group;
+
+namespace {
+
+struct GroupInfo {
+    Group group;
+    // KE data and shared secret length
+    U32 keLen;
+    U32 secretLen;
+};
+
+const GroupInfo groups[] = {
+    {Group::MODP2048, 256, 256},
+    {Group::MODP3072, 384, 384},
+    {Group::ECP256, 64, 32},
+    {Group::ECP384, 96, 48},
+    {Group::CURVE25519, 32, 32},
+};
+
+// Generated key of group, checked once here so cases below can
+// assume it
+std::unique_ptr<Crypto::DH>
+keyOf(Group group) {
+    std::unique_ptr<Crypto::DH> dh(new Crypto::DH(group));
+    REQUIRE( dh->generateKey() == 0 );
+    return dh;
+}
+
+// Peer KE data must be refused without leaving secret behind
+void
+rejects(const Crypto::DH & dh, const std::vector<UCHAR> & ke) {
+    std::vector<UCHAR> secret(1, 0xff);
+    REQUIRE( dh.computeKey(ke.data(), ke.size(), secret) == -1 );
+    REQUIRE( secret.empty() );
+}
+
+// MODP public value y as KE data, zero padded to prime length
+std::vector<UCHAR>
+modpValue(const BIGNUM * y, U32 len) {
+    std::vector<UCHAR> ke(len);
+    REQUIRE( BN_bn2binpad(y, ke.data(), len) == static_cast<S32>(len) );
+    return ke;
+}
+
+// Spin till cond holds, false if it did not within 10 sec
+bool
+waitFor(const std::function<bool()> & cond) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!cond()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+// Runs refill loop of pool for lifetime of object
+class Refiller {
+ public:
+    explicit Refiller(Crypto::DHPool & pool) : pool_(pool) {
+        done_ = std::async(std::launch::async, [this]() { return pool_.refillLoop(); });
+    }
+    ~Refiller() {
+        pool_.shutdownHandler();
+        done_.wait();
+    }
+ private:
+    Crypto::DHPool & pool_;
+    std::future<S32> done_;
+};
+
+}  // namespace
+
+TEST_CASE( "Both DH parties derive same secret", "[dh]" ) {
+    for (auto & info : groups) {
+        auto initiator = keyOf(info.group);
+        auto responder = keyOf(info.group);
+        REQUIRE( initiator->publicKey().size() == info.keLen );
+        REQUIRE( initiator->publicKey() != responder->publicKey() );
+
+        std::vector<UCHAR> mine;
+        std::vector<UCHAR> theirs;
+        REQUIRE( initiator->computeKey(responder->publicKey().data(),
+                                       responder->publicKey().size(), mine) == 0 );
+        REQUIRE( responder->computeKey(initiator->publicKey().data(),
+                                       initiator->publicKey().size(), theirs) == 0 );
+        REQUIRE( mine.size() == info.secretLen );
+        REQUIRE( mine == theirs );
+    }
+}
+
+TEST_CASE( "DH rejects KE data of wrong length", "[dh]" ) {
+    for (auto & info : groups) {
+        auto dh = keyOf(info.group);
+        auto peer = keyOf(info.group);
+
+        std::vector<UCHAR> shorter(peer->publicKey().begin(), peer->publicKey().end() - 1);
+        rejects(*dh, shorter);
+        std::vector<UCHAR> longer(peer->publicKey());
+        longer.push_back(0);
+        rejects(*dh, longer);
+        rejects(*dh, std::vector<UCHAR>());
+    }
+}
+
+TEST_CASE( "MODP rejects degenerate public values", "[dh]" ) {
+    struct {
+        Group group;
+        BIGNUM * (*prime)(BIGNUM *);
+        U32 keLen;
+    } modps[] = {
+        {Group::MODP2048, BN_get_rfc3526_prime_2048, 256},
+        {Group::MODP3072, BN_get_rfc3526_prime_3072, 384},
+    };
+
+    for (auto & modp : modps) {
+        auto dh = keyOf(modp.group);
+        BIGNUM * y = modp.prime(nullptr);
+        REQUIRE( y != nullptr );
+
+        // y = p and y = p - 1
+        rejects(*dh, modpValue(y, modp.keLen));
+        REQUIRE( BN_sub_word(y, 1) == 1 );
+        rejects(*dh, modpValue(y, modp.keLen));
+
+        // y = 0 and y = 1
+        BN_zero(y);
+        rejects(*dh, modpValue(y, modp.keLen));
+        REQUIRE( BN_one(y) == 1 );
+        rejects(*dh, modpValue(y, modp.keLen));
+
+        BN_free(y);
+    }
+}
+
+TEST_CASE( "ECP rejects points off curve", "[dh]" ) {
+    for (auto group : {Group::ECP256, Group::ECP384}) {
+        auto dh = keyOf(group);
+        auto peer = keyOf(group);
+        U32 coordLen = peer->publicKey().size() / 2;
+
+        // (1, 1) is on neither curve
+        std::vector<UCHAR> ke(2 * coordLen, 0);
+        ke[coordLen - 1] = 1;
+        ke.back() = 1;
+        rejects(*dh, ke);
+
+        // Valid point with y changed
+        ke = peer->publicKey();
+        ke.back() ^= 0x01;
+        rejects(*dh, ke);
+
+        // All zero is not a point either
+        rejects(*dh, std::vector<UCHAR>(2 * coordLen, 0));
+    }
+}
+
+TEST_CASE( "Curve25519 rejects all zero shared secret", "[dh]" ) {
+    auto dh = keyOf(Group::CURVE25519);
+
+    // u = 0 and point of order 8, both give all zero result
+    rejects(*dh, std::vector<UCHAR>(32, 0));
+    std::vector<UCHAR> lowOrder = {
+        0xe0, 0xeb, 0x7a, 0x7c, 0x3b, 0x41, 0xb8, 0xae, 0x16, 0x56, 0xe3, 0xfa,
+        0xf1, 0x9f, 0xc4, 0x6a, 0xda, 0x09, 0x8d, 0xeb, 0x9c, 0x32, 0xb1, 0xfd,
+        0x86, 0x62, 0x05, 0x16, 0x5f, 0x49, 0xb8, 0x00,
+    };
+    rejects(*dh, lowOrder);
+}
+
+TEST_CASE( "DH pool hands out refilled keys", "[dhpool]" ) {
+    Crypto::DHPool pool;
+    pool.configure(2, 0, 0);
+    Refiller refiller(pool);
+
+    for (auto & info : groups) {
+        REQUIRE( waitFor([&]() { return pool.ready(info.group) == 2; }) );
+    }
+
+    // Each acquire takes different ready key, refill tops pool up again
+    for (auto & info : groups) {
+        auto first = pool.acquire(info.group);
+        auto second = pool.acquire(info.group);
+        REQUIRE( first != nullptr );
+        REQUIRE( second != nullptr );
+        REQUIRE( first != second );
+        REQUIRE( first->group() == info.group );
+        REQUIRE( first->publicKey().size() == info.keLen );
+    }
+    REQUIRE( pool.hits() == 2 * sizeof(groups) / sizeof(groups[0]) );
+    REQUIRE( pool.misses() == 0U );
+
+    REQUIRE( waitFor([&]() { return pool.ready(Group::ECP256) == 2; }) );
+}
+
+TEST_CASE( "Empty DH pool generates key inline", "[dhpool]" ) {
+    // Nothing refills this pool
+    Crypto::DHPool pool;
+    pool.configure(4, 0, 0);
+
+    auto key = pool.acquire(Group::ECP256);
+    REQUIRE( key != nullptr );
+    REQUIRE( key->publicKey().size() == 64U );
+    REQUIRE( pool.misses() == 1U );
+    REQUIRE( pool.hits() == 0U );
+
+    // Unsupported group is refused
+    REQUIRE( pool.acquire(static_cast<Group>(2)) == nullptr );
+    REQUIRE( pool.ready(static_cast<Group>(2)) == 0U );
+}
+
+TEST_CASE( "DH pool of depth 0 keeps no keys", "[dhpool]" ) {
+    Crypto::DHPool pool;
+    pool.configure(1, 0, 0);
+    Refiller refiller(pool);
+    REQUIRE( waitFor([&]() { return pool.ready(Group::ECP256) == 1; }) );
+
+    // Turning pool off drops keys already made and makes no more
+    pool.configure(0, 0, 0);
+    REQUIRE( pool.ready(Group::ECP256) == 0U );
+    auto first = pool.acquire(Group::ECP256);
+    auto second = pool.acquire(Group::ECP256);
+    REQUIRE( first != nullptr );
+    REQUIRE( first != second );
+    REQUIRE( pool.misses() == 2U );
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (auto & info : groups) {
+        REQUIRE( pool.ready(info.group) == 0U );
+    }
+}
+
+TEST_CASE( "DH key reuse is bounded by count and time", "[dhpool]" ) {
+    Crypto::DHPool pool;
+
+    SECTION( "count" ) {
+        pool.configure(0, 60000, 3);
+        auto key = pool.acquire(Group::CURVE25519);
+        REQUIRE( pool.acquire(Group::CURVE25519) == key );
+        REQUIRE( pool.acquire(Group::CURVE25519) == key );
+        // Third exchange was last one key may serve
+        auto next = pool.acquire(Group::CURVE25519);
+        REQUIRE( next != key );
+        REQUIRE( pool.reuses() == 2U );
+        REQUIRE( pool.acquire(Group::CURVE25519) == next );
+
+        // Reuse is per group
+        REQUIRE( pool.acquire(Group::ECP256) != next );
+    }
+
+    SECTION( "time" ) {
+        pool.configure(0, 50, 100);
+        auto key = pool.acquire(Group::CURVE25519);
+        REQUIRE( pool.acquire(Group::CURVE25519) == key );
+        std::this_thread::sleep_for(std::chrono::milliseconds(80));
+        REQUIRE( pool.acquire(Group::CURVE25519) != key );
+        REQUIRE( pool.reuses() == 1U );
+    }
+
+    SECTION( "off" ) {
+        pool.configure(0, 60000, 1);
+        auto key = pool.acquire(Group::CURVE25519);
+        REQUIRE( pool.acquire(Group::CURVE25519) != key );
+        REQUIRE( pool.reuses() == 0U );
+    }
+}
+
+TEST_CASE( "DH pool shutdown ends refill loop", "[dhpool]" ) {
+    Crypto::DHPool pool;
+
+    SECTION( "idle" ) {
+        // Depth 0, loop sleeps waiting for work
+        pool.configure(0, 0, 0);
+        auto done = std::async(std::launch::async, [&pool]() { return pool.refillLoop(); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        pool.shutdownHandler();
+        REQUIRE( done.wait_for(std::chrono::seconds(10)) == std::future_status::ready );
+        REQUIRE( done.get() == 0 );
+    }
+
+    SECTION( "generating" ) {
+        pool.configure(64, 0, 0);
+        auto done = std::async(std::launch::async, [&pool]() { return pool.refillLoop(); });
+        REQUIRE( waitFor([&]() { return pool.ready(Group::MODP3072) > 0; }) );
+        pool.shutdownHandler();
+        REQUIRE( done.wait_for(std::chrono::seconds(10)) == std::future_status::ready );
+        REQUIRE( done.get() == 0 );
+    }
+
+    SECTION( "before loop starts" ) {
+        pool.shutdownHandler();
+        REQUIRE( pool.refillLoop() == 0 );
+    }
+}
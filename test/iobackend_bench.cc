@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compare epoll and io_uring datagram backends on loopback: receive
+// rate and syscalls per datagram while sender keeps socket busy, and
+// send rate through small socket buffer(EAGAIN path)
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+
+#include "iobackend.hh"
+#include "utils.hh"
+
+namespace {
+
+const S32 STOP_EVENT = 1;
+const U32 BATCH_SIZE = 32;
+const U32 DATAGRAM_SIZE = 200;
+const U32 SLOT_SIZE = 2048;
+const U32 MAX_DATAGRAM = 65535;
+const U32 SEND_COUNT = 200000;
+const S32 RUN_MSEC = 2000;
+
+S32
+udpSocket(S32 bufSize, bool sndBuf) {
+    S32 fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, sndBuf ? SO_SNDBUF : SO_RCVBUF, &bufSize, sizeof(bufSize));
+    Utils::setFdNonBlocking(fd);
+    return fd;
+}
+
+struct sockaddr_in
+localAddr(S32 fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    return addr;
+}
+
+// Sender floods receiver socket for RUN_MSEC while backend drains it
+void
+benchReceive(ASIO::IOBackend::Type type, const char * name) {
+    S32 rcvFd = udpSocket(4 << 20, false);
+    S32 sndFd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in dst = localAddr(rcvFd);
+
+    Synchro::Notifier stop(name);
+    stop.createNotifier(0, EFD_SEMAPHORE);
+    auto backend = ASIO::IOBackend::create(type, name);
+    if (backend->init(rcvFd, stop, STOP_EVENT, BATCH_SIZE, MAX_DATAGRAM) == -1) {
+        printf("%-8s receive: backend unavailable\n", name);
+        close(rcvFd);
+        close(sndFd);
+        return;
+    }
+
+    std::atomic<bool> done(false);
+    std::thread sender([&]() {
+        std::vector<char> payload(DATAGRAM_SIZE, 'x');
+        struct iovec iov = { payload.data(), payload.size() };
+        std::vector<struct mmsghdr> msgs(BATCH_SIZE);
+        for (auto & msg : msgs) {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_hdr.msg_name = &dst;
+            msg.msg_hdr.msg_namelen = sizeof(dst);
+            msg.msg_hdr.msg_iov = &iov;
+            msg.msg_hdr.msg_iovlen = 1;
+        }
+        while (!done) {
+            sendmmsg(sndFd, msgs.data(), msgs.size(), 0);
+        }
+        stop.notify(STOP_EVENT);
+    });
+
+    std::vector<std::vector<SCHAR>> buffers(BATCH_SIZE, std::vector<SCHAR>(SLOT_SIZE));
+    std::vector<struct sockaddr_storage> peers(BATCH_SIZE);
+    // io_uring may hand over more than one batch per receive()
+    auto slots = [&](U32 idx, U32 sizeHint) {
+        if (idx >= buffers.size()) {
+            buffers.resize(idx + 1, std::vector<SCHAR>(SLOT_SIZE));
+            peers.resize(idx + 1);
+        }
+        return ASIO::IOBackend::RcvSlot{buffers[idx].data(), SLOT_SIZE,
+                                        (struct sockaddr *)&peers[idx],
+                                        sizeof(peers[idx])};
+    };
+    U64 bytes = 0;
+    auto handler = [&](U32 idx, S32 len, const SCHAR * overflow, bool truncated) {
+        bytes += len;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::milliseconds(RUN_MSEC);
+    while (true) {
+        if (!done && std::chrono::steady_clock::now() >= deadline) {
+            done = true;
+        }
+        S32 ret = backend->receive(slots, handler);
+        if (ret == ASIO::IO_STOP || ret == -1) {
+            break;
+        }
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    sender.join();
+
+    printf("%-8s receive: %9.0f datagrams/s  %.3f syscalls/datagram  %lu bytes\n",
+           name, backend->datagrams() / secs,
+           backend->datagrams() ? static_cast<double>(backend->syscalls()) / backend->datagrams() : 0,
+           bytes);
+
+    backend.reset();
+    close(rcvFd);
+    close(sndFd);
+}
+
+// Send SEND_COUNT datagrams through small send buffer, so backend
+// has to wait for buffer space instead of dropping
+void
+benchSend(ASIO::IOBackend::Type type, const char * name) {
+    S32 sndFd = udpSocket(16 << 10, true);
+    S32 sinkFd = udpSocket(8 << 20, false);
+    struct sockaddr_in dst = localAddr(sinkFd);
+
+    Synchro::Notifier stop(name);
+    stop.createNotifier(0, EFD_SEMAPHORE);
+    auto backend = ASIO::IOBackend::create(type, name);
+    if (backend->init(sndFd, stop, STOP_EVENT, BATCH_SIZE, MAX_DATAGRAM) == -1) {
+        printf("%-8s send   : backend unavailable\n", name);
+        close(sndFd);
+        close(sinkFd);
+        return;
+    }
+
+    // Sink drains so sender only waits for its own buffer
+    std::atomic<bool> done(false);
+    std::thread sink([&]() {
+        std::vector<char> buf(MAX_DATAGRAM);
+        while (!done) {
+            if (recv(sinkFd, buf.data(), buf.size(), 0) == -1) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    std::vector<char> payload(DATAGRAM_SIZE, 'x');
+    struct iovec iov = { payload.data(), payload.size() };
+    std::vector<struct mmsghdr> msgs(BATCH_SIZE);
+
+    U64 syscallsBefore = backend->syscalls();
+    auto start = std::chrono::steady_clock::now();
+    for (U32 sent = 0; sent < SEND_COUNT; sent += BATCH_SIZE) {
+        for (auto & msg : msgs) {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_hdr.msg_name = &dst;
+            msg.msg_hdr.msg_namelen = sizeof(dst);
+            msg.msg_hdr.msg_iov = &iov;
+            msg.msg_hdr.msg_iovlen = 1;
+        }
+        if (backend->send(msgs.data(), msgs.size()) == -1) {
+            break;
+        }
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    done = true;
+    sink.join();
+
+    printf("%-8s send   : %9.0f datagrams/s  %.3f syscalls/datagram  %lu dropped\n",
+           name, SEND_COUNT / secs,
+           static_cast<double>(backend->syscalls() - syscallsBefore) / SEND_COUNT,
+           backend->sendDrops());
+
+    backend.reset();
+    close(sndFd);
+    close(sinkFd);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    benchReceive(ASIO::IOBackend::Type::EPOLL, "epoll");
+    benchReceive(ASIO::IOBackend::Type::IO_URING, "io_uring");
+    benchSend(ASIO::IOBackend::Type::EPOLL, "epoll");
+    benchSend(ASIO::IOBackend::Type::IO_URING, "io_uring");
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Session map at 100k and 1M sessions: insert, lookup from several
+// threads and erase, against single mutex map it replaced
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <random>
+#include <cstdio>
+#include <unordered_map>
+
+#include "network.hh"
+
+namespace {
+
+const U32 LOOKUP_THREADS = 4;
+const U32 LOOKUPS_PER_THREAD = 1000000;
+
+struct Session {
+    U32 id;
+};
+
+// Map as it was before lock striping, kept for comparison
+class LockedMap {
+ public:
+    using Ptr = std::shared_ptr<Session>;
+    using Factory = std::function<Ptr()>;
+
+    bool findOrInsert(const HashKey & key, const Factory & factory, Ptr & value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = map_.find(key);
+        if (iter != map_.end()) {
+            value = iter->second;
+            return false;
+        }
+        value = factory();
+        map_.insert({key, value});
+        return true;
+    }
+
+    bool find(const HashKey & key, Ptr & value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = map_.find(key);
+        if (iter == map_.end()) {
+            return false;
+        }
+        value = iter->second;
+        return true;
+    }
+
+    void erase(const HashKey & key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        map_.erase(key);
+    }
+ private:
+    std::mutex mutex_;
+    std::unordered_map<HashKey, Ptr> map_;
+};
+
+// Peers spread over 10.0.0.0/8 and ephemeral ports
+std::vector<HashKey>
+makeKeys(U32 count) {
+    std::vector<HashKey> keys;
+    keys.reserve(count);
+    for (U32 idx = 0; idx < count; ++idx) {
+        struct sockaddr_in peer;
+        memset(&peer, 0, sizeof(peer));
+        peer.sin_family = AF_INET;
+        peer.sin_addr.s_addr = htonl(0x0a000000 | (idx >> 4));
+        peer.sin_port = htons(32768 + (idx & 0xf));
+        keys.push_back(HashKey::fromSockAddr(peer));
+    }
+    return keys;
+}
+
+double
+nsPerOp(std::chrono::steady_clock::time_point start, U64 ops) {
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now() - start).count() / ops;
+}
+
+template<typename M>
+void
+run(const char * name, const std::vector<HashKey> & keys) {
+    M sessions;
+    auto factory = []() { return std::make_shared<Session>(); };
+    typename M::Ptr value;
+
+    auto start = std::chrono::steady_clock::now();
+    for (auto & key : keys) {
+        sessions.findOrInsert(key, factory, value);
+    }
+    double insertNs = nsPerOp(start, keys.size());
+
+    // Random lookups from several threads, as worker threads do
+    start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (U32 id = 0; id < LOOKUP_THREADS; ++id) {
+        threads.emplace_back([&, id]() {
+            std::mt19937 rng(id);
+            std::uniform_int_distribution<U32> pick(0, keys.size() - 1);
+            typename M::Ptr found;
+            for (U32 idx = 0; idx < LOOKUPS_PER_THREAD; ++idx) {
+                sessions.find(keys[pick(rng)], found);
+            }
+        });
+    }
+    for (auto & thread : threads) {
+        thread.join();
+    }
+    double lookupNs = nsPerOp(start, static_cast<U64>(LOOKUP_THREADS) * LOOKUPS_PER_THREAD);
+
+    start = std::chrono::steady_clock::now();
+    for (auto & key : keys) {
+        sessions.erase(key);
+    }
+    double eraseNs = nsPerOp(start, keys.size());
+
+    printf("%8zu %-14s insert %7.1f ns  lookup %7.1f ns  erase %7.1f ns\n",
+           keys.size(), name, insertNs, lookupNs, eraseNs);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    for (U32 count : { 100000, 1000000 }) {
+        auto keys = makeKeys(count);
+        run<LockedMap>("single mutex", keys);
+        run<Map<HashKey, Session>>("striped", keys);
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#include "catch.hpp"
+#include "map.hh"
+
+namespace {
+
+struct Session {
+    explicit Session(U32 key) : key(key) {}
+    U32 key;
+};
+
+using SessionMap = Map<U32, Session>;
+
+}  // namespace
+
+TEST_CASE( "Racing findOrInsert creates one value per key", "[map]" ) {
+    const U32 threadCount = 8;
+    const U32 keyCount = 2000;
+
+    SessionMap sessions;
+    std::atomic<U32> created(0);
+    std::atomic<bool> go(false);
+    // Per thread: which keys it inserted and what it got back
+    std::vector<std::vector<bool>> won(threadCount, std::vector<bool>(keyCount));
+    std::vector<std::vector<SessionMap::Ptr>> got(threadCount,
+                                                  std::vector<SessionMap::Ptr>(keyCount));
+
+    std::vector<std::thread> threads;
+    for (U32 id = 0; id < threadCount; ++id) {
+        threads.emplace_back([&, id]() {
+            while (!go) {
+                std::this_thread::yield();
+            }
+            for (U32 key = 0; key < keyCount; ++key) {
+                won[id][key] = sessions.findOrInsert(key, [&created, key]() {
+                    created++;
+                    return std::make_shared<Session>(key);
+                }, got[id][key]);
+            }
+        });
+    }
+    go = true;
+    for (auto & thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE( created == keyCount );
+    REQUIRE( sessions.size() == keyCount );
+
+    U32 badWinners = 0;
+    U32 mismatches = 0;
+    for (U32 key = 0; key < keyCount; ++key) {
+        U32 winners = 0;
+        SessionMap::Ptr stored;
+        sessions.find(key, stored);
+        for (U32 id = 0; id < threadCount; ++id) {
+            winners += won[id][key];
+            mismatches += got[id][key] != stored || stored->key != key;
+        }
+        badWinners += winners != 1;
+    }
+    REQUIRE( badWinners == 0 );
+    REQUIRE( mismatches == 0 );
+}
+
+TEST_CASE( "Erase by value leaves replacement alone", "[map]" ) {
+    SessionMap sessions;
+    auto stale = std::make_shared<Session>(7);
+    auto fresh = std::make_shared<Session>(7);
+
+    sessions.add(7, stale);
+    sessions.erase(7, stale.get());
+    REQUIRE( sessions.size() == 0 );
+
+    sessions.add(7, fresh);
+    // Late erase of old value must not remove new one
+    sessions.erase(7, stale.get());
+    SessionMap::Ptr found;
+    REQUIRE( sessions.find(7, found) );
+    REQUIRE( found == fresh );
+
+    sessions.erase(7);
+    REQUIRE_FALSE( sessions.find(7, found) );
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+
+#include "catch.hpp"
+#include "alloccount.hh"
+#include "network.hh"
+
+using Network::PeerData4;
+
+namespace {
+
+// Packets held at once, like receive slots of one recvmmsg() batch
+const U32 BATCH = 32;
+const U32 CYCLES = 1000;
+
+// One receive / release cycle: take batch of packets from pool, give
+// each buffer of given size class and release them all
+void
+cycle(std::vector<PeerData4::Ptr> & batch, std::size_t len) {
+    for (U32 idx = 0; idx < BATCH; ++idx) {
+        auto pkt = PeerData4::create();
+        pkt->buffer.reserve(len);
+        pkt->bufferLen = len;
+        batch.push_back(pkt);
+    }
+    batch.clear();
+}
+
+U64
+allSlabs() {
+    U64 slabs = PeerData4::pool().slabs();
+    for (U32 idx = 0; idx < Pool::BUFFER_CLASS_COUNT; ++idx) {
+        slabs += Pool::bufferPool(idx).slabs();
+    }
+    return slabs;
+}
+
+}  // namespace
+
+TEST_CASE( "Packet receive / release does not allocate after warm-up", "[pool]" ) {
+    std::vector<PeerData4::Ptr> batch;
+    batch.reserve(BATCH);
+
+    // Warm-up carves slabs and fills thread caches
+    for (auto len : Pool::BUFFER_SIZE_CLASSES) {
+        cycle(batch, len);
+    }
+    U64 slabs = allSlabs();
+    U64 before = AllocCount::allocations();
+
+    for (U32 round = 0; round < CYCLES; ++round) {
+        for (auto len : Pool::BUFFER_SIZE_CLASSES) {
+            cycle(batch, len);
+        }
+    }
+
+    U64 allocations = AllocCount::allocations() - before;
+    REQUIRE( allocations == 0 );
+    REQUIRE( allSlabs() == slabs );
+
+    // Counter does see plain heap allocation. Counts are read before
+    // REQUIRE since Catch allocates while capturing expression
+    before = AllocCount::allocations();
+    auto plain = std::make_shared<PeerData4>();
+    allocations = AllocCount::allocations() - before;
+    REQUIRE( allocations == 1 );
+}
+
+TEST_CASE( "Buffer moves between size classes without allocating", "[pool]" ) {
+    Pool::Buffer warm;
+    for (auto len : Pool::BUFFER_SIZE_CLASSES) {
+        REQUIRE( warm.reserve(len) );
+        warm.reset();
+    }
+    U64 slabs = allSlabs();
+    U64 before = AllocCount::allocations();
+
+    for (U32 round = 0; round < CYCLES; ++round) {
+        Pool::Buffer buffer;
+        // Growing releases smaller block back to its class
+        for (U32 idx = 0; idx < Pool::BUFFER_CLASS_COUNT; ++idx) {
+            buffer.reserve(Pool::BUFFER_SIZE_CLASSES[idx]);
+        }
+        Pool::Buffer moved(std::move(buffer));
+        buffer = std::move(moved);
+    }
+
+    U64 allocations = AllocCount::allocations() - before;
+    REQUIRE( allocations == 0 );
+    REQUIRE( allSlabs() == slabs );
+
+    Pool::Buffer buffer;
+    REQUIRE( buffer.reserve(100) );
+    REQUIRE( buffer.capacity() == Pool::BUFFER_SIZE_CLASSES[0] );
+    REQUIRE( buffer.reserve(3000) );
+    REQUIRE( buffer.capacity() == Pool::BUFFER_SIZE_CLASSES[2] );
+    REQUIRE_FALSE( buffer.reserve(Pool::BUFFER_SIZE_CLASSES[Pool::BUFFER_CLASS_COUNT - 1] + 1) );
+}
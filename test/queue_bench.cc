@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Packet queue throughput: lock-free ring against mutex + condvar
+// queue it replaced, for several producer / consumer counts
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+
+#include "queue.hh"
+
+namespace {
+
+const U32 PKTS_PER_PRODUCER = 500000;
+
+// Queue as it was before lock-free ring, kept for comparison
+template<typename T>
+class LockedQueue {
+ public:
+    using Ptr = std::shared_ptr<T>;
+
+    LockedQueue() : stopped_(false) {}
+
+    bool addPkt(Ptr elem) {
+        std::unique_lock<std::mutex> lock(queueMutex_);
+        if (stopped_) {
+            return false;
+        }
+        opaqueQ_.push_back(elem);
+        queueCond_.notify_one();
+        return true;
+    }
+
+    bool getPkt(Ptr & elem) {
+        std::unique_lock<std::mutex> lock(queueMutex_);
+        queueCond_.wait(lock, [this]{ return this->stopped_ || !this->opaqueQ_.empty(); });
+        if (opaqueQ_.empty()) {
+            return false;
+        }
+        elem = opaqueQ_.front();
+        opaqueQ_.pop_front();
+        return true;
+    }
+
+    void shutdown() {
+        std::unique_lock<std::mutex> lock(queueMutex_);
+        stopped_ = true;
+        queueCond_.notify_all();
+    }
+ private:
+    std::deque<Ptr> opaqueQ_;
+    std::mutex queueMutex_;
+    std::condition_variable queueCond_;
+    bool stopped_;
+};
+
+// Packets are allocated up front so only queue cost is measured
+template<typename Q>
+double
+run(Q & queue, U32 producers, U32 consumers) {
+    const U32 total = producers * PKTS_PER_PRODUCER;
+    std::vector<std::shared_ptr<U32>> pkts;
+    pkts.reserve(total);
+    for (U32 idx = 0; idx < total; ++idx) {
+        pkts.push_back(std::make_shared<U32>(idx));
+    }
+
+    std::atomic<U32> consumed(0);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+
+    for (U32 id = 0; id < consumers; ++id) {
+        threads.emplace_back([&]() {
+            typename Q::Ptr elem;
+            while (queue.getPkt(elem)) {
+                if (++consumed == total) {
+                    queue.shutdown();
+                }
+            }
+        });
+    }
+
+    for (U32 id = 0; id < producers; ++id) {
+        threads.emplace_back([&, id]() {
+            for (U32 idx = id * PKTS_PER_PRODUCER; idx < (id + 1) * PKTS_PER_PRODUCER; ++idx) {
+                while (!queue.addPkt(pkts[idx])) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    for (auto & thread : threads) {
+        thread.join();
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return total / secs / 1e6;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    const U32 counts[][2] = { {1, 1}, {2, 2}, {4, 4}, {8, 2} };
+
+    printf("producers consumers   mutex+condvar    lock-free ring\n");
+    for (auto & count : counts) {
+        LockedQueue<U32> locked;
+        Queue<U32> ring(QUEUE_CAPACITY);
+        double lockedRate = run(locked, count[0], count[1]);
+        double ringRate = run(ring, count[0], count[1]);
+        printf("%9u %9u   %8.2f Mpkt/s    %8.2f Mpkt/s\n",
+               count[0], count[1], lockedRate, ringRate);
+    }
+    return 0;
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <thread>
+#include <future>
+#include <chrono>
+#include <vector>
+#include <atomic>
+
+#include "catch.hpp"
+#include "queue.hh"
+
+using IntQueue = Queue<U32>;
+
+TEST_CASE( "Every packet is delivered exactly once", "[queue]" ) {
+    const U32 producers = 4;
+    const U32 consumers = 4;
+    const U32 perProducer = 50000;
+    const U32 total = producers * perProducer;
+
+    // Small ring so producers keep hitting full ring and wrapping
+    IntQueue queue(256);
+    std::vector<std::atomic<U32>> seen(total);
+    for (auto & count : seen) {
+        count = 0;
+    }
+    std::atomic<U32> consumed(0);
+
+    std::vector<std::thread> threads;
+    for (U32 id = 0; id < consumers; ++id) {
+        threads.emplace_back([&]() {
+            IntQueue::Ptr elem;
+            while (queue.getPkt(elem)) {
+                seen[*elem]++;
+                if (++consumed == total) {
+                    queue.shutdown();
+                }
+            }
+        });
+    }
+
+    for (U32 id = 0; id < producers; ++id) {
+        threads.emplace_back([&, id]() {
+            for (U32 idx = 0; idx < perProducer; ++idx) {
+                auto elem = std::make_shared<U32>(id * perProducer + idx);
+                // Ring full is not a loss here, try again
+                while (!queue.addPkt(elem)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    for (auto & thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE( consumed == total );
+    U32 duplicates = 0;
+    U32 missing = 0;
+    for (auto & count : seen) {
+        duplicates += count > 1;
+        missing += count == 0;
+    }
+    REQUIRE( duplicates == 0 );
+    REQUIRE( missing == 0 );
+}
+
+TEST_CASE( "Ring keeps order across wrap around", "[queue]" ) {
+    IntQueue queue(8);
+    REQUIRE( queue.capacity() == 8 );
+
+    U32 next = 0;
+    U32 expected = 0;
+    IntQueue::Ptr elem;
+
+    // Each lap fills ring to capacity, so cell sequence numbers
+    // move through several laps
+    for (U32 lap = 0; lap < 5; ++lap) {
+        while (queue.depth() < queue.capacity()) {
+            REQUIRE( queue.addPkt(std::make_shared<U32>(next++)) );
+        }
+
+        // Full ring rejects arriving packet
+        REQUIRE_FALSE( queue.addPkt(std::make_shared<U32>(UINT32_MAX)) );
+        REQUIRE( queue.overflowDrops() == lap + 1 );
+
+        // Free part of ring so next lap starts mid ring
+        for (U32 idx = 0; idx < 3; ++idx) {
+            REQUIRE( queue.getPkt(elem) );
+            REQUIRE( *elem == expected++ );
+        }
+    }
+
+    std::vector<IntQueue::Ptr> rest;
+    REQUIRE( queue.tryGetPkts(rest, 16) );
+    REQUIRE( rest.size() == queue.capacity() - 3 );
+    for (auto & iter : rest) {
+        REQUIRE( *iter == expected++ );
+    }
+    REQUIRE( expected == next );
+    rest.clear();
+    REQUIRE_FALSE( queue.tryGetPkts(rest, 16) );
+}
+
+TEST_CASE( "Shutdown wakes blocked consumers", "[queue]" ) {
+    IntQueue queue(16);
+
+    std::vector<std::future<bool>> results;
+    for (U32 id = 0; id < 3; ++id) {
+        results.push_back(std::async(std::launch::async, [&]() {
+            IntQueue::Ptr elem;
+            return queue.getPkt(elem);
+        }));
+    }
+
+    // Let consumers go to sleep on empty ring
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    queue.shutdown();
+
+    for (auto & result : results) {
+        REQUIRE( result.wait_for(std::chrono::seconds(5)) == std::future_status::ready );
+        REQUIRE_FALSE( result.get() );
+    }
+
+    // Stopped queue takes no more packets
+    REQUIRE( queue.stopped() );
+    REQUIRE_FALSE( queue.addPkt(std::make_shared<U32>(1)) );
+}
+
+namespace {
+
+// Odd values stand for packets starting new session
+bool
+newSession(const U32 & value) {
+    return value & 1;
+}
+
+// Return everything queued, in order consumers would see it
+std::vector<U32>
+drain(IntQueue & queue) {
+    std::vector<IntQueue::Ptr> elems;
+    std::vector<U32> values;
+    if (queue.tryGetPkts(elems, queue.capacity())) {
+        for (auto & elem : elems) {
+            values.push_back(*elem);
+        }
+    }
+    return values;
+}
+
+// Queue values first..last one at a time
+void
+fill(IntQueue & queue, U32 first, U32 last) {
+    for (U32 value = first; value <= last; ++value) {
+        queue.addPkt(std::make_shared<U32>(value));
+    }
+}
+
+}  // namespace
+
+TEST_CASE( "Drop newest keeps queued packets past high water", "[queue]" ) {
+    IntQueue queue;
+    queue.configure(16, 8, OverflowPolicy::DROP_NEWEST);
+    REQUIRE( queue.highWater() == 8 );
+
+    fill(queue, 0, 11);
+    REQUIRE( queue.depth() == 8 );
+    REQUIRE( queue.overflowDrops() == 4 );
+    REQUIRE( queue.evictions() == 0 );
+    REQUIRE( queue.newSessionDrops() == 0 );
+    REQUIRE( queue.drops() == 4 );
+    REQUIRE( drain(queue) == std::vector<U32>({0, 1, 2, 3, 4, 5, 6, 7}) );
+}
+
+TEST_CASE( "Drop oldest evicts head of queue past high water", "[queue]" ) {
+    IntQueue queue;
+    queue.configure(16, 8, OverflowPolicy::DROP_OLDEST);
+
+    fill(queue, 0, 11);
+    REQUIRE( queue.depth() == 8 );
+    REQUIRE( queue.evictions() == 4 );
+    REQUIRE( queue.overflowDrops() == 0 );
+    REQUIRE( queue.newSessionDrops() == 0 );
+    REQUIRE( drain(queue) == std::vector<U32>({4, 5, 6, 7, 8, 9, 10, 11}) );
+
+    // Batched add goes through same policy
+    std::vector<IntQueue::Ptr> batch;
+    for (U32 value = 20; value < 30; ++value) {
+        batch.push_back(std::make_shared<U32>(value));
+    }
+    REQUIRE( queue.addPkts(batch) == 10 );
+    REQUIRE( batch.empty() );
+    REQUIRE( queue.evictions() == 6 );
+    REQUIRE( drain(queue) == std::vector<U32>({22, 23, 24, 25, 26, 27, 28, 29}) );
+}
+
+TEST_CASE( "Prefer existing drops new sessions past high water", "[queue]" ) {
+    IntQueue queue;
+    queue.configure(16, 8, OverflowPolicy::PREFER_EXISTING);
+    queue.classifierIs(newSession);
+
+    // Below high water everything is admitted
+    fill(queue, 0, 7);
+    REQUIRE( queue.depth() == 8 );
+
+    // Past it only existing sessions(even) get in
+    fill(queue, 8, 15);
+    REQUIRE( queue.newSessionDrops() == 4 );
+    REQUIRE( queue.overflowDrops() == 0 );
+    REQUIRE( queue.evictions() == 0 );
+    REQUIRE( queue.depth() == 12 );
+
+    // Existing sessions still lose once ring itself is full
+    for (U32 value = 16; value <= 24; value += 2) {
+        queue.addPkt(std::make_shared<U32>(value));
+    }
+    REQUIRE( queue.depth() == 16 );
+    REQUIRE( queue.overflowDrops() == 1 );
+    REQUIRE( queue.newSessionDrops() == 4 );
+    REQUIRE( drain(queue) == std::vector<U32>({0, 1, 2, 3, 4, 5, 6, 7,
+                                               8, 10, 12, 14, 16, 18, 20, 22}) );
+}
+
+TEST_CASE( "Prefer existing without classifier drops everything past high water", "[queue]" ) {
+    IntQueue queue;
+    queue.configure(16, 4, OverflowPolicy::PREFER_EXISTING);
+
+    fill(queue, 0, 7);
+    REQUIRE( queue.newSessionDrops() == 4 );
+    REQUIRE( queue.overflowDrops() == 0 );
+    REQUIRE( drain(queue) == std::vector<U32>({0, 1, 2, 3}) );
+}
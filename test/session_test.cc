@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+
+#include <cstring>
+
+#include "catch.hpp"
+#include "network.hh"
+
+using namespace Network;
+
+namespace {
+
+PeerData4::Ptr
+makePkt(U32 addr, U16 port) {
+    auto pkt = PeerData4::create();
+    pkt->buffer.reserve(64);
+    memset(pkt->buffer.data(), 0, 64);
+    // Too short for IKE header, session is found by address
+    pkt->bufferLen = 8;
+    memset(&pkt->peer, 0, sizeof(pkt->peer));
+    pkt->peer.sin_family = AF_INET;
+    pkt->peer.sin_addr.s_addr = htonl(addr);
+    pkt->peer.sin_port = htons(port);
+    pkt->hash = HashKey::fromSockAddr(pkt->peer);
+    return pkt;
+}
+
+// Full IKE header carrying given responder SPI
+PeerData4::Ptr
+makeIkePkt(U32 addr, U16 port, U64 responderSpi) {
+    auto pkt = makePkt(addr, port);
+    pkt->bufferLen = IKEv2::IKEV2_HEADER_LEN;
+    U64 spi = htobe64(responderSpi);
+    memcpy(pkt->buffer.data() + IKEv2::IKEV2_RESPONDER_SPI_OFFSET, &spi, sizeof(spi));
+    return pkt;
+}
+
+}  // namespace
+
+TEST_CASE( "Timed out session refuses keep alive", "[session]" ) {
+    U64 now = 0;
+    Timer::AsyncTimer timer;
+    timer.clockIs([&now]() { return now; });
+    timer.createTimerFd();
+
+    SessionMap4 sessions;
+    SpiTable4 spis;
+    auto pkt = makePkt(0x0a000001, 500);
+
+    IKEv2SessionManager4::processPkt(pkt, sessions, spis, timer);
+    IKEv2Session4::Ptr first;
+    REQUIRE( sessions.find(pkt->hash, first) );
+
+    // Traffic before deadline keeps session
+    now = SESSION_TIMEOUT - 1000;
+    IKEv2SessionManager4::processPkt(pkt, sessions, spis, timer);
+    now = SESSION_TIMEOUT + 1000;
+    timer.handleTimerFd();
+    REQUIRE( sessions.size() == 1 );
+
+    // Idle past timeout(and timer slack), session leaves map
+    now += SESSION_TIMEOUT + 2 * SESSION_TIMER_SLACK;
+    timer.handleTimerFd();
+    REQUIRE( sessions.size() == 0 );
+
+    // Packet which found session just before it timed out is told so
+    // and processPkt() looks up again, getting fresh session
+    REQUIRE_FALSE( first->keepAlive() );
+    IKEv2SessionManager4::processPkt(pkt, sessions, spis, timer);
+    IKEv2Session4::Ptr second;
+    REQUIRE( sessions.find(pkt->hash, second) );
+    REQUIRE( second != first );
+    REQUIRE( second->keepAlive() );
+}
+
+TEST_CASE( "Session follows peer to new address by responder SPI", "[session]" ) {
+    Timer::AsyncTimer timer;
+    timer.createTimerFd();
+    SessionMap4 sessions;
+    SpiTable4 spis;
+
+    // IKE_SA_INIT gets our SPI allocated
+    auto init = makeIkePkt(0x0a000001, 500, 0);
+    IKEv2SessionManager4::processPkt(init, sessions, spis, timer);
+    IKEv2Session4::Ptr session;
+    REQUIRE( sessions.find(init->hash, session) );
+    U64 spi = session->responderSpi();
+    REQUIRE( spi != 0 );
+    REQUIRE( spis.size() == 1 );
+
+    // Peer behind NAT shows up from other address and port
+    auto moved = makeIkePkt(0x0a000002, 4500, spi);
+    IKEv2SessionManager4::processPkt(moved, sessions, spis, timer);
+    REQUIRE( sessions.size() == 1 );
+    IKEv2Session4::Ptr found;
+    REQUIRE_FALSE( sessions.find(init->hash, found) );
+    REQUIRE( sessions.find(moved->hash, found) );
+    REQUIRE( found == session );
+    REQUIRE( session->key() == moved->hash );
+    REQUIRE( spis.size() == 1 );
+
+    // Unknown SPI from third address gets session of its own
+    auto stranger = makeIkePkt(0x0a000003, 500, spi ^ (1ULL << 63));
+    IKEv2SessionManager4::processPkt(stranger, sessions, spis, timer);
+    REQUIRE( sessions.size() == 2 );
+    REQUIRE( sessions.find(stranger->hash, found) );
+    REQUIRE( found != session );
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Responder SPI lookup at 1K, 100K and 1M IKE SAs. SPI table should
+// cost same at every size, striped hash map keyed by SPI is shown
+// for comparison
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <random>
+#include <cstdio>
+
+#include "map.hh"
+#include "spitable.hh"
+
+namespace {
+
+const U32 LOOKUP_THREADS = 4;
+const U32 LOOKUPS_PER_THREAD = 2000000;
+
+struct Session {
+    U32 id;
+};
+
+// Hash map keyed by SPI, as SAs would be without SPI table
+class HashedSpis {
+ public:
+    using Ptr = std::shared_ptr<Session>;
+
+    U64 add(const Ptr & value) {
+        U64 spi = rng_();
+        map_.add(spi, value);
+        return spi;
+    }
+    bool find(U64 spi, Ptr & value) { return map_.find(spi, value); }
+ private:
+    Map<U64, Session> map_;
+    std::mt19937_64 rng_;
+};
+
+template<typename T>
+void
+run(const char * name, U32 count) {
+    T table;
+    std::vector<U64> spis;
+    spis.reserve(count);
+    for (U32 idx = 0; idx < count; ++idx) {
+        spis.push_back(table.add(std::make_shared<Session>()));
+    }
+
+    // SPIs to look up are picked up front, so only lookup is timed
+    std::vector<std::vector<U64>> picks(LOOKUP_THREADS);
+    for (U32 id = 0; id < LOOKUP_THREADS; ++id) {
+        std::mt19937 rng(id);
+        std::uniform_int_distribution<U32> pick(0, count - 1);
+        picks[id].reserve(LOOKUPS_PER_THREAD);
+        for (U32 idx = 0; idx < LOOKUPS_PER_THREAD; ++idx) {
+            picks[id].push_back(spis[pick(rng)]);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (U32 id = 0; id < LOOKUP_THREADS; ++id) {
+        threads.emplace_back([&, id]() {
+            typename T::Ptr found;
+            for (U64 spi : picks[id]) {
+                table.find(spi, found);
+            }
+        });
+    }
+    for (auto & thread : threads) {
+        thread.join();
+    }
+    double ns = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - start).count() /
+                (static_cast<U64>(LOOKUP_THREADS) * LOOKUPS_PER_THREAD);
+
+    printf("%8u %-10s lookup %7.1f ns\n", count, name, ns);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    for (U32 count : { 1000, 100000, 1000000 }) {
+        run<HashedSpis>("hash map", count);
+        run<SpiTable<Session>>("spi table", count);
+    }
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#include "catch.hpp"
+#include "spitable.hh"
+
+using IntTable = SpiTable<U32>;
+
+TEST_CASE( "SPI table adds, finds and erases", "[spitable]" ) {
+    IntTable table(3);
+    auto value = std::make_shared<U32>(7);
+
+    U64 spi = table.add(value);
+    REQUIRE( spi != 0 );
+    REQUIRE( IntTable::shardOf(spi) == 3 );
+    REQUIRE( table.size() == 1 );
+
+    IntTable::Ptr found;
+    REQUIRE( table.find(spi, found) );
+    REQUIRE( found == value );
+
+    // Every SPI handed out is distinct
+    U64 other = table.add(std::make_shared<U32>(8));
+    REQUIRE( other != spi );
+    REQUIRE( table.size() == 2 );
+
+    table.erase(spi);
+    REQUIRE( table.size() == 1 );
+    REQUIRE_FALSE( table.find(spi, found) );
+    REQUIRE( table.find(other, found) );
+    REQUIRE( *found == 8 );
+
+    // Erasing twice is harmless
+    table.erase(spi);
+    REQUIRE( table.size() == 1 );
+    REQUIRE( value.use_count() == 1 );
+}
+
+TEST_CASE( "Stale SPI misses after its slot is reused", "[spitable]" ) {
+    IntTable table;
+    U64 stale = table.add(std::make_shared<U32>(1));
+    table.erase(stale);
+
+    // Freed slot is handed out first, under new tag
+    U64 fresh = table.add(std::make_shared<U32>(2));
+    REQUIRE( (fresh & (SPI_MAX_SLOTS - 1)) == (stale & (SPI_MAX_SLOTS - 1)) );
+    REQUIRE( fresh != stale );
+
+    IntTable::Ptr found;
+    REQUIRE_FALSE( table.find(stale, found) );
+    REQUIRE( found == nullptr );
+    REQUIRE( table.find(fresh, found) );
+    REQUIRE( *found == 2 );
+
+    // Nor can stale SPI erase new occupant
+    table.erase(stale);
+    REQUIRE( table.size() == 1 );
+    REQUIRE( table.find(fresh, found) );
+}
+
+TEST_CASE( "SPI of other shard is not found", "[spitable]" ) {
+    IntTable mine(1);
+    IntTable theirs(2);
+    U64 spi = theirs.add(std::make_shared<U32>(1));
+    mine.add(std::make_shared<U32>(2));
+
+    // Same slot and tag, wrong shard bits
+    IntTable::Ptr found;
+    REQUIRE_FALSE( mine.find(spi, found) );
+    mine.erase(spi);
+    REQUIRE( mine.size() == 1 );
+
+    // Slot beyond grown chunks and zero SPI miss too
+    REQUIRE_FALSE( mine.find((static_cast<U64>(1) << SPI_TAG_SHIFT) |
+                             (static_cast<U64>(1) << SPI_SLOT_BITS) | (SPI_MAX_SLOTS - 1), found) );
+    REQUIRE_FALSE( mine.find(0, found) );
+}
+
+TEST_CASE( "Full SPI table refuses new SAs till one leaves", "[spitable]" ) {
+    IntTable table(0, SPI_CHUNK_SLOTS);
+    std::vector<U64> spis;
+    for (U32 idx = 0; idx < SPI_CHUNK_SLOTS; ++idx) {
+        U64 spi = table.add(std::make_shared<U32>(idx));
+        REQUIRE( spi != 0 );
+        spis.push_back(spi);
+    }
+    REQUIRE( table.size() == SPI_CHUNK_SLOTS );
+
+    REQUIRE( table.add(std::make_shared<U32>(0)) == 0 );
+    REQUIRE( table.size() == SPI_CHUNK_SLOTS );
+
+    table.erase(spis[100]);
+    U64 spi = table.add(std::make_shared<U32>(1));
+    REQUIRE( spi != 0 );
+    REQUIRE( table.add(std::make_shared<U32>(2)) == 0 );
+
+    // Everything still there is found by its own SPI
+    IntTable::Ptr found;
+    for (U32 idx = 0; idx < SPI_CHUNK_SLOTS; ++idx) {
+        if (idx != 100) {
+            REQUIRE( table.find(spis[idx], found) );
+            REQUIRE( *found == idx );
+        }
+    }
+}
+
+TEST_CASE( "SPI lookups race with adds and erases", "[spitable]" ) {
+    IntTable table;
+    const U32 rounds = 20000;
+
+    // Value is SPI it was stored under, so reader can tell when slot
+    // handed back value of other SA
+    struct Entry {
+        std::atomic<U64> spi;
+    };
+    const U32 live = 64;
+    std::vector<Entry> entries(live);
+    for (auto & entry : entries) {
+        entry.spi = 0;
+    }
+
+    std::atomic<bool> done(false);
+    std::atomic<U32> wrong(0);
+    std::vector<std::thread> readers;
+    for (U32 id = 0; id < 3; ++id) {
+        readers.emplace_back([&]() {
+            IntTable::Ptr found;
+            while (!done) {
+                for (auto & entry : entries) {
+                    U64 spi = entry.spi;
+                    if (spi != 0 && table.find(spi, found) &&
+                        *found != static_cast<U32>(spi >> SPI_TAG_SHIFT)) {
+                        wrong++;
+                    }
+                }
+            }
+        });
+    }
+
+    for (U32 round = 0; round < rounds; ++round) {
+        Entry & entry = entries[round % live];
+        U64 old = entry.spi;
+        if (old != 0) {
+            table.erase(old);
+        }
+        auto value = std::make_shared<U32>(0);
+        U64 spi = table.add(value);
+        REQUIRE( spi != 0 );
+        // Value is filled in before readers learn SPI
+        *value = spi >> SPI_TAG_SHIFT;
+        entry.spi = spi;
+    }
+    done = true;
+    for (auto & reader : readers) {
+        reader.join();
+    }
+
+    REQUIRE( wrong == 0U );
+    REQUIRE( table.size() == live );
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Short task throughput of thread pool by no. of workers. Tasks are
+// posted from outside pool(shared injector) or spawned by task
+// running on worker(own deque, others steal)
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <algorithm>
+
+#include "threadpool.hh"
+
+namespace {
+
+const U32 TASKS = 2000000;
+// Tasks spawned per running task in spawn mode
+const U32 FANOUT = 64;
+
+// About 100ns of work, kept out of reach of optimiser
+U32
+work(U32 seed) {
+    for (U32 idx = 0; idx < 64; ++idx) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+    }
+    return seed;
+}
+
+std::atomic<U32> done;
+std::atomic<U32> sink;
+
+void
+shortTask(U32 seed) {
+    sink.fetch_add(work(seed) & 1, std::memory_order_relaxed);
+    done.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Spawns FANOUT short tasks, then next spawner, from worker thread
+void
+spawner(IKEv2::ThreadPool * pool, U32 left) {
+    U32 count = std::min(left, FANOUT);
+    for (U32 idx = 0; idx < count; ++idx) {
+        pool->post([idx]() { shortTask(idx + 1); });
+    }
+    if (left > count) {
+        pool->post([pool, left, count]() { spawner(pool, left - count); });
+    }
+}
+
+double
+run(U32 workers, bool spawn) {
+    IKEv2::ThreadPool pool(workers);
+    done = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    if (spawn) {
+        pool.post([&pool]() { spawner(&pool, TASKS); });
+    } else {
+        for (U32 idx = 0; idx < TASKS; ++idx) {
+            pool.post([idx]() { shortTask(idx + 1); });
+        }
+    }
+    while (done.load(std::memory_order_relaxed) < TASKS) {
+        std::this_thread::yield();
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return TASKS / secs / 1e6;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    printf("cores %u\n", std::thread::hardware_concurrency());
+    printf("workers     posted         spawned\n");
+    for (U32 workers : { 1, 2, 4, 8, 16 }) {
+        double posted = run(workers, false);
+        double spawned = run(workers, true);
+        printf("%7u   %6.2f Mtask/s   %6.2f Mtask/s\n", workers, posted, spawned);
+    }
+    return 0;
+}
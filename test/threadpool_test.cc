@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <functional>
+
+#include "catch.hpp"
+#include "alloccount.hh"
+#include "threadpool.hh"
+
+using IKEv2::Task;
+using IKEv2::ThreadPool;
+using IKEv2::WorkDeque;
+
+namespace {
+
+// Spin till cond holds, false if it did not within 5 sec
+bool
+waitFor(const std::function<bool()> & cond) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!cond()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+// Callable too big for Task inline storage, counts its instances
+struct BigCallable {
+    BigCallable(std::atomic<S32> & live, std::atomic<S32> & calls) :
+        live(&live), calls(&calls) {
+        (*this->live)++;
+    }
+    BigCallable(const BigCallable & other) : live(other.live), calls(other.calls) {
+        (*live)++;
+    }
+    BigCallable(BigCallable && other) noexcept : live(other.live), calls(other.calls) {
+        (*live)++;
+    }
+    ~BigCallable() {
+        (*live)--;
+    }
+    void operator()() {
+        (*calls)++;
+    }
+
+    std::atomic<S32> * live;
+    std::atomic<S32> * calls;
+    UCHAR payload[IKEv2::TASK_INLINE_BYTES];
+};
+
+}  // namespace
+
+TEST_CASE( "Posting small lambda allocates nothing after warm-up", "[threadpool]" ) {
+    const U32 rounds = 100;
+    // Tasks in flight at once. Bounded so that task pool needs same
+    // no. of blocks in every round
+    const U32 batch = 256;
+    ThreadPool pool(2);
+    std::atomic<U32> done(0);
+    U64 a = 1, b = 2, c = 3, d = 4;
+
+    auto task = [&done, a, b, c, d]() {
+        if (a + b + c + d == 10) {
+            done++;
+        }
+    };
+    static_assert(sizeof(task) <= IKEv2::TASK_INLINE_BYTES, "lambda must fit inline");
+
+    U32 posted = 0;
+    auto round = [&]() {
+        for (U32 idx = 0; idx < batch; ++idx) {
+            pool.post(task);
+        }
+        posted += batch;
+        return waitFor([&]() { return done == posted; });
+    };
+
+    // Warm-up fills task pool and thread caches
+    REQUIRE( round() );
+    U64 slabs = Pool::poolFor<Task>("Task").slabs();
+
+    U64 before = AllocCount::allocations();
+    bool finished = true;
+    for (U32 idx = 0; idx < rounds && finished; ++idx) {
+        finished = round();
+    }
+    U64 allocations = AllocCount::allocations() - before;
+
+    REQUIRE( finished );
+    REQUIRE( allocations == 0 );
+    REQUIRE( Pool::poolFor<Task>("Task").slabs() == slabs );
+}
+
+TEST_CASE( "Large callable is heap stored and destroyed once", "[threadpool]" ) {
+    const S32 count = 100;
+    std::atomic<S32> live(0);
+    std::atomic<S32> calls(0);
+    ThreadPool pool(2);
+
+    // Temporary is gone once post() returns, heap copy once task ran
+    U64 before = AllocCount::allocations();
+    for (S32 idx = 0; idx < count; ++idx) {
+        pool.post(BigCallable(live, calls));
+    }
+    bool finished = waitFor([&]() { return calls == count && live == 0; });
+    U64 allocations = AllocCount::allocations() - before;
+
+    REQUIRE( finished );
+    REQUIRE( calls == count );
+    REQUIRE( live == 0 );
+    // One heap copy per task, task nodes themselves are pooled
+    REQUIRE( allocations == static_cast<U64>(count) );
+}
+
+TEST_CASE( "Moved task runs and destroys callable once", "[threadpool]" ) {
+    std::atomic<S32> live(0);
+    std::atomic<S32> calls(0);
+
+    SECTION( "heap stored" ) {
+        {
+            Task first{BigCallable(live, calls)};
+            REQUIRE( live == 1 );
+            // Heap stored callable is handed over, not copied
+            Task second(std::move(first));
+            REQUIRE( live == 1 );
+            second();
+        }
+        REQUIRE( calls == 1 );
+        REQUIRE( live == 0 );
+    }
+
+    SECTION( "inline move-only" ) {
+        auto owned = std::unique_ptr<std::atomic<S32>>(new std::atomic<S32>(0));
+        std::atomic<S32> * counter = owned.get();
+        std::weak_ptr<S32> watch;
+        {
+            auto tracked = std::make_shared<S32>(0);
+            watch = tracked;
+            Task first([owned = std::move(owned), tracked = std::move(tracked)]() {
+                (*owned)++;
+            });
+            Task second(std::move(first));
+            Task third(std::move(second));
+            third();
+            REQUIRE( counter->load() == 1 );
+            // Captures live on in last task only
+            REQUIRE( watch.use_count() == 1 );
+        }
+        REQUIRE( watch.expired() );
+    }
+}
+
+TEST_CASE( "Work deque loses and repeats no task under stealing", "[threadpool]" ) {
+    const U32 owners = 3;
+    const U32 thieves = 3;
+    // Well past initial capacity, so deques grow while being robbed
+    const U32 perOwner = 100000;
+    const U32 total = owners * perOwner;
+
+    std::vector<std::atomic<U32>> runs(total);
+    for (auto & count : runs) {
+        count = 0;
+    }
+    std::atomic<U32> done(0);
+    std::vector<std::unique_ptr<WorkDeque>> deques;
+    for (U32 id = 0; id < owners; ++id) {
+        deques.emplace_back(new WorkDeque());
+    }
+
+    auto run = [&](Task * task) {
+        (*task)();
+        delete task;
+        done++;
+    };
+
+    std::vector<std::thread> threads;
+    for (U32 id = 0; id < owners; ++id) {
+        threads.emplace_back([&, id]() {
+            WorkDeque & deque = *deques[id];
+            for (U32 idx = id * perOwner; idx < (id + 1) * perOwner; ++idx) {
+                deque.push(new Task([&runs, idx]() { runs[idx]++; }));
+                // Owner takes some back, racing thieves for last task
+                if (idx % 3 == 0) {
+                    if (Task * task = deque.pop()) {
+                        run(task);
+                    }
+                }
+            }
+            while (Task * task = deque.pop()) {
+                run(task);
+            }
+        });
+    }
+
+    for (U32 id = 0; id < thieves; ++id) {
+        threads.emplace_back([&, id]() {
+            U32 victim = id;
+            while (done < total) {
+                if (Task * task = deques[victim++ % owners]->steal()) {
+                    run(task);
+                }
+            }
+        });
+    }
+
+    for (auto & thread : threads) {
+        thread.join();
+    }
+
+    U32 missing = 0;
+    U32 repeated = 0;
+    for (auto & count : runs) {
+        missing += count == 0;
+        repeated += count > 1;
+    }
+    REQUIRE( done == total );
+    REQUIRE( missing == 0U );
+    REQUIRE( repeated == 0U );
+    for (auto & deque : deques) {
+        REQUIRE( deque->empty() );
+    }
+}
+
+TEST_CASE( "Parked workers wake for injected tasks", "[threadpool]" ) {
+    ThreadPool pool(2);
+    std::atomic<U32> done(0);
+
+    // Pool goes idle between rounds, so each post has to wake sleeper
+    for (U32 round = 1; round <= 5; ++round) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        pool.post([&done]() { done++; });
+        REQUIRE( waitFor([&]() { return done == round; }) );
+    }
+
+    // Same for bulk lane
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    pool.post([&done]() { done++; }, IKEv2::Lane::BULK);
+    REQUIRE( waitFor([&]() { return done == 6U; }) );
+}
+
+TEST_CASE( "Parked worker steals task pushed by busy worker", "[threadpool]" ) {
+    ThreadPool pool(2);
+    std::atomic<bool> childRan(false);
+    std::atomic<bool> parentDone(false);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    // Parent stays busy till child ran, so child sitting in parent's
+    // own deque can only run if other worker wakes and steals it
+    pool.post([&]() {
+        pool.post([&childRan]() { childRan = true; });
+        waitFor([&]() { return childRan.load(); });
+        parentDone = true;
+    });
+
+    REQUIRE( waitFor([&]() { return parentDone.load(); }) );
+    REQUIRE( childRan );
+}
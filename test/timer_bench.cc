@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Timing wheel with 1M timers: arm, cancel and expire events, and
+// arm / push out / cancel session style handles. Clock is stepped by
+// hand so expiry of a minute of timers does not take a minute
+#include <chrono>
+#include <vector>
+#include <random>
+#include <memory>
+#include <cstdio>
+
+#include "timer.hh"
+
+namespace {
+
+const U32 TIMER_COUNT = 1000000;
+// Timeouts spread over this many msec, crosses levels 0 - 2
+const S32 TIMEOUT_RANGE = 120000;
+// Clock step between expiry runs, like poller waking each msec
+const U64 STEP = 1;
+
+double
+nsPerOp(std::chrono::steady_clock::time_point start, U64 ops) {
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now() - start).count() / ops;
+}
+
+std::vector<S32>
+makeTimeouts() {
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<S32> pick(0, TIMEOUT_RANGE);
+    std::vector<S32> timeouts(TIMER_COUNT);
+    for (auto & timeout : timeouts) {
+        timeout = pick(rng);
+    }
+    return timeouts;
+}
+
+void
+benchEvents(const std::vector<S32> & timeouts) {
+    U64 now = 0;
+    U64 fired = 0;
+    Timer::AsyncTimer timer;
+    timer.clockIs([&now]() { return now; });
+    timer.createTimerFd();
+
+    std::vector<S32> ids;
+    ids.reserve(timeouts.size());
+    auto start = std::chrono::steady_clock::now();
+    for (auto timeout : timeouts) {
+        ids.push_back(timer.createTimerEvent(timeout, false, [&fired]() { fired++; }));
+    }
+    double armNs = nsPerOp(start, timeouts.size());
+
+    // Cancel every other event
+    start = std::chrono::steady_clock::now();
+    for (std::size_t idx = 0; idx < ids.size(); idx += 2) {
+        timer.cancelTimerEvent(ids[idx]);
+    }
+    double cancelNs = nsPerOp(start, ids.size() / 2);
+
+    start = std::chrono::steady_clock::now();
+    while (now <= static_cast<U64>(TIMEOUT_RANGE) + 1) {
+        now += STEP;
+        timer.handleTimerFd();
+    }
+    double expireNs = nsPerOp(start, fired);
+
+    printf("events : arm %6.1f ns  cancel %6.1f ns  expire %6.1f ns/timer"
+           "  (%lu fired)\n", armNs, cancelNs, expireNs, fired);
+}
+
+void
+benchHandles(const std::vector<S32> & timeouts) {
+    U64 now = 0;
+    U64 fired = 0;
+    Timer::AsyncTimer timer;
+    timer.clockIs([&now]() { return now; });
+    timer.createTimerFd();
+
+    std::vector<std::unique_ptr<Timer::TimerHandle>> handles;
+    handles.reserve(timeouts.size());
+    for (std::size_t idx = 0; idx < timeouts.size(); ++idx) {
+        handles.emplace_back(new Timer::TimerHandle(timer));
+        handles.back()->handlerIs([&fired]() { fired++; });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t idx = 0; idx < handles.size(); ++idx) {
+        handles[idx]->reset(timeouts[idx]);
+    }
+    double armNs = nsPerOp(start, handles.size());
+
+    // Keep alive pushes deadline out, lock free for armed handle
+    now += 1000;
+    start = std::chrono::steady_clock::now();
+    for (std::size_t idx = 0; idx < handles.size(); ++idx) {
+        handles[idx]->reset(timeouts[idx]);
+    }
+    double pushNs = nsPerOp(start, handles.size());
+
+    start = std::chrono::steady_clock::now();
+    for (std::size_t idx = 0; idx < handles.size(); idx += 2) {
+        handles[idx]->cancel();
+    }
+    double cancelNs = nsPerOp(start, handles.size() / 2);
+
+    start = std::chrono::steady_clock::now();
+    U64 end = now + TIMEOUT_RANGE + 1;
+    while (now <= end) {
+        now += STEP;
+        timer.handleTimerFd();
+    }
+    double expireNs = nsPerOp(start, fired);
+
+    printf("handles: arm %6.1f ns  push out %6.1f ns  cancel %6.1f ns"
+           "  expire %6.1f ns/timer  (%lu fired)\n",
+           armNs, pushNs, cancelNs, expireNs, fired);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    auto timeouts = makeTimeouts();
+    benchEvents(timeouts);
+    benchHandles(timeouts);
+    return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2014 Raju Kadam <rajulkadam@gmail.com>
+ *
+ * IKEv2 is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IKEv2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <algorithm>
+
+#include "catch.hpp"
+#include "timer.hh"
+
+using Timer::AsyncTimer;
+using Timer::TimerHandle;
+
+namespace {
+
+// Timer driven by hand: clock only moves in runTo() and expired
+// handlers run inline from handleTimerFd()
+struct ManualTimer {
+    ManualTimer() : now(0) {
+        timer.clockIs([this]() { return this->now; });
+        timer.createTimerFd();
+    }
+
+    S32 add(S32 timeout) {
+        return timer.createTimerEvent(timeout, false, [this, timeout]() {
+            this->fired.push_back(timeout);
+            this->firedAt.push_back(this->now);
+        });
+    }
+
+    void runTo(U64 tick) {
+        now = tick;
+        timer.handleTimerFd();
+    }
+
+    AsyncTimer timer;
+    U64 now;
+    // Timeout of every fired event and tick it fired at, in order
+    std::vector<S32> fired;
+    std::vector<U64> firedAt;
+};
+
+// Arm events at tick 0 and step clock to one tick before and then
+// onto each deadline, so event must fire exactly on its deadline
+void
+checkStepwise(std::vector<S32> timeouts) {
+    ManualTimer manual;
+    for (auto timeout : timeouts) {
+        manual.add(timeout);
+    }
+
+    std::sort(timeouts.begin(), timeouts.end());
+    U32 early = 0;
+    U32 wrong = 0;
+    for (std::size_t idx = 0; idx < timeouts.size(); ++idx) {
+        // Timer rounds deadline up past partly over tick
+        U64 deadline = timeouts[idx] + 1;
+        manual.runTo(deadline - 1);
+        early += manual.fired.size() != idx;
+        manual.runTo(deadline);
+        wrong += manual.fired.size() != idx + 1 ||
+                 manual.fired.back() != timeouts[idx] ||
+                 manual.firedAt.back() != deadline;
+    }
+    REQUIRE( early == 0 );
+    REQUIRE( wrong == 0 );
+}
+
+// Jump past every deadline at once, handlers still run in order
+void
+checkJump(std::vector<S32> timeouts) {
+    ManualTimer manual;
+    for (auto timeout : timeouts) {
+        manual.add(timeout);
+    }
+
+    manual.runTo(*std::max_element(timeouts.begin(), timeouts.end()) + 1);
+    std::sort(timeouts.begin(), timeouts.end());
+    REQUIRE( manual.fired == timeouts );
+}
+
+const S32 LEVEL1 = 1 << Timer::WHEEL_BITS;
+const S32 LEVEL2 = 1 << (Timer::WHEEL_BITS * 2);
+const S32 LEVEL3 = 1 << (Timer::WHEEL_BITS * 3);
+
+}  // namespace
+
+TEST_CASE( "Timers cascading from level 1 expire in order", "[timer]" ) {
+    std::vector<S32> timeouts = { 700, 3, LEVEL1 - 1, LEVEL1, 300,
+                                  2 * LEVEL1 - 1, 1000, LEVEL1 + 1 };
+    checkStepwise(timeouts);
+    checkJump(timeouts);
+}
+
+TEST_CASE( "Timers cascading from level 3 expire in order", "[timer]" ) {
+    std::vector<S32> timeouts = { LEVEL3 + 300, LEVEL3 - 1, LEVEL2,
+                                  LEVEL2 + 3 * LEVEL1 + 7, 5,
+                                  2 * LEVEL3 + 12345, LEVEL3 };
+    checkStepwise(timeouts);
+    checkJump(timeouts);
+}
+
+TEST_CASE( "Cancelled events never fire", "[timer]" ) {
+    ManualTimer manual;
+
+    // Three events linked in same level 0 slot, cancel middle one
+    S32 first = manual.add(50);
+    S32 middle = manual.add(50);
+    S32 last = manual.add(50);
+    // And events parked in level 1 and level 2
+    S32 level1 = manual.add(5000);
+    manual.add(LEVEL2 + 10);
+    // Event which has cascaded down from level 1 by the time it is
+    // cancelled
+    S32 cascaded = manual.add(LEVEL1 + 100);
+
+    REQUIRE( first != middle );
+    REQUIRE( middle != last );
+    REQUIRE( manual.timer.cancelTimerEvent(middle) == 0 );
+    REQUIRE( manual.timer.cancelTimerEvent(level1) == 0 );
+    REQUIRE( manual.timer.cancelTimerEvent(middle) == -1 );
+
+    manual.runTo(LEVEL1 + 1);
+    REQUIRE( manual.fired == std::vector<S32>({50, 50}) );
+    REQUIRE( manual.timer.cancelTimerEvent(cascaded) == 0 );
+    // Fired events are gone as well
+    REQUIRE( manual.timer.cancelTimerEvent(first) == -1 );
+
+    manual.runTo(2 * LEVEL2);
+    REQUIRE( manual.fired == std::vector<S32>({50, 50, LEVEL2 + 10}) );
+}
+
+TEST_CASE( "Cancelled handle never fires", "[timer]" ) {
+    ManualTimer manual;
+    U32 fired = 0;
+
+    TimerHandle handle(manual.timer);
+    handle.handlerIs([&fired]() { fired++; });
+    handle.reset(LEVEL1 + 100);
+    REQUIRE( handle.armed() );
+
+    // Cascade handle down to level 0, then cancel it there
+    manual.runTo(LEVEL1 + 1);
+    REQUIRE( fired == 0 );
+    handle.cancel();
+    REQUIRE_FALSE( handle.armed() );
+    manual.runTo(4 * LEVEL1);
+    REQUIRE( fired == 0 );
+
+    // Rearmed handle fires once
+    handle.reset(10);
+    manual.runTo(4 * LEVEL1 + 11);
+    REQUIRE( fired == 1 );
+    REQUIRE_FALSE( handle.armed() );
+}
+
+TEST_CASE( "Timer beyond wheel span is parked and fires on time", "[timer]" ) {
+    ManualTimer manual;
+    const U64 span = 1ULL << (Timer::WHEEL_BITS * Timer::WHEEL_LEVELS);
+    const S32 longest = 0x7fffffff;
+
+    // Keep wheel from catching up so currentTick stays at 0 while
+    // clock moves on. Wheel must then park next event, its deadline
+    // is more than span ticks ahead of wheel
+    manual.add(longest);
+    manual.now = longest + 1000ULL;
+    manual.add(longest);
+    U64 parked = manual.now + longest + 1;
+    REQUIRE( parked >= span );
+
+    manual.runTo(parked - 1);
+    REQUIRE( manual.fired.size() == 1 );
+    REQUIRE( manual.firedAt.back() == parked - 1 );
+
+    manual.runTo(parked);
+    REQUIRE( manual.fired.size() == 2 );
+    REQUIRE( manual.firedAt.back() == parked );
+}